@@ -1,7 +1,6 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <csignal>
 #include <boost/program_options.hpp>
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -26,16 +25,61 @@ std::string manual_text = R"(
 
 )";
 
-void signal_handler(int sig)
+/**
+ * gsc compile <session-file> [-o <bundle-file>]
+ *
+ * Write a precompiled bundle of a session script that can be run
+ * without parsing.
+ */
+int compile_main(int argc, char *argv[])
 {
-  BOOST_LOG_TRIVIAL(debug) << "Received signal: " << sig;
+  po::options_description options("Compile options");
+  options.add_options()
+    ("help,h"            , "print help message")
+    ("output,o"          , po::value<string>(), "bundle file to write. default is the session file name with a .gscb extension.")
+    ("session-file"      , po::value<string>(), "script file to compile.")
+    ;
+
+  po::positional_options_description args;
+  args.add("session-file", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(options).positional(args).run(), vm);
+  po::notify(vm);
+
+  if(vm.count("help") || vm.count("session-file") == 0)
+  {
+    cout << "Usage: gsc compile <session-file> [-o <bundle-file>]" << endl;
+    cout << options << endl;
+    return 0;
+  }
+
+  string session_filename = vm["session-file"].as<string>();
+  string bundle_filename = boost::filesystem::path(session_filename).replace_extension(".gscb").string();
+  if(vm.count("output"))
+    bundle_filename = vm["output"].as<string>();
 
-  BOOST_LOG_TRIVIAL(debug) << "Throwing early_exit_exception";
-  throw early_exit_exception();
+  try {
+    // the script is loaded without a context so that the
+    // template tokens and the #IF/#FOR blocks are kept in the bundle.
+    SessionScript script;
+    script.expand_directives = false;
+    script.load(session_filename);
+    script.save_bundle(bundle_filename);
+  }
+  catch(const std::runtime_error& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+
+  return 0;
 }
 
 int main(int argc, char *argv[])
 {
+  if( argc > 1 && string(argv[1]) == "compile" )
+    return compile_main(argc-1, argv+1);
 
   // process command line arguments
   po::options_description options("Global options");
@@ -47,6 +91,13 @@ int main(int argc, char *argv[])
     ("no-monitor"        , "disable monitor server.")
     ("auto,a"            , "run script in auto-pilot without waiting for user input. useful for testing.")
     ("auto-pause"        , po::value<int>()->default_value(100), "number of milliseconds to pause between key presses in auto-pilot.")
+    ("stdout-buffer"     , po::value<size_t>()->default_value(1024*1024), "number of bytes of output that may be waiting to be written to the terminal.")
+    ("stdout-policy"     , po::value<string>()->default_value("block"), "what to do when the terminal can't keep up and the stdout buffer is full. 'block' waits for the terminal, 'drop' skips output and repaints the current screen when the terminal catches up, 'spill' buffers the output in a temporary file.")
+    ("broadcast-unix"    , po::value<vector<string>>()->composing(), "may be given multiple times. mirror the session to viewers that connect to a Unix socket at this path (e.g. with socat or nc -U).")
+    ("broadcast-tcp"     , po::value<vector<int>>()->composing(), "may be given multiple times. mirror the session to viewers that connect to this TCP port on localhost.")
+    ("broadcast-buffer"  , po::value<size_t>()->default_value(1024*1024), "number of bytes of output kept for broadcast viewers that are behind. viewers that fall further behind are sent a repaint of the current screen.")
+    ("slave-high-water"  , po::value<size_t>()->default_value(4096), "number of bytes that may be waiting to be written to the shell before typing is paused.")
+    ("expect-timeout"    , po::value<int>()->default_value(10000), "number of milliseconds that #EXPECT and #EXPECT_SCREEN wait for output to match. gsc exits with status 4 if an expectation is not met.")
     ("setup-script"      , po::value<vector<string>>()->composing(), "may be given multiple times. executables that will be ran before the session starts.")
     ("cleanup-script"    , po::value<vector<string>>()->composing(), "may be given multiple times. executable that will be ran after the session finishes.")
     ("setup-command"     , po::value<vector<string>>()->composing(), "may be given multiple times. command that will be passed to the session shell before any script lines.")
@@ -54,8 +105,21 @@ int main(int argc, char *argv[])
     ("context-variable,v", po::value<vector<string>>()->composing(), "add context variable for string formatting.")
     ("key-binding,k"     , po::value<vector<string>>()->composing(), "add keybinding in k=action format. only integer keycodes are supported. example: '127:InsertMode_BackOneCharacter' will set backspace to backup one character in insert mode (default behavior)")
     ("list-key-bindings"  , "list all default keybindings.")
+    ("filter"            , po::value<vector<string>>()->composing(), "may be given multiple times. filter rule for the shell output. rules are 'redact:TEXT', 'redact-regex:REGEX', 'suppress:REGEX' (drop matching lines), and 'replace:REGEX=>TEXT'. output is filtered if any rules are given.")
+    ("filter-file"       , po::value<vector<string>>()->composing(), "may be given multiple times. file containing filter rules, one per line.")
+    ("filter-mask"       , po::value<string>()->default_value("****"), "text that redacted output is replaced with.")
+    ("cache"             , "cache loaded scripts, so that later runs with the same script and context don't need to parse and render it. cached scripts are rendered, so they contain the context variables. the cache is only readable by the user, and unused entries are removed after 30 days or when it grows past 64 MB.")
+    ("cache-dir"         , po::value<string>(), "directory that loaded scripts are cached in. default is $XDG_CACHE_HOME/gsc or ~/.cache/gsc. implies --cache.")
+    ("load-threads"      , po::value<unsigned int>(), "number of threads used to parse large scripts. default is the number of cores.")
     ("config-file"       , po::value<vector<string>>()->composing(), "config file to read additional options from.")
     ("log-file"          , po::value<string>(), "log file name.")
+    ("stats-file"        , po::value<string>(), "write latency and throughput stats to this file (JSON) when the session ends.")
+    ("checkpoint"        , "save the position in the script while the session runs, so that it can be resumed with --resume if gsc or the terminal dies. the checkpoint contains the context and captured variables, and is removed when gsc exits.")
+    ("checkpoint-file"   , po::value<string>(), "file that checkpoints are written to and resumed from. default is a file named after the session file in $XDG_STATE_HOME/gsc or ~/.local/state/gsc. implies --checkpoint.")
+    ("checkpoint-interval", po::value<int>()->default_value(2000), "number of milliseconds between checkpoints. 0 disables checkpoints.")
+    ("start-at"          , po::value<string>(), "line number or label to start the session at. the lines before it are sent to the shell without the typing effect, except for lines marked with #NOREPLAY.")
+    ("fast-forward-hide-output", "turn stdout off while lines are sent by --start-at, --resume, or the FastForward command.")
+    ("resume"            , "resume a session from its checkpoint. the lines before the checkpoint are sent to the shell without the typing effect, except for lines marked with #NOREPLAY.")
     ("session-file"      , po::value<string>(), "script file to run.")
     ;
 
@@ -82,6 +146,7 @@ int main(int argc, char *argv[])
   if(vm.count("session-file") == 0)
   {
     cout << "Usage: " << argv[0] << " [OPTIONS] <session-file>" << endl;
+    cout << "       " << argv[0] << " compile <session-file> [-o <bundle-file>]" << endl;
     cout << options << endl;
     exit(0);
   }
@@ -90,7 +155,7 @@ int main(int argc, char *argv[])
   string session_filename = vm["session-file"].as<string>();
 
 
-  if( !filesystem::exists(session_filename) )
+  if( !boost::filesystem::exists(session_filename) )
   {
     std::cerr << "No such file '"<<session_filename<<"'"<<std::endl;
     exit(1);
@@ -152,7 +217,7 @@ int main(int argc, char *argv[])
     {
       string configfile = render( file, c );
       BOOST_LOG_TRIVIAL(debug) << "Checking for '" << configfile << "' to load addition options.";
-      if( filesystem::exists(configfile) )
+      if( boost::filesystem::exists(configfile) )
       {
         BOOST_LOG_TRIVIAL(debug) << "\tFound. Loading now.";
 
@@ -185,12 +250,6 @@ int main(int argc, char *argv[])
 
 
   // create and configure the session that will run the script
-  if( std::signal(SIGINT ,signal_handler) == SIG_ERR 
-   || std::signal(SIGQUIT,signal_handler) == SIG_ERR )
-  {
-    throw std::runtime_error("Could not setup signal handler");
-  }
-
   int monitor_port = vm["monitor-port"].as<int>();
   if( vm.count("no-monitor") )
     monitor_port = -1;
@@ -203,8 +262,93 @@ int main(int argc, char *argv[])
     session.state.auto_pilot_mode  = AutoPilotMode::FULL;
     session.state.auto_pilot_pause_milliseconds = vm["auto-pause"].as<int>();
   }
+  if( vm.count("stats-file") > 0 )
+    session.stats_filename = vm["stats-file"].as<string>();
+  session.state.expect_timeout_milliseconds = vm["expect-timeout"].as<int>();
+  session.slave_writer.high_water_mark = vm["slave-high-water"].as<size_t>();
+  {
+    string policy = vm["stdout-policy"].as<string>();
+    OverflowPolicy p = OverflowPolicy::BLOCK;
+    if( policy == "drop" )
+      p = OverflowPolicy::DROP;
+    else if( policy == "spill" )
+      p = OverflowPolicy::SPILL;
+    else if( policy != "block" )
+    {
+      std::cerr << "Unknown stdout policy '"<<policy<<"'. Should be one of block, drop, or spill.\r"<<std::endl;
+      return 1;
+    }
+    session.stdout_ring.configure(vm["stdout-buffer"].as<size_t>(), p);
+  }
+  if( vm.count("checkpoint-file") > 0 )
+  {
+    session.checkpoint_filename = vm["checkpoint-file"].as<string>();
+  }
+  else if( vm.count("checkpoint") > 0 || vm.count("resume") > 0 )
+  {
+    // checkpoints contain the context, so they are kept out of the
+    // session file's directory, which may be shared
+    string state_dir;
+    if( getenv("XDG_STATE_HOME") != NULL && string(getenv("XDG_STATE_HOME")) != "" )
+      state_dir = string(getenv("XDG_STATE_HOME")) + "/gsc";
+    else if( getenv("HOME") != NULL )
+      state_dir = string(getenv("HOME")) + "/.local/state/gsc";
+    if( state_dir == "" )
+    {
+      std::cerr << "Could not find a directory for checkpoints. Set XDG_STATE_HOME or use --checkpoint-file.\r"<<std::endl;
+      return 1;
+    }
+    try {
+      create_private_directory(state_dir);
+    }catch(const std::runtime_error& e){
+      std::cerr << e.what() << "\r" << std::endl;
+      return 1;
+    }
+    session.checkpoint_filename = Checkpoint::default_filename(state_dir, session_filename);
+  }
+  session.state.checkpoint_interval_milliseconds = vm["checkpoint-interval"].as<int>();
+  if( vm.count("fast-forward-hide-output") > 0 )
+    session.state.fast_forward_hide_output = true;
+  if( vm.count("start-at") > 0 )
+  {
+    if( vm.count("resume") > 0 )
+    {
+      std::cerr << "--start-at and --resume can't be used together.\r"<<std::endl;
+      return 1;
+    }
+    session.start_at = vm["start-at"].as<string>();
+  }
+  if( vm.count("resume") > 0 )
+  {
+    try {
+      Checkpoint checkpoint = Checkpoint::load(session.checkpoint_filename);
+      if( checkpoint.script != boost::filesystem::canonical(session_filename).string() )
+      {
+        std::cerr << "Checkpoint '"<<session.checkpoint_filename<<"' was written for a different session file ("<<checkpoint.script<<").\r"<<std::endl;
+        return 1;
+      }
+      // variables given on the command line take precedence
+      for( auto &v : checkpoint.context )
+        c.insert(v);
+      session.resume_from = checkpoint;
+    }catch(const std::runtime_error& e){
+      std::cerr << e.what() << "\r" << std::endl;
+      return 1;
+    }
+  }
   session.script.context = c;
   session.script.render();
+  if( vm.count("cache") > 0 || vm.count("cache-dir") > 0 )
+  {
+    if( vm.count("cache-dir") > 0 )
+      session.script.cache_dir = vm["cache-dir"].as<string>();
+    else if( getenv("XDG_CACHE_HOME") != NULL && string(getenv("XDG_CACHE_HOME")) != "" )
+      session.script.cache_dir = string(getenv("XDG_CACHE_HOME")) + "/gsc";
+    else if( getenv("HOME") != NULL )
+      session.script.cache_dir = string(getenv("HOME")) + "/.cache/gsc";
+  }
+  if( vm.count("load-threads") > 0 )
+    session.script.load_threads = vm["load-threads"].as<unsigned int>();
 
   if( vm.count("setup-command") > 0 )
   {
@@ -218,6 +362,53 @@ int main(int argc, char *argv[])
       session.cleanup_commands.push_back(s);
   }
 
+  {
+    vector<string> rules;
+    if( vm.count("filter") > 0 )
+      rules = vm["filter"].as<vector<string>>();
+    if( vm.count("filter-file") > 0 )
+    {
+      for( auto &f : vm["filter-file"].as<vector<string>>() )
+      {
+        ifstream in(f.c_str());
+        if( !in )
+        {
+          std::cerr << "Could not open filter file '"<<f<<"'.\r"<<std::endl;
+          return 1;
+        }
+        string rule;
+        while( getline(in,rule) )
+          if( rule.size() > 0 && rule[0] != '#' )
+            rules.push_back(rule);
+      }
+    }
+
+    session.output_filter.mask = vm["filter-mask"].as<string>();
+    try {
+      for( auto &r : rules )
+        session.output_filter.add_rule(r);
+    }catch(const std::runtime_error& e){
+      std::cerr << e.what() << "\r" << std::endl;
+      return 1;
+    }
+    if( !session.output_filter.empty() )
+      session.state.output_mode = OutputMode::FILTERED;
+  }
+
+  session.broadcast.capacity = vm["broadcast-buffer"].as<size_t>();
+  try {
+    if( vm.count("broadcast-unix") > 0 )
+      for( auto &path : vm["broadcast-unix"].as<vector<string>>() )
+        session.broadcast.listen_unix(path);
+    if( vm.count("broadcast-tcp") > 0 )
+      for( auto &port : vm["broadcast-tcp"].as<vector<int>>() )
+        session.broadcast.listen_tcp(port);
+  }catch(const std::runtime_error& e){
+    std::cerr << e.what() << "\r" << std::endl;
+    return 1;
+  }
+  session.broadcast.start();
+
   if( vm.count("key-binding") > 0 )
   {
     for( auto s : vm["key-binding"].as<vector<string>>() )
@@ -242,6 +433,7 @@ int main(int argc, char *argv[])
 
 
 
+  int rc = 0;
   try {
     // run setup scripts
     for( auto &s : setup_scripts )
@@ -262,7 +454,7 @@ int main(int argc, char *argv[])
     }
 
     // run the session
-    session.run();
+    rc = session.run();
 
     // run cleanup scripts
     for( auto &s : cleanup_scripts )
@@ -286,16 +478,19 @@ int main(int argc, char *argv[])
   catch(const normal_exit_exception& e)
   {
     BOOST_LOG_TRIVIAL(debug) << "Exiting normally.";
-    return 0;
+    return session.exit_code();
   }
   catch(const early_exit_exception& e)
   {
     BOOST_LOG_TRIVIAL(debug) << "Exiting early.";
-    return 1;
+    // exit like the shell would if gsc was killed by a signal
+    int sig = session.state.interrupt_signal;
+    return sig > 0 ? 128 + sig : 1;
   }
   catch(const std::runtime_error& e)
   {
     BOOST_LOG_TRIVIAL(error) << "A runtime error occurred: " << e.what();
+    std::cerr << e.what() << "\r" << std::endl;
     return 2;
   }
   catch(...)
@@ -305,5 +500,5 @@ int main(int argc, char *argv[])
   }
 
 
-  return 0;
+  return rc;
 }
@@ -0,0 +1,354 @@
+#include "./Broadcast.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+BroadcastHub::BroadcastHub()
+{
+  if(pipe2(wakeup, O_NONBLOCK | O_CLOEXEC) != 0)
+    throw std::runtime_error("Could not create broadcast wakeup pipe.");
+}
+
+BroadcastHub::~BroadcastHub()
+{
+  stop();
+  for(auto& v : viewers)
+    ::close(v.fd);
+  for(int fd : listeners)
+    ::close(fd);
+  for(auto& path : unix_paths)
+    unlink(path.c_str());
+  ::close(wakeup[0]);
+  ::close(wakeup[1]);
+}
+
+void BroadcastHub::listen_unix(const std::string& path)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path))
+    throw std::runtime_error("Broadcast socket path '"+path+"' is too long");
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+    throw std::runtime_error("Could not create broadcast socket: "+std::string(strerror(errno)));
+  // remove a socket left behind by a previous session
+  unlink(path.c_str());
+  if(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 16) != 0)
+  {
+    std::string error = strerror(errno);
+    ::close(fd);
+    throw std::runtime_error("Could not listen on broadcast socket '"+path+"': "+error);
+  }
+  listeners.push_back(fd);
+  unix_paths.push_back(path);
+}
+
+void BroadcastHub::listen_tcp(int port)
+{
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  // viewers are only accepted from the local machine
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+    throw std::runtime_error("Could not create broadcast socket: "+std::string(strerror(errno)));
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 16) != 0)
+  {
+    std::string error = strerror(errno);
+    ::close(fd);
+    throw std::runtime_error("Could not listen on broadcast port "+std::to_string(port)+": "+error);
+  }
+  listeners.push_back(fd);
+}
+
+bool BroadcastHub::active() const
+{
+  return !listeners.empty();
+}
+
+void BroadcastHub::start()
+{
+  if(!active() || running)
+    return;
+  running = true;
+  thread = std::thread(&BroadcastHub::run, this);
+}
+
+void BroadcastHub::stop()
+{
+  if(!running)
+    return;
+  running = false;
+  wakeup_pending = false;
+  wake();
+  if(thread.joinable())
+    thread.join();
+}
+
+void BroadcastHub::publish(const char* data, size_t size)
+{
+  if(size == 0)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // new viewers start from a repaint, so output is only kept while someone is watching
+    if(viewers.empty())
+    {
+      end += size;
+      return;
+    }
+
+    chunks.push_back({end, std::make_shared<const std::string>(data, size)});
+    end += size;
+    bytes += size;
+    while(bytes > capacity && chunks.size() > 1)
+    {
+      bytes -= chunks.front().data->size();
+      chunks.pop_front();
+    }
+
+    uint64_t oldest = chunks.front().start;
+    for(auto& v : viewers)
+    {
+      if(!v.waiting_for_resync && v.position < oldest)
+      {
+        v.waiting_for_resync = true;
+        v.repaint.reset();
+      }
+    }
+  }
+  request_resync();
+  wake();
+}
+
+bool BroadcastHub::needs_resync() const
+{
+  return resync_wanted;
+}
+
+void BroadcastHub::resync(const std::string& repaint)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    resync_wanted = false;
+    auto shared = std::make_shared<const std::string>(repaint);
+    for(auto& v : viewers)
+    {
+      if(!v.waiting_for_resync)
+        continue;
+      v.waiting_for_resync = false;
+      v.repaint = shared;
+      v.repaint_offset = 0;
+      v.position = end;
+    }
+  }
+  wake();
+}
+
+size_t BroadcastHub::num_viewers() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return viewers.size();
+}
+
+void BroadcastHub::wake()
+{
+  // one byte in the pipe is enough to wake the hub thread
+  if(wakeup_pending.exchange(true))
+    return;
+  char c = 0;
+  if(write(wakeup[1], &c, 1) < 0)
+    wakeup_pending = false;
+}
+
+void BroadcastHub::request_resync()
+{
+  // called with viewers possibly waiting, checks under the lock
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool waiting = std::any_of(viewers.begin(), viewers.end(), [](const Viewer& v) { return v.waiting_for_resync; });
+    if(!waiting || resync_wanted)
+      return;
+    resync_wanted = true;
+  }
+  if(resync_wakeup_fd >= 0)
+  {
+    char c = 0;
+    if(write(resync_wakeup_fd, &c, 1) < 0)
+    {
+      // the pipe is full, so the publisher will wake up anyway
+    }
+  }
+}
+
+bool BroadcastHub::has_output(const Viewer& viewer) const
+{
+  if(viewer.waiting_for_resync)
+    return false;
+  return viewer.repaint || viewer.position < end;
+}
+
+void BroadcastHub::accept_viewer(int listener)
+{
+  for(;;)
+  {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0)
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    Viewer v;
+    v.fd = fd;
+    viewers.push_back(v);
+  }
+}
+
+bool BroadcastHub::write_viewer(Viewer& viewer)
+{
+  // called with the mutex held
+  const int max_iov = 64;
+  iovec iov[max_iov];
+  int count = 0;
+
+  if(viewer.repaint)
+  {
+    iov[count].iov_base = const_cast<char*>(viewer.repaint->data() + viewer.repaint_offset);
+    iov[count].iov_len = viewer.repaint->size() - viewer.repaint_offset;
+    ++count;
+  }
+
+  // chunks are sorted by start, so the viewer's chunk can be found with a binary search
+  auto it = std::upper_bound(chunks.begin(), chunks.end(), viewer.position,
+                             [](uint64_t pos, const Chunk& c) { return pos < c.start; });
+  if(it != chunks.begin())
+    --it;
+  for(; it != chunks.end() && count < max_iov; ++it)
+  {
+    uint64_t chunk_end = it->start + it->data->size();
+    if(chunk_end <= viewer.position)
+      continue;
+    size_t offset = viewer.position > it->start ? viewer.position - it->start : 0;
+    iov[count].iov_base = const_cast<char*>(it->data->data() + offset);
+    iov[count].iov_len = it->data->size() - offset;
+    ++count;
+  }
+  if(count == 0)
+    return true;
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  // MSG_NOSIGNAL so that a viewer going away doesn't raise SIGPIPE
+  ssize_t rc = sendmsg(viewer.fd, &msg, MSG_NOSIGNAL);
+  if(rc < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+  size_t written = rc;
+  if(viewer.repaint)
+  {
+    size_t n = std::min(written, viewer.repaint->size() - viewer.repaint_offset);
+    viewer.repaint_offset += n;
+    written -= n;
+    if(viewer.repaint_offset == viewer.repaint->size())
+      viewer.repaint.reset();
+  }
+  viewer.position += written;
+  return true;
+}
+
+void BroadcastHub::run()
+{
+  std::vector<pollfd> fds;
+  char discard[4096];
+  while(running)
+  {
+    fds.clear();
+    fds.push_back({wakeup[0], POLLIN, 0});
+    for(int fd : listeners)
+      fds.push_back({fd, POLLIN, 0});
+    size_t first_viewer = fds.size();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for(auto& v : viewers)
+        fds.push_back({v.fd, static_cast<short>(POLLIN | (has_output(v) ? POLLOUT : 0)), 0});
+    }
+
+    int rc = poll(fds.data(), fds.size(), 1000);
+    if(rc < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+
+    if(fds[0].revents & POLLIN)
+    {
+      wakeup_pending = false;
+      while(read(wakeup[0], discard, sizeof(discard)) > 0) { }
+    }
+    for(size_t i = 1; i < first_viewer; ++i)
+      if(fds[i].revents & POLLIN)
+        accept_viewer(fds[i].fd);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      // fds only holds the viewers that existed when poll was called,
+      // which are at the front of the list.
+      size_t n = fds.size() - first_viewer;
+      std::vector<bool> closed(viewers.size(), false);
+      for(size_t i = 0; i < n; ++i)
+      {
+        auto& v = viewers[i];
+        short revents = fds[first_viewer + i].revents;
+        if(revents & (POLLERR | POLLNVAL))
+          closed[i] = true;
+        else if(revents & (POLLIN | POLLHUP))
+        {
+          // anything a viewer types is ignored
+          ssize_t r = recv(v.fd, discard, sizeof(discard), MSG_DONTWAIT);
+          if(r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            closed[i] = true;
+        }
+        if(!closed[i] && (revents & POLLOUT))
+          closed[i] = !write_viewer(v);
+      }
+      for(size_t i = viewers.size(); i-- > 0;)
+      {
+        if(closed[i])
+        {
+          ::close(viewers[i].fd);
+          viewers.erase(viewers.begin() + i);
+        }
+      }
+
+      // output that every viewer has been sent is no longer needed
+      uint64_t oldest = end;
+      for(auto& v : viewers)
+        oldest = std::min(oldest, v.waiting_for_resync ? end : v.position);
+      while(!chunks.empty() && chunks.front().start + chunks.front().data->size() <= oldest)
+      {
+        bytes -= chunks.front().data->size();
+        chunks.pop_front();
+      }
+    }
+    request_resync();
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef Broadcast_hpp
+#define Broadcast_hpp
+
+/** @file Broadcast.hpp
+  * @brief Mirrors the session output to viewers on Unix and TCP sockets.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Sends the session output to any number of viewers.
+ *
+ * Published output is kept in a ring of reference-counted chunks. Each
+ * viewer has its own position in the ring and is written to by the hub's
+ * thread with non-blocking vectored writes straight from the shared chunks,
+ * so nothing is copied per viewer and a slow viewer never holds back the
+ * session.
+ *
+ * A viewer that falls so far behind that its position has been evicted
+ * from the ring (and a viewer that has just connected) is resynced: the
+ * hub asks for a repaint of the current screen (needs_resync()), which
+ * the publisher provides with resync(). The viewer is sent the repaint
+ * and then continues with the output published after it.
+ */
+class BroadcastHub
+{
+  public:
+    // number of bytes of output kept for viewers that are behind
+    size_t capacity = 1024*1024;
+    // written to when a resync is needed, to wake up the publisher
+    int resync_wakeup_fd = -1;
+
+    BroadcastHub();
+    ~BroadcastHub();
+
+    // these throw std::runtime_error if the socket can't be setup
+    void listen_unix(const std::string& path);
+    void listen_tcp(int port);
+
+    bool active() const;
+    void start();
+    void stop();
+
+    void publish(const char* data, size_t size);
+    bool needs_resync() const;
+    void resync(const std::string& repaint);
+
+    size_t num_viewers() const;
+
+  protected:
+    struct Chunk
+    {
+      // position of the first byte in the output stream
+      uint64_t start;
+      std::shared_ptr<const std::string> data;
+    };
+
+    struct Viewer
+    {
+      int fd;
+      uint64_t position = 0;
+      bool waiting_for_resync = true;
+      std::shared_ptr<const std::string> repaint;
+      size_t repaint_offset = 0;
+    };
+
+    mutable std::mutex mutex;
+    std::deque<Chunk> chunks;
+    uint64_t end = 0;
+    size_t bytes = 0;
+    std::vector<Viewer> viewers;
+    std::atomic<bool> resync_wanted{false};
+
+    std::vector<int> listeners;
+    std::vector<std::string> unix_paths;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+    int wakeup[2] = {-1, -1};
+    std::atomic<bool> wakeup_pending{false};
+
+    void run();
+    void wake();
+    void request_resync();
+    void accept_viewer(int listener);
+    // returns false if the viewer has gone away
+    bool write_viewer(Viewer& viewer);
+    bool has_output(const Viewer& viewer) const;
+};
+
+#endif // include protector
@@ -8,6 +8,7 @@
   */
 
 #include<map>
+#include<string>
 struct CharTree
 {
   protected:
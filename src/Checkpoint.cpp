@@ -0,0 +1,95 @@
+#include "./Checkpoint.hpp"
+
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./ScriptBundle.hpp"
+
+void Checkpoint::save(const std::string& filename) const
+{
+  boost::property_tree::ptree t;
+  t.put("script", script);
+  t.put("line", line);
+  t.put("input mode", static_cast<int>(input_mode));
+  t.put("auto pilot mode", static_cast<int>(auto_pilot_mode));
+  t.put("output mode", static_cast<int>(output_mode));
+  for(auto section : {std::make_pair("context", &context), std::make_pair("captured", &captured)})
+  {
+    boost::property_tree::ptree c;
+    for(auto& v : *section.second)
+      c.push_back(std::make_pair(v.first, boost::property_tree::ptree(v.second)));
+    t.add_child(section.first, c);
+  }
+
+  std::stringstream s;
+  write_json(s, t);
+  std::string data = s.str();
+
+  std::string tmp = filename + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0)
+    throw std::runtime_error("Could not open "+tmp+" for writing");
+  size_t written = 0;
+  while(written < data.size())
+  {
+    ssize_t rc = write(fd, data.data() + written, data.size() - written);
+    if(rc < 0)
+    {
+      close(fd);
+      unlink(tmp.c_str());
+      throw std::runtime_error("Could not write checkpoint "+tmp);
+    }
+    written += rc;
+  }
+  // the data must be on disk before the rename, or a crash could leave an empty file
+  fsync(fd);
+  close(fd);
+  if(rename(tmp.c_str(), filename.c_str()) != 0)
+  {
+    unlink(tmp.c_str());
+    throw std::runtime_error("Could not write checkpoint "+filename);
+  }
+}
+
+Checkpoint Checkpoint::load(const std::string& filename)
+{
+  boost::property_tree::ptree t;
+  try {
+    read_json(filename, t);
+  } catch(const boost::property_tree::json_parser_error& e) {
+    throw std::runtime_error("Could not read checkpoint "+filename+": "+e.message());
+  }
+
+  Checkpoint checkpoint;
+  try {
+    checkpoint.script = t.get<std::string>("script");
+    checkpoint.line = t.get<size_t>("line");
+    checkpoint.input_mode = static_cast<UserInputMode>(t.get<int>("input mode"));
+    checkpoint.auto_pilot_mode = static_cast<AutoPilotMode>(t.get<int>("auto pilot mode"));
+    checkpoint.output_mode = static_cast<OutputMode>(t.get<int>("output mode"));
+    for(auto& v : t.get_child("context", boost::property_tree::ptree()))
+      checkpoint.context[v.first] = v.second.data();
+    for(auto& v : t.get_child("captured", boost::property_tree::ptree()))
+      checkpoint.captured[v.first] = v.second.data();
+  } catch(const boost::property_tree::ptree_error& e) {
+    throw std::runtime_error("Checkpoint "+filename+" is corrupt: "+e.what());
+  }
+  return checkpoint;
+}
+
+std::string Checkpoint::default_filename(const std::string& directory, const std::string& script)
+{
+  boost::filesystem::path path = boost::filesystem::weakly_canonical(script);
+  std::string key = path.string();
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(bundle_hash(key.data(), key.size())));
+  return (boost::filesystem::path(directory) / (path.filename().string() + "-" + hash + ".checkpoint")).string();
+}
@@ -0,0 +1,45 @@
+#ifndef Checkpoint_hpp
+#define Checkpoint_hpp
+
+/** @file Checkpoint.hpp
+  * @brief Saved position of a session, used by --resume.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <string>
+
+#include "./Enums.hpp"
+#include "./Utils.hpp"
+
+/**
+ * Where a session was and how it was being run. Written periodically
+ * while a session runs so that it can be resumed if gsc or the terminal
+ * dies.
+ */
+struct Checkpoint
+{
+  // canonical path of the session file
+  std::string script;
+  // index of the first line that has not been run
+  size_t line = 0;
+  UserInputMode input_mode = UserInputMode::INSERT;
+  AutoPilotMode auto_pilot_mode = AutoPilotMode::FULL;
+  OutputMode output_mode = OutputMode::ALL;
+  // context the script was rendered with
+  Context context;
+  // variables captured from the output with #CAPTURE
+  Context captured;
+
+  // the checkpoint is written to a temporary file that is renamed over
+  // filename, so a crash never leaves a partial checkpoint behind.
+  // the file is only readable by the user, since it contains the context.
+  // both throw std::runtime_error.
+  void save(const std::string& filename) const;
+  static Checkpoint load(const std::string& filename);
+  // name of the checkpoint file for a session file in directory. the name
+  // is unique for each session file, so sessions don't share checkpoints.
+  static std::string default_filename(const std::string& directory, const std::string& script);
+};
+
+#endif // include protector
@@ -8,6 +8,9 @@
   */
 
 
+#include <optional>
+#include <string>
+#include <string_view>
 #include <boost/spirit/home/x3.hpp>
 
 namespace {
@@ -15,6 +18,8 @@ namespace {
 }
 struct CommandParser 
 {
+  using Match = std::optional< std::pair< std::string, std::string > >;
+
   sx3::symbols<std::string> commands;
   CommandParser()
   {
@@ -38,9 +43,19 @@ struct CommandParser
     commands.add("INCLUDE", "INCLUDE");
     commands.add("INC", "INCLUDE");
     commands.add("WAIT", "WAIT");
+    commands.add("EXPECT", "EXPECT");
+    commands.add("EXPECT_SCREEN", "EXPECT_SCREEN");
+    commands.add("LABEL", "LABEL");
+    commands.add("NOREPLAY", "NOREPLAY");
+    commands.add("IF", "IF");
+    commands.add("ELSE", "ELSE");
+    commands.add("ENDIF", "ENDIF");
+    commands.add("FOR", "FOR");
+    commands.add("ENDFOR", "ENDFOR");
+    commands.add("CAPTURE", "CAPTURE");
   }
 
-  std::optional< std::pair< std::string, std::string > > parse( std::string line )
+  Match parse( std::string_view line )
   {
     std::string command, argument;
 
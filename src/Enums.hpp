@@ -11,6 +11,7 @@ enum class UserInputMode {COMMAND, INSERT, PASSTHROUGH, AUTO };
 enum class LineStatus {EMPTY, INPROCESS, LOADED, RELOAD};
 enum class OutputMode {ALL, NONE, FILTERED};
 enum class AutoPilotMode { SEMI, FULL };
+enum class OverflowPolicy { BLOCK, DROP, SPILL };
 
 enum class CommandModeActions {
                                 SwitchToInsertMode
@@ -24,6 +25,12 @@ enum class CommandModeActions {
                               , TurnOffStdout
                               , TurnOnStdout
                               , ToggleStdout
+                              , GotoLine
+                              , GotoLabel
+                              , SearchForward
+                              , SearchBackward
+                              , SearchNext
+                              , FastForward
                               , None
                               };
 enum class InsertModeActions {
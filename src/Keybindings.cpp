@@ -34,6 +34,12 @@ Keybindings::Keybindings()
   add_name(TurnOffStdout);
   add_name(TurnOnStdout);
   add_name(ToggleStdout);
+  add_name(GotoLine);
+  add_name(GotoLabel);
+  add_name(SearchForward);
+  add_name(SearchBackward);
+  add_name(SearchNext);
+  add_name(FastForward);
   add_name(None);
 
   assert(CommandModeActionNames.size() == (int)CommandModeActions::None+1);
@@ -83,6 +89,12 @@ Keybindings::Keybindings()
   add('s',  CommandModeActions::TurnOffStdout);
   add('v',  CommandModeActions::TurnOnStdout);
   add('o',  CommandModeActions::ToggleStdout);
+  add('g',  CommandModeActions::GotoLine);
+  add('\'', CommandModeActions::GotoLabel);
+  add('/',  CommandModeActions::SearchForward);
+  add('?',  CommandModeActions::SearchBackward);
+  add('n',  CommandModeActions::SearchNext);
+  add('F',  CommandModeActions::FastForward);
 
   add('', PassthroughModeActions::SwitchToCommandMode);
 
@@ -0,0 +1,532 @@
+#include "./OutputFilter.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+void OutputFilter::add_rule(const std::string& rule)
+{
+  size_t sep = rule.find(':');
+  if(sep == std::string::npos)
+    throw std::runtime_error("Output filter rule '"+rule+"' should have the form kind:pattern");
+  std::string kind = rule.substr(0, sep);
+  std::string arg = rule.substr(sep + 1);
+
+  try {
+    if(kind == "redact")
+      return add_literal(arg);
+    if(kind == "redact-regex")
+      return add_regex_redaction(arg);
+    if(kind == "suppress")
+      return add_suppression(arg);
+    if(kind == "replace")
+    {
+      size_t arrow = arg.find("=>");
+      if(arrow == std::string::npos)
+        throw std::runtime_error("Output filter rule '"+rule+"' should have the form replace:REGEX=>TEXT");
+      return add_substitution(arg.substr(0, arrow), arg.substr(arrow + 2));
+    }
+  } catch(const std::regex_error& e) {
+    throw std::runtime_error("Invalid regex in output filter rule '"+rule+"': "+e.what());
+  }
+
+  throw std::runtime_error("Unknown output filter rule '"+rule+"'");
+}
+
+void OutputFilter::add_literal(const std::string& text)
+{
+  if(text.empty())
+    return;
+  literals.push_back(text);
+  unsigned char first = text[0];
+  if(!first_bytes[first])
+    first_byte_list += text[0];
+  first_bytes[first] = true;
+}
+
+void OutputFilter::add_regex_redaction(const std::string& regex)
+{
+  add_substitution(regex, mask);
+}
+
+void OutputFilter::add_suppression(const std::string& regex)
+{
+  suppressions.push_back(std::regex(regex));
+}
+
+void OutputFilter::add_substitution(const std::string& regex, const std::string& replacement)
+{
+  std::regex re(regex);
+  try {
+    partial_patterns.push_back(boost::regex(regex));
+  } catch(const boost::regex_error& e) {
+    throw std::runtime_error("Unsupported regex '"+regex+"' in output filter rule: "+e.what());
+  }
+  substitutions.push_back(std::make_pair(re, replacement));
+}
+
+bool OutputFilter::empty() const
+{
+  return literals.empty() && suppressions.empty() && substitutions.empty();
+}
+
+bool OutputFilter::pending() const
+{
+  return !held.empty() || !line.empty();
+}
+
+/**
+ * Filter a chunk of output. The filtered output is appended to out.
+ *
+ * Escape sequences are collected in escape until they are complete, so a
+ * sequence that is split between chunks is handled as one.
+ */
+void OutputFilter::process(const char* data, size_t size, std::string& out)
+{
+  size_t run_start = 0;
+  size_t i = 0;
+  while(i < size)
+  {
+    if(escape_state == EscapeState::GROUND)
+    {
+      // skip to the next escape sequence
+      const void* esc = std::memchr(data + i, '\x1b', size - i);
+      if(esc == nullptr)
+      {
+        i = size;
+        break;
+      }
+      i = static_cast<const char*>(esc) - data;
+      if(i > run_start)
+        filter_text(data + run_start, i - run_start, out);
+      run_start = i;
+      escape_state = EscapeState::ESCAPE;
+      ++i;
+      continue;
+    }
+
+    unsigned char c = data[i++];
+    bool done = false;
+    switch(escape_state)
+    {
+      case EscapeState::ESCAPE:
+        if(c == '[')
+          escape_state = EscapeState::CSI;
+        else if(c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+          escape_state = EscapeState::STRING;
+        else if(c >= 0x20 && c <= 0x2f)
+          escape_state = EscapeState::INTERMEDIATE;
+        else
+          done = true;
+        break;
+      case EscapeState::INTERMEDIATE:
+        done = !(c >= 0x20 && c <= 0x2f);
+        break;
+      case EscapeState::CSI:
+        done = c >= 0x40 && c <= 0x7e;
+        break;
+      case EscapeState::STRING:
+        if(c == '\x07')
+          done = true;
+        else if(c == '\x1b')
+          escape_state = EscapeState::STRING_ESCAPE;
+        break;
+      case EscapeState::STRING_ESCAPE:
+        if(c == '\\')
+          done = true;
+        else
+          escape_state = EscapeState::STRING;
+        break;
+      case EscapeState::GROUND:
+        break;
+    }
+    if(done)
+    {
+      escape.append(data + run_start, i - run_start);
+      end_escape(out);
+      run_start = i;
+      escape_state = EscapeState::GROUND;
+    }
+    else if(escape.size() + (i - run_start) > max_escape_length)
+    {
+      // an unterminated sequence would hide everything after it from the
+      // rules (and from the terminal), so it is dropped
+      escape.clear();
+      run_start = i;
+      escape_state = EscapeState::GROUND;
+    }
+  }
+
+  if(run_start < size)
+  {
+    if(escape_state == EscapeState::GROUND)
+      filter_text(data + run_start, size - run_start, out);
+    else
+      escape.append(data + run_start, size - run_start);
+  }
+}
+
+/**
+ * Release any output that is being held back.
+ */
+void OutputFilter::flush(std::string& out)
+{
+  if(!held.empty())
+  {
+    std::string text;
+    text.swap(held);
+    redact_literals(text, out, true);
+  }
+  if(!line.empty())
+    emit_line(out);
+}
+
+/**
+ * Release the output that is being held back, except for the end of an
+ * incomplete line that a regex rule could still match more of.
+ */
+void OutputFilter::flush_idle(std::string& out)
+{
+  if(!held.empty())
+  {
+    std::string text;
+    text.swap(held);
+    redact_literals(text, out, true);
+  }
+  if(line.empty())
+    return;
+
+  emit_line_before(extendable_position(), out);
+  idle_held = line.size();
+}
+
+void OutputFilter::reset()
+{
+  escape_state = EscapeState::GROUND;
+  escape.clear();
+  held.clear();
+  line.clear();
+  line_escapes.clear();
+  idle_held = 0;
+}
+
+bool OutputFilter::idle_pending() const
+{
+  return !held.empty() || line.size() != idle_held;
+}
+
+/**
+ * Position of the first match of a regex rule in the last text run of
+ * the line that could still grow, or the length of the line if there is none.
+ * Rules are only applied within a text run, so the runs before the last escape
+ * sequence are complete.
+ */
+size_t OutputFilter::extendable_position() const
+{
+  size_t start = line_escapes.empty() ? 0 : line_escapes.back().first + line_escapes.back().second;
+  size_t position = line.size();
+  auto begin = line.cbegin() + start;
+  for(auto& re : partial_patterns)
+  {
+    boost::smatch m;
+    auto it = begin;
+    while(it != line.cend() && boost::regex_search(it, line.cend(), m, re, boost::match_default | boost::match_partial))
+    {
+      if(!m[0].matched || m[0].second == line.cend())
+      {
+        position = std::min<size_t>(position, m[0].first - line.cbegin());
+        break;
+      }
+      it = m[0].second == m[0].first ? m[0].second + 1 : m[0].second;
+    }
+  }
+  return position;
+}
+
+/**
+ * Find the next position that could be the start of a literal.
+ *
+ * For a few distinct first bytes, memchr (which is vectorized by the C library)
+ * is used to scan for each of them. Otherwise, the bytes are checked against a
+ * table.
+ */
+size_t OutputFilter::find_candidate(const char* data, size_t size) const
+{
+  if(first_byte_list.size() <= 4)
+  {
+    size_t n = size;
+    for(char b : first_byte_list)
+    {
+      const void* p = std::memchr(data, b, n);
+      if(p != nullptr)
+        n = static_cast<const char*>(p) - data;
+    }
+    return n < size ? n : std::string::npos;
+  }
+
+  for(size_t i = 0; i < size; ++i)
+    if(first_bytes[static_cast<unsigned char>(data[i])])
+      return i;
+  return std::string::npos;
+}
+
+/**
+ * Redact literals in text and emit it. Unless final is true, a tail that
+ * could be the beginning of a literal is kept in held.
+ *
+ * Occurrences of literals that overlap are masked as one range, so that
+ * no part of either one is emitted. A range is only emitted once no
+ * literal that starts inside it could still extend it.
+ */
+void OutputFilter::redact_literals(std::string& text, std::string& out, bool final)
+{
+  size_t emitted = 0;
+  size_t pos = 0;
+  size_t c;
+  while(pos < text.size() && (c = find_candidate(text.data() + pos, text.size() - pos)) != std::string::npos)
+  {
+    c += pos;
+    bool partial = false;
+    size_t end = literal_end(text, c, partial);
+
+    if(partial && !final)
+    {
+      emit_text(text.data() + emitted, c - emitted, out);
+      held = text.substr(c);
+      return;
+    }
+
+    if(end > c)
+    {
+      emit_text(text.data() + emitted, c - emitted, out);
+      emit_text(mask.data(), mask.size(), out);
+      emitted = pos = end;
+    }
+    else
+    {
+      pos = c + 1;
+    }
+  }
+  emit_text(text.data() + emitted, text.size() - emitted, out);
+  held.clear();
+}
+
+/**
+ * End of the range of text starting at c that is masked by the literals,
+ * or c if no literal matches there. The range grows while literals that
+ * start inside of it match. partial is set if a literal that starts in the
+ * range runs past the end of text.
+ */
+size_t OutputFilter::literal_end(const std::string& text, size_t c, bool& partial) const
+{
+  size_t end = c;
+  for(size_t p = c; p == c || p < end; ++p)
+  {
+    if(!first_bytes[static_cast<unsigned char>(text[p])])
+      continue;
+    for(auto& l : literals)
+    {
+      if(l[0] != text[p])
+        continue;
+      size_t n = std::min(l.size(), text.size() - p);
+      if(text.compare(p, n, l, 0, n) != 0)
+        continue;
+      if(n == l.size())
+        end = std::max(end, p + n);
+      else
+        partial = true;
+    }
+  }
+  return end;
+}
+
+/**
+ * Apply all of the rules to text that is complete, e.g. the payload of a
+ * string sequence. Returns false if it should be suppressed.
+ */
+bool OutputFilter::filter_string(std::string& text) const
+{
+  if(!literals.empty())
+  {
+    std::string masked;
+    size_t emitted = 0;
+    size_t pos = 0;
+    size_t c;
+    while(pos < text.size() && (c = find_candidate(text.data() + pos, text.size() - pos)) != std::string::npos)
+    {
+      c += pos;
+      bool partial = false;
+      size_t end = literal_end(text, c, partial);
+      if(end > c)
+      {
+        masked.append(text, emitted, c - emitted);
+        masked += mask;
+        emitted = pos = end;
+      }
+      else
+      {
+        pos = c + 1;
+      }
+    }
+    masked.append(text, emitted, std::string::npos);
+    text.swap(masked);
+  }
+
+  for(auto& s : substitutions)
+    text = std::regex_replace(text, s.first, s.second);
+  for(auto& re : suppressions)
+    if(std::regex_search(text, re))
+      return false;
+  return true;
+}
+
+/**
+ * Pass text through the literal rules.
+ */
+void OutputFilter::filter_text(const char* data, size_t size, std::string& out)
+{
+  if(literals.empty())
+    return emit_text(data, size, out);
+
+  std::string text;
+  text.swap(held);
+  text.append(data, size);
+  redact_literals(text, out, false);
+}
+
+/**
+ * Pass text that has been through the literal rules through the line rules.
+ */
+void OutputFilter::emit_text(const char* data, size_t size, std::string& out)
+{
+  if(size == 0)
+    return;
+
+  if(suppressions.empty() && substitutions.empty())
+  {
+    out.append(data, size);
+    return;
+  }
+
+  while(size > 0)
+  {
+    const void* nl = std::memchr(data, '\n', size);
+    size_t n = nl == nullptr ? size : static_cast<const char*>(nl) - data + 1;
+    line.append(data, n);
+    data += n;
+    size -= n;
+    if(nl != nullptr)
+    {
+      emit_line(out);
+    }
+    else if(line.size() >= max_line_length)
+    {
+      // don't split a match that could still grow. if the whole line is
+      // one, it is emitted so the line doesn't grow without bound.
+      size_t keep = extendable_position();
+      emit_line_before(keep > 0 ? keep : line.size(), out);
+    }
+  }
+}
+
+void OutputFilter::emit_escape(const char* data, size_t size, std::string& out)
+{
+  // a partial literal can't continue through an escape sequence
+  if(!held.empty())
+  {
+    std::string text;
+    text.swap(held);
+    redact_literals(text, out, true);
+  }
+
+  if(suppressions.empty() && substitutions.empty())
+  {
+    out.append(data, size);
+    return;
+  }
+
+  line_escapes.push_back(std::make_pair(line.size(), size));
+  line.append(data, size);
+}
+
+/**
+ * Emit the escape sequence that has been collected. The payload of a string
+ * sequence is filtered, and the sequence is dropped if it is suppressed.
+ */
+void OutputFilter::end_escape(std::string& out)
+{
+  if(escape.size() > 2 && std::strchr("]PX^_", escape[1]) != nullptr)
+  {
+    size_t terminator = escape.back() == '\x07' ? 1 : 2;
+    std::string payload = escape.substr(2, escape.size() - 2 - terminator);
+    if(!filter_string(payload))
+    {
+      escape.clear();
+      return;
+    }
+    escape.replace(2, escape.size() - 2 - terminator, payload);
+  }
+  emit_escape(escape.data(), escape.size(), out);
+  escape.clear();
+}
+
+/**
+ * Emit the part of the buffered line before keep and hold the rest. keep
+ * must be in the last text run of the line.
+ */
+void OutputFilter::emit_line_before(size_t keep, std::string& out)
+{
+  if(keep == line.size())
+  {
+    emit_line(out);
+    return;
+  }
+  if(keep > 0)
+  {
+    std::string rest = line.substr(keep);
+    line.resize(keep);
+    emit_line(out);
+    line.swap(rest);
+  }
+}
+
+/**
+ * Apply the line rules to the buffered line and emit it.
+ */
+void OutputFilter::emit_line(std::string& out)
+{
+  std::string text;
+  std::vector<std::pair<size_t,size_t>> text_runs;
+  size_t pos = 0;
+  for(auto& e : line_escapes)
+  {
+    text_runs.push_back(std::make_pair(pos, e.first - pos));
+    text.append(line, pos, e.first - pos);
+    pos = e.first + e.second;
+  }
+  text_runs.push_back(std::make_pair(pos, line.size() - pos));
+  text.append(line, pos, line.size() - pos);
+
+  bool suppress = false;
+  for(auto& re : suppressions)
+    if(std::regex_search(text, re))
+      suppress = true;
+
+  // escape sequences are kept, even for suppressed lines, so that the
+  // terminal state (colors, cursor, ...) is not changed by the filter.
+  for(size_t i = 0; i < text_runs.size(); ++i)
+  {
+    if(!suppress)
+    {
+      std::string run = line.substr(text_runs[i].first, text_runs[i].second);
+      for(auto& s : substitutions)
+        run = std::regex_replace(run, s.first, s.second);
+      out += run;
+    }
+    if(i < line_escapes.size())
+      out.append(line, line_escapes[i].first, line_escapes[i].second);
+  }
+
+  line.clear();
+  line_escapes.clear();
+  idle_held = 0;
+}
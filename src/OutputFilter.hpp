@@ -0,0 +1,116 @@
+#ifndef OutputFilter_hpp
+#define OutputFilter_hpp
+
+/** @file OutputFilter.hpp
+  * @brief Streaming filter for slave output (OutputMode::FILTERED).
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <regex>
+#include <boost/regex.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Filters the slave output as it is streamed to stdout.
+ *
+ * Rules are given as strings:
+ *
+ *   redact:TEXT            replace every occurrence of TEXT with the mask.
+ *   redact-regex:REGEX     replace matches of REGEX with the mask.
+ *   suppress:REGEX         drop lines that match REGEX.
+ *   replace:REGEX=>TEXT    replace matches of REGEX with TEXT.
+ *
+ * Output is processed in chunks. Literal redaction only holds back the
+ * bytes that could be the start of a secret, so output is not delayed by
+ * line buffering unless line (regex) rules are used. Control sequences
+ * (CSI) and other short escape sequences are never matched by the rules
+ * and are passed through intact. Regex rules are applied to the text
+ * between escape sequences, and suppression is tested on a line with its
+ * escape sequences removed.
+ *
+ * String sequences (OSC, DCS, SOS, PM and APC, e.g. the window title that
+ * shell prompts set) carry text, so their payload is filtered on its own:
+ * literals and substitutions are applied to it, and the sequence is dropped
+ * if it matches a suppression. They are held until they are terminated. A
+ * sequence longer than max_escape_length is dropped, and the output after
+ * it is filtered as text.
+ *
+ * Held back output is released by flush_idle(), which should be called when
+ * the output stream goes idle. It releases the start of an incomplete line,
+ * up to the first position where a regex rule has a match that more output
+ * could still extend (a partial match, or a match that reaches the end of the
+ * line). That part is held until the line is complete or max_line_length is
+ * reached, so a secret that is written slowly is still redacted. When a line
+ * reaches max_line_length, the part of it that a regex rule could still match
+ * more of is held back in the same way. flush() releases everything except an
+ * unterminated escape sequence. The part of a line that is released early is treated
+ * as a complete line by the line rules.
+ */
+class OutputFilter
+{
+  public:
+    std::string mask = "****";
+    // lines longer than this are flushed even if they are not complete
+    size_t max_line_length = 4096;
+    // escape sequences longer than this are dropped
+    size_t max_escape_length = 4096;
+
+    void add_rule(const std::string& rule);
+    void add_literal(const std::string& text);
+    void add_regex_redaction(const std::string& regex);
+    void add_suppression(const std::string& regex);
+    void add_substitution(const std::string& regex, const std::string& replacement);
+
+    bool empty() const;
+    // true if there is output being held back
+    bool pending() const;
+
+    void process(const char* data, size_t size, std::string& out);
+    void flush(std::string& out);
+    void flush_idle(std::string& out);
+    // forget the held back output and any partial escape sequence, but keep
+    // the rules. used to filter a repaint with a copy of a running filter.
+    void reset();
+    // true if flush_idle() would release some output
+    bool idle_pending() const;
+
+  protected:
+    enum class EscapeState { GROUND, ESCAPE, INTERMEDIATE, CSI, STRING, STRING_ESCAPE };
+    EscapeState escape_state = EscapeState::GROUND;
+    // the escape sequence that is being read
+    std::string escape;
+
+    // literal redaction
+    std::vector<std::string> literals;
+    bool first_bytes[256] = {};
+    std::string first_byte_list;
+    std::string held;
+
+    // line rules
+    std::vector<std::regex> suppressions;
+    std::vector<std::pair<std::regex,std::string>> substitutions;
+    // the substitution patterns again, for partial matching (which std::regex can't do)
+    std::vector<boost::regex> partial_patterns;
+    std::string line;
+    // ranges of line that are escape sequences
+    std::vector<std::pair<size_t,size_t>> line_escapes;
+    // length of line that flush_idle() last held back
+    size_t idle_held = 0;
+
+    size_t find_candidate(const char* data, size_t size) const;
+    size_t literal_end(const std::string& text, size_t c, bool& partial) const;
+    bool filter_string(std::string& text) const;
+    void filter_text(const char* data, size_t size, std::string& out);
+    void redact_literals(std::string& text, std::string& out, bool final);
+    void emit_text(const char* data, size_t size, std::string& out);
+    void emit_escape(const char* data, size_t size, std::string& out);
+    void end_escape(std::string& out);
+    void emit_line(std::string& out);
+    void emit_line_before(size_t keep, std::string& out);
+    size_t extendable_position() const;
+};
+
+#endif // include protector
@@ -0,0 +1,146 @@
+#include "./OutputMatcher.hpp"
+
+#include <cstring>
+
+void OutputMatcher::feed(const char* data, size_t size)
+{
+  if(!enabled)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(size_t i = 0; i < size; ++i)
+    {
+      char c = data[i];
+      switch(escape_state)
+      {
+        case EscapeState::GROUND:
+          if(c == '\n')
+            end_line();
+          else if(c == '\x1b')
+            escape_state = EscapeState::ESCAPE;
+          else if(c != '\r' && !skip_line)
+          {
+            current += c;
+            if(current.size() >= max_line_length)
+              end_line();
+          }
+          break;
+        case EscapeState::ESCAPE:
+          if(c == '[')
+            escape_state = EscapeState::CSI;
+          else if(c == ']')
+            escape_state = EscapeState::OSC;
+          else if(!(c >= 0x20 && c <= 0x2f))
+            escape_state = EscapeState::GROUND;
+          break;
+        case EscapeState::CSI:
+          if(c >= 0x40 && c <= 0x7e)
+            escape_state = EscapeState::GROUND;
+          break;
+        case EscapeState::OSC:
+          if(c == '\x07')
+            escape_state = EscapeState::GROUND;
+          else if(c == '\x1b')
+            escape_state = EscapeState::OSC_ESCAPE;
+          break;
+        case EscapeState::OSC_ESCAPE:
+          escape_state = c == '\\' ? EscapeState::GROUND : EscapeState::OSC;
+          break;
+      }
+    }
+    bytes_received += size;
+  }
+  output_received.notify_all();
+}
+
+void OutputMatcher::end_line()
+{
+  if(!skip_line)
+  {
+    lines.push_back(current);
+    if(lines.size() > max_lines)
+    {
+      lines.pop_front();
+      ++dropped;
+    }
+  }
+  current.clear();
+  skip_line = false;
+}
+
+void OutputMatcher::mark()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  dropped += lines.size();
+  lines.clear();
+  current.clear();
+  skip_line = true;
+}
+
+bool OutputMatcher::wait_for(const std::regex& re, clock::time_point deadline)
+{
+  return match(re, deadline, nullptr);
+}
+
+bool OutputMatcher::capture(const std::regex& re, clock::time_point deadline, std::string& value)
+{
+  return match(re, deadline, &value);
+}
+
+bool OutputMatcher::match(const std::regex& re, clock::time_point deadline, std::string* value)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  // index of the next line to test, counted from the first line ever received
+  uint64_t next = dropped;
+  for(;;)
+  {
+    if(next < dropped)
+      next = dropped;
+    for(; next < dropped + lines.size(); ++next)
+    {
+      std::smatch m;
+      if(std::regex_search(lines[next - dropped], m, re))
+      {
+        if(value)
+          *value = m.size() > 1 ? m[1].str() : m[0].str();
+        size_t n = next - dropped + 1;
+        lines.erase(lines.begin(), lines.begin() + n);
+        dropped += n;
+        return true;
+      }
+    }
+    if(!value && !skip_line && std::regex_search(current, re))
+    {
+      dropped += lines.size();
+      lines.clear();
+      current.clear();
+      skip_line = true;
+      return true;
+    }
+
+    if(clock::now() >= deadline)
+      return false;
+    output_received.wait_until(lock, deadline);
+  }
+}
+
+bool OutputMatcher::wait_for_output(uint64_t a_bytes, clock::time_point deadline)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return output_received.wait_until(lock, deadline, [&]() { return bytes_received != a_bytes; });
+}
+
+uint64_t OutputMatcher::bytes() const
+{
+  return bytes_received;
+}
+
+std::vector<std::string> OutputMatcher::unmatched() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::string> out(lines.begin(), lines.end());
+  if(!current.empty() && !skip_line)
+    out.push_back(current);
+  return out;
+}
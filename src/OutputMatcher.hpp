@@ -0,0 +1,80 @@
+#ifndef OutputMatcher_hpp
+#define OutputMatcher_hpp
+
+/** @file OutputMatcher.hpp
+  * @brief Waits for slave output to match a pattern (#EXPECT).
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <vector>
+
+/**
+ * Collects the slave output as lines so that the main thread can wait for a
+ * line matching a regex.
+ *
+ * Output is fed by the output thread. Escape sequences and carriage returns
+ * are removed. Each complete line is tested against an expectation once,
+ * so waiting never re-scans the accumulated output; only the incomplete
+ * last line is tested again when more output arrives.
+ *
+ * A match consumes the output up to and including the matching line, so
+ * consecutive expectations (and captures) must match in order. mark() discards all output
+ * and the rest of the current line. It is called when a script line is
+ * submitted, so that the echo of the command is not matched.
+ */
+class OutputMatcher
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // output is only collected if enabled
+    std::atomic<bool> enabled{false};
+    // number of lines that are kept for the failure report
+    size_t max_lines = 1000;
+    // lines longer than this are split
+    size_t max_line_length = 4096;
+
+    void feed(const char* data, size_t size);
+    void mark();
+
+    // wait for a line matching re. returns false on timeout.
+    bool wait_for(const std::regex& re, clock::time_point deadline);
+    // wait for a complete line matching re and set value to the first group
+    // of the match (or the whole match if re has no groups). the last line
+    // is only tested once it is complete, so a value is never cut short.
+    bool capture(const std::regex& re, clock::time_point deadline, std::string& value);
+    // wait for more output than bytes. returns false on timeout.
+    bool wait_for_output(uint64_t bytes, clock::time_point deadline);
+    uint64_t bytes() const;
+
+    // output lines that have not been consumed by a match
+    std::vector<std::string> unmatched() const;
+
+  protected:
+    mutable std::mutex mutex;
+    std::condition_variable output_received;
+    std::atomic<uint64_t> bytes_received{0};
+
+    std::deque<std::string> lines;
+    // number of lines that have been removed from the front of lines
+    uint64_t dropped = 0;
+    std::string current;
+    bool skip_line = false;
+
+    enum class EscapeState { GROUND, ESCAPE, CSI, OSC, OSC_ESCAPE };
+    EscapeState escape_state = EscapeState::GROUND;
+
+    void end_line();
+    bool match(const std::regex& re, clock::time_point deadline, std::string* value);
+};
+
+#endif // include protector
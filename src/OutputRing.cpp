@@ -0,0 +1,223 @@
+#include "./OutputRing.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+OutputRing::OutputRing(size_t capacity, OverflowPolicy policy)
+    : buffer(std::max<size_t>(1, capacity)), overflow_policy(policy)
+{
+  const char* tmp = getenv("TMPDIR");
+  spill_directory = tmp != nullptr ? tmp : "/tmp";
+}
+
+OutputRing::~OutputRing()
+{
+  if(spill_fd >= 0)
+    ::close(spill_fd);
+}
+
+void OutputRing::configure(size_t capacity, OverflowPolicy policy)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  overflow_policy = policy;
+  capacity = std::max<size_t>(1, std::max(capacity, count));
+  if(capacity == buffer.size())
+    return;
+
+  std::vector<char> resized(capacity);
+  for(size_t i = 0; i < count; ++i)
+    resized[i] = buffer[(head + i) % buffer.size()];
+  buffer.swap(resized);
+  head = 0;
+  not_full.notify_all();
+}
+
+OverflowPolicy OutputRing::policy() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return overflow_policy;
+}
+
+size_t OutputRing::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return count + (spill_write - spill_read);
+}
+
+bool OutputRing::empty() const
+{
+  return size() == 0;
+}
+
+bool OutputRing::dropping() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return is_dropping;
+}
+
+void OutputRing::end_drop()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  is_dropping = false;
+}
+
+void OutputRing::close()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+  }
+  not_empty.notify_all();
+  not_full.notify_all();
+}
+
+bool OutputRing::push(const char* data, size_t size, bool may_drop)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  if(closed)
+    return false;
+
+  size_t free = buffer.size() - count;
+  if(overflow_policy == OverflowPolicy::SPILL && (spill_write > spill_read || size > free))
+  {
+    // once spilling, everything is spilled until the reader catches up so
+    // that the order is kept
+    if(spill(data, size))
+    {
+      lock.unlock();
+      not_empty.notify_one();
+      return true;
+    }
+    // the output that has been spilled must be written first
+    not_full.wait(lock, [&]() { return spill_write == spill_read || closed; });
+  }
+
+  if(overflow_policy == OverflowPolicy::DROP && may_drop)
+  {
+    if(!is_dropping && size > free)
+    {
+      if(stats != nullptr)
+        stats->stdout_dropped_bytes += count;
+      head = 0;
+      count = 0;
+      is_dropping = true;
+      not_full.notify_all();
+    }
+    if(is_dropping)
+    {
+      if(stats != nullptr)
+        stats->stdout_dropped_bytes += size;
+      return true;
+    }
+  }
+
+  while(size > 0)
+  {
+    not_full.wait(lock, [&]() { return count < buffer.size() || closed; });
+    if(closed)
+      return false;
+    size_t n = std::min(size, buffer.size() - count);
+    copy_in(data, n);
+    data += n;
+    size -= n;
+    not_empty.notify_one();
+  }
+  return true;
+}
+
+void OutputRing::copy_in(const char* data, size_t size)
+{
+  size_t tail = (head + count) % buffer.size();
+  size_t n = std::min(size, buffer.size() - tail);
+  std::memcpy(buffer.data() + tail, data, n);
+  std::memcpy(buffer.data(), data + n, size - n);
+  count += size;
+}
+
+/**
+ * Append to the spill file. mutex must be held. returns false if the spill
+ * file can't be used.
+ */
+bool OutputRing::spill(const char* data, size_t size)
+{
+  if(spill_fd < 0)
+  {
+    std::string name = spill_directory + "/gsc-spill-XXXXXX";
+    spill_fd = mkstemp(&name[0]);
+    if(spill_fd < 0)
+      return false;
+    // the file is only needed while it is open
+    unlink(name.c_str());
+  }
+
+  size_t written = 0;
+  while(written < size)
+  {
+    ssize_t rc = pwrite(spill_fd, data + written, size - written, spill_write + written);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return false;
+    written += rc;
+  }
+  spill_write += size;
+  if(stats != nullptr)
+    stats->stdout_spilled_bytes += size;
+  return true;
+}
+
+int OutputRing::pop(char* data, size_t size, std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  not_empty.wait_for(lock, timeout, [&]() { return count > 0 || spill_write > spill_read || closed; });
+
+  if(count > 0)
+  {
+    size_t n = std::min(size, std::min(count, buffer.size() - head));
+    std::memcpy(data, buffer.data() + head, n);
+    head = (head + n) % buffer.size();
+    count -= n;
+    lock.unlock();
+    not_full.notify_all();
+    return n;
+  }
+
+  if(spill_write > spill_read)
+  {
+    // only the reader moves spill_read, and the writer only appends after
+    // spill_write, so the file is read without holding the lock and push()
+    // doesn't wait for the disk.
+    uint64_t offset = spill_read;
+    size_t   length = std::min<uint64_t>(size, spill_write - spill_read);
+    int      fd     = spill_fd;
+    lock.unlock();
+    ssize_t n;
+    do
+      n = pread(fd, data, length, offset);
+    while(n < 0 && errno == EINTR);
+    lock.lock();
+    if(n <= 0)
+    {
+      // the spilled output can't be read back
+      n = 0;
+      spill_read = spill_write;
+    }
+    spill_read += n;
+    if(spill_read == spill_write)
+    {
+      // caught up. start over at the beginning of the file.
+      if(ftruncate(spill_fd, 0) != 0) {}
+      spill_read = 0;
+      spill_write = 0;
+    }
+    lock.unlock();
+    not_full.notify_all();
+    return n;
+  }
+
+  return closed ? -1 : 0;
+}
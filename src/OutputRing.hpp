@@ -0,0 +1,84 @@
+#ifndef OutputRing_hpp
+#define OutputRing_hpp
+
+/** @file OutputRing.hpp
+  * @brief Bounded buffer between the slave reader and the stdout writer.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "./Enums.hpp"
+#include "./Stats.hpp"
+
+/**
+ * A ring buffer of output waiting to be written to stdout.
+ *
+ * Output is pushed by the thread reading the slave and popped by a thread
+ * that writes to stdout, so a slow terminal doesn't stall the slave. What
+ * happens when the ring is full depends on the policy:
+ *
+ *   BLOCK  push() waits for room.
+ *   DROP   the buffered output is discarded and the ring starts dropping
+ *          everything that may be dropped until the reader has caught up
+ *          (see dropping()). The caller then repaints the terminal and
+ *          calls end_drop().
+ *   SPILL  output is appended to a temporary file and read back in order
+ *          once the ring is empty.
+ */
+class OutputRing
+{
+  public:
+    SessionStats* stats = nullptr;
+    // directory for the spill file
+    std::string spill_directory;
+
+    OutputRing(size_t capacity = 1024*1024, OverflowPolicy policy = OverflowPolicy::BLOCK);
+    ~OutputRing();
+
+    void configure(size_t capacity, OverflowPolicy policy);
+    OverflowPolicy policy() const;
+
+    // add output. if may_drop is false, output is never dropped. returns
+    // false if the ring has been closed.
+    bool push(const char* data, size_t size, bool may_drop = true);
+    // remove up to size bytes. waits up to timeout for output. returns the
+    // number of bytes, or -1 if the ring is closed and empty. only one
+    // thread may pop.
+    int pop(char* data, size_t size, std::chrono::milliseconds timeout);
+
+    size_t size() const;
+    bool empty() const;
+    bool dropping() const;
+    void end_drop();
+
+    // no more output will be pushed. pop() returns what is left.
+    void close();
+
+  protected:
+    mutable std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+    std::vector<char> buffer;
+    size_t head = 0;
+    size_t count = 0;
+    OverflowPolicy overflow_policy;
+    bool closed = false;
+    bool is_dropping = false;
+
+    int spill_fd = -1;
+    uint64_t spill_read = 0;
+    uint64_t spill_write = 0;
+
+    void copy_in(const char* data, size_t size);
+    bool spill(const char* data, size_t size);
+};
+
+#endif // include protector
@@ -0,0 +1,505 @@
+#include "./ScriptBundle.hpp"
+#include "./SessionScript.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+namespace {
+
+bool is_token_char(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+template<typename T>
+void append(std::string& buffer, const T& t)
+{
+  buffer.append(reinterpret_cast<const char*>(&t), sizeof(T));
+}
+
+// read-only memory map of a file that is released when it goes out of scope.
+struct MappedFile
+{
+  const char* data = nullptr;
+  size_t size = 0;
+
+  MappedFile(const std::string& filename)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+      throw std::runtime_error("Could not open script bundle "+filename);
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+      close(fd);
+      throw std::runtime_error("Could not stat script bundle "+filename);
+    }
+    size = st.st_size;
+    void* addr = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(addr == MAP_FAILED)
+      throw std::runtime_error("Could not map script bundle "+filename);
+    data = static_cast<const char*>(addr);
+  }
+  ~MappedFile()
+  {
+    munmap(const_cast<char*>(data), size);
+  }
+};
+
+}
+
+/**
+ * 64-bit FNV-1a hash.
+ */
+uint64_t bundle_hash(const char* data, size_t size)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for(size_t i = 0; i < size; ++i)
+  {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool is_script_bundle(const std::string& filename)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  char magic[sizeof(bundle_magic)];
+  if(!in.read(magic, sizeof(magic)))
+    return false;
+  return std::memcmp(magic, bundle_magic, sizeof(magic)) == 0;
+}
+
+/**
+ * Write the script to a bundle file.
+ *
+ * The script should have been loaded without a context so that the
+ * template tokens are still in the lines. They are rendered when the
+ * bundle is loaded.
+ */
+void SessionScript::save_bundle(const std::string& filename)
+{
+  std::vector<BundleLine> bundle_lines;
+  std::vector<BundleToken> bundle_tokens;
+  std::vector<BundleString> bundle_command_names;
+  std::map<std::string,uint32_t> command_ids;
+  std::string text;
+
+  auto add_string = [&text](const std::string& s) {
+    BundleString bs;
+    bs.offset = text.size();
+    bs.length = s.size();
+    text += s;
+    return bs;
+  };
+
+  BundleString stag = add_string(render_stag);
+  BundleString etag = add_string(render_etag);
+
+  for(size_t i = 0; i < lines.size(); ++i)
+  {
+    std::string_view line = lines[i];
+    BundleLine bl;
+    std::memset(&bl, 0, sizeof(bl));
+    bl.length = line.size();
+    bl.first_token = bundle_tokens.size();
+
+    auto& match = command(i);
+    if(match)
+    {
+      if(!command_ids.count(match->first))
+      {
+        bundle_command_names.push_back(add_string(match->first));
+        command_ids[match->first] = bundle_command_names.size();
+      }
+      bl.command = command_ids[match->first];
+      // the argument is always the tail of the line
+      bl.argument = line.size() - match->second.size();
+    }
+
+    // find the tokens that can be replaced by a context variable.
+    // tokens are scanned left to right and do not overlap.
+    size_t b = line.find(render_stag);
+    if(b != std::string::npos)
+      bl.flags |= BUNDLE_LINE_HAS_STAG;
+    while(b != std::string::npos && !render_stag.empty() && !render_etag.empty())
+    {
+      size_t n = b + render_stag.size();
+      size_t e = n;
+      while(e < line.size() && is_token_char(line[e]))
+        ++e;
+      if(e > n && line.compare(e, render_etag.size(), render_etag) == 0)
+      {
+        BundleToken bt;
+        bt.offset = b;
+        bt.length = e + render_etag.size() - b;
+        bundle_tokens.push_back(bt);
+        b = line.find(render_stag, b + bt.length);
+      }
+      else
+      {
+        b = line.find(render_stag, b + 1);
+      }
+    }
+    bl.num_tokens = bundle_tokens.size() - bl.first_token;
+
+    bl.offset = text.size();
+    text += line;
+    bundle_lines.push_back(bl);
+  }
+
+  std::string payload;
+  for(auto& e : bundle_lines)
+    append(payload, e);
+  for(auto& e : bundle_tokens)
+    append(payload, e);
+  for(auto& e : bundle_command_names)
+    append(payload, e);
+  payload += text;
+
+  BundleHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, bundle_magic, sizeof(bundle_magic));
+  header.version = bundle_version;
+  header.hash = bundle_hash(payload.data(), payload.size());
+  header.num_lines = bundle_lines.size();
+  header.num_tokens = bundle_tokens.size();
+  header.num_command_names = bundle_command_names.size();
+  header.text_size = text.size();
+  header.render_stag = stag;
+  header.render_etag = etag;
+
+  std::ofstream out(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if(!out)
+    throw std::runtime_error("Could not open "+filename+" for writing");
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(payload.data(), payload.size());
+  if(!out)
+    throw std::runtime_error("Could not write script bundle "+filename);
+}
+
+/**
+ * Load a script bundle written by save_bundle().
+ *
+ * The only work done here is the context substitution. Lines that contain
+ * the start tag are rendered with a Renderer, which gives the same result as
+ * ::render(). The tokens stored in the bundle are only used to skip lines that
+ * can't contain a variable. Splicing them in place isn't the same as render(),
+ * which replaces one variable at a time, so tokens can overlap.
+ */
+void SessionScript::load_bundle(const std::string& filename, ScriptLines& a_lines, std::vector<CommandParser::Match>& a_commands, const Context& a_context)
+{
+  MappedFile file(filename);
+
+  if(file.size < sizeof(BundleHeader))
+    throw std::runtime_error("Script bundle "+filename+" is truncated");
+  BundleHeader header;
+  std::memcpy(&header, file.data, sizeof(header));
+  if(std::memcmp(header.magic, bundle_magic, sizeof(bundle_magic)) != 0)
+    throw std::runtime_error(filename+" is not a script bundle");
+  if(header.version != bundle_version)
+    throw std::runtime_error("Script bundle "+filename+" was written by an incompatible version of gsc");
+
+  const char* payload = file.data + sizeof(BundleHeader);
+  size_t payload_size = file.size - sizeof(BundleHeader);
+  size_t tables_size = header.num_lines*sizeof(BundleLine)
+                     + header.num_tokens*sizeof(BundleToken)
+                     + header.num_command_names*sizeof(BundleString);
+  if(header.num_lines > payload_size || header.num_tokens > payload_size || header.num_command_names > payload_size
+  || tables_size + header.text_size != payload_size)
+    throw std::runtime_error("Script bundle "+filename+" is corrupt");
+  if(bundle_hash(payload, payload_size) != header.hash)
+    throw std::runtime_error("Script bundle "+filename+" failed hash check");
+
+  // all sections are 8 byte aligned, so they can be used in place
+  const BundleLine*   bundle_lines  = reinterpret_cast<const BundleLine*>(payload);
+  const BundleToken*  bundle_tokens = reinterpret_cast<const BundleToken*>(bundle_lines + header.num_lines);
+  const BundleString* bundle_names  = reinterpret_cast<const BundleString*>(bundle_tokens + header.num_tokens);
+  const char*         text          = reinterpret_cast<const char*>(bundle_names + header.num_command_names);
+
+  auto get_string = [&](const BundleString& s) {
+    if(s.offset > header.text_size || s.length > header.text_size - s.offset)
+      throw std::runtime_error("Script bundle "+filename+" is corrupt");
+    return std::string(text + s.offset, s.length);
+  };
+
+  std::vector<std::string> command_names;
+  for(size_t i = 0; i < header.num_command_names; ++i)
+    command_names.push_back(get_string(bundle_names[i]));
+
+  // a line without stag can only be skipped if the tags are plain text and
+  // were used to scan the lines. a line without any tokens can only be
+  // skipped if every variable would have been recorded as a token too.
+  bool plain_tags = get_string(header.render_stag) == render_stag
+                 && get_string(header.render_etag) == render_etag
+                 && !has_regex_chars(render_stag)
+                 && !has_regex_chars(render_etag);
+  bool skip_untokened = plain_tags;
+  for(auto& c : a_context)
+    for(auto ch : c.first)
+      if(!is_token_char(ch))
+        skip_untokened = false;
+  Renderer renderer(a_context, render_stag, render_etag);
+
+  a_lines.reserve(a_lines.size() + header.num_lines);
+  a_commands.reserve(a_commands.size() + header.num_lines);
+  // the text section is copied into the script's arena in one piece, and
+  // lines that aren't rendered point into it.
+  char* arena_text = a_lines.allocate(header.text_size);
+  if(header.text_size > 0)
+    std::memcpy(arena_text, text, header.text_size);
+  for(size_t i = 0; i < header.num_lines; ++i)
+  {
+    const BundleLine& bl = bundle_lines[i];
+    if(bl.offset > header.text_size || bl.length > header.text_size - bl.offset
+    || bl.first_token > header.num_tokens || bl.num_tokens > header.num_tokens - bl.first_token
+    || bl.command > command_names.size() || bl.argument > bl.length)
+      throw std::runtime_error("Script bundle "+filename+" is corrupt");
+
+    std::string_view line(arena_text + bl.offset, bl.length);
+    std::string_view rendered = line;
+    if(!plain_tags || ((bl.flags & BUNDLE_LINE_HAS_STAG) && !(skip_untokened && bl.num_tokens == 0)))
+      rendered = renderer.render(line);
+    if(rendered.data() == line.data())
+    {
+      a_lines.push_back_view(line);
+      if(bl.command > 0)
+        a_commands.emplace_back(std::make_pair(command_names[bl.command-1], std::string(line.substr(bl.argument))));
+      else
+        a_commands.emplace_back(std::nullopt);
+      continue;
+    }
+
+    // the command may have been changed by rendering
+    a_commands.emplace_back(command_parser.parse(rendered));
+    a_lines.push_back(rendered);
+  }
+}
+
+/**
+ * Name (without extension) of the cache files for a script. The name is a
+ * hash of everything other than the files' contents that changes the
+ * loaded script: the path, the context, the tags and whether directives
+ * are expanded. The files' contents are checked separately when the cache
+ * is read.
+ */
+std::string SessionScript::cache_filename(const std::string& filename) const
+{
+  std::string key = "gsc script cache " + std::to_string(bundle_version) + '\0';
+  key += boost::filesystem::canonical(filename).string() + '\0';
+  key += render_stag + '\0' + render_etag + '\0' + (expand_directives ? "1" : "0") + '\0';
+  for(auto& c : context)
+    key += c.first + '\0' + c.second + '\0';
+
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(bundle_hash(key.data(), key.size())));
+  return (boost::filesystem::path(cache_dir) / name).string();
+}
+
+namespace {
+
+// a line of the dependency list: size, modification time and path of a file
+bool write_dependency(std::ostream& out, const std::string& path)
+{
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0)
+    return false;
+  out << st.st_size << " " << st.st_mtim.tv_sec << " " << st.st_mtim.tv_nsec << " " << path << "\n";
+  return true;
+}
+
+bool dependency_unchanged(const std::string& line)
+{
+  std::istringstream in(line);
+  long long size, sec, nsec;
+  std::string path;
+  if(!(in >> size >> sec >> nsec) || !std::getline(in >> std::ws, path))
+    return false;
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && st.st_size == size
+      && st.st_mtim.tv_sec == sec && st.st_mtim.tv_nsec == nsec;
+}
+
+uint64_t read_bundle_hash(const std::string& filename)
+{
+  BundleHeader header;
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+    return 0;
+  return header.hash;
+}
+
+}
+
+/**
+ * Load a script from the persistent cache, if it is there and none of the
+ * files it was loaded from have changed since.
+ *
+ * The cache is a bundle of the rendered script and a list of the files it
+ * depends on (<hash>.gscb and <hash>.deps). Checking the files only needs
+ * a stat() for each, and the bundle doesn't need any parsing or rendering.
+ */
+bool SessionScript::load_cached(const std::string& filename)
+{
+  std::string base;
+  try {
+    base = cache_filename(filename);
+  } catch(const std::exception&) {
+    return false;
+  }
+
+  std::ifstream deps((base + ".deps").c_str());
+  std::string line;
+  uint64_t hash = 0;
+  if(!std::getline(deps, line) || !(std::istringstream(line) >> hash))
+    return false;
+  while(std::getline(deps, line))
+    if(!dependency_unchanged(line))
+      return false;
+
+  // the bundle and the dependency list are replaced separately, so make
+  // sure that they were written together
+  if(read_bundle_hash(base + ".gscb") != hash)
+    return false;
+  try {
+    // the lines have already been rendered
+    this->load_bundle(base + ".gscb", lines, commands, Context());
+  } catch(const std::runtime_error&) {
+    lines.clear();
+    commands.clear();
+    return false;
+  }
+  // the modification time of the bundle is when it was last used, so
+  // prune_cache() removes the least recently used entries
+  utime((base + ".gscb").c_str(), nullptr);
+  return true;
+}
+
+/**
+ * Write the script that was just loaded to the persistent cache. Errors
+ * are ignored, the script will be loaded from its files next time.
+ */
+void SessionScript::save_cached(const std::string& filename)
+{
+  std::string base, tmp;
+  try {
+    base = cache_filename(filename);
+    // several gsc processes may be writing the same entry
+    tmp = base + "." + std::to_string(getpid()) + ".tmp";
+    create_private_directory(cache_dir);
+
+    auto& file = file_cache.at(boost::filesystem::canonical(filename).string());
+    std::vector<std::string> dependencies = file.dependencies;
+    std::sort(dependencies.begin(), dependencies.end());
+    dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+
+    save_bundle(tmp + ".gscb");
+    std::ofstream out((tmp + ".deps").c_str());
+    out << read_bundle_hash(tmp + ".gscb") << "\n";
+    bool ok = true;
+    for(auto& d : dependencies)
+      ok = ok && write_dependency(out, d);
+    out.close();
+    if(!ok || !out)
+      throw std::runtime_error("Could not write "+tmp+".deps");
+    // the directory is private, but the files shouldn't rely on it
+    if(chmod((tmp + ".gscb").c_str(), S_IRUSR | S_IWUSR) != 0
+    || chmod((tmp + ".deps").c_str(), S_IRUSR | S_IWUSR) != 0)
+      throw std::runtime_error("Could not write "+tmp);
+
+    if(rename((tmp + ".gscb").c_str(), (base + ".gscb").c_str()) != 0
+    || rename((tmp + ".deps").c_str(), (base + ".deps").c_str()) != 0)
+      throw std::runtime_error("Could not write "+base);
+  } catch(const std::exception&) {
+    if(!tmp.empty())
+    {
+      unlink((tmp + ".gscb").c_str());
+      unlink((tmp + ".deps").c_str());
+    }
+    return;
+  }
+  prune_cache();
+}
+
+/**
+ * Remove the cache entries that are older than cache_max_age, and then the
+ * least recently used ones until the rest fit in cache_max_bytes. Errors are
+ * ignored, another gsc process may be pruning the cache too.
+ */
+void SessionScript::prune_cache() const
+{
+  namespace fs = boost::filesystem;
+  struct Entry
+  {
+    std::string base;
+    std::time_t used = 0;
+    uintmax_t size = 0;
+  };
+  std::map<std::string,Entry> entries;
+  std::time_t now = std::time(nullptr);
+  boost::system::error_code ec;
+  for(fs::directory_iterator it(cache_dir, ec), end; !ec && it != end; it.increment(ec))
+  {
+    fs::path path = it->path();
+    std::time_t time = fs::last_write_time(path, ec);
+    uintmax_t size = fs::file_size(path, ec);
+    if(ec)
+    {
+      ec.clear();
+      continue;
+    }
+    if(path.extension() == ".tmp" || (path.extension() != ".gscb" && path.extension() != ".deps"))
+    {
+      // left behind by a gsc that died while writing an entry
+      if(path.extension() == ".tmp" && now - time > cache_max_age)
+        fs::remove(path, ec);
+      continue;
+    }
+    Entry& e = entries[path.stem().string()];
+    e.base = (path.parent_path() / path.stem()).string();
+    e.size += size;
+    if(path.extension() == ".gscb")
+      e.used = time;
+  }
+
+  std::vector<Entry> kept;
+  for(auto& e : entries)
+  {
+    if(now - e.second.used > cache_max_age)
+    {
+      fs::remove(e.second.base + ".gscb", ec);
+      fs::remove(e.second.base + ".deps", ec);
+    }
+    else
+    {
+      kept.push_back(e.second);
+    }
+  }
+  std::sort(kept.begin(), kept.end(), [](const Entry& a, const Entry& b) { return a.used > b.used; });
+  uintmax_t total = 0;
+  for(auto& e : kept)
+  {
+    total += e.size;
+    if(total > cache_max_bytes)
+    {
+      fs::remove(e.base + ".gscb", ec);
+      fs::remove(e.base + ".deps", ec);
+    }
+  }
+}
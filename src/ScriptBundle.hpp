@@ -0,0 +1,74 @@
+#ifndef ScriptBundle_hpp
+#define ScriptBundle_hpp
+
+/** @file ScriptBundle.hpp
+  * @brief Binary layout of precompiled session scripts (.gscb files).
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// A bundle is a single file that can be mapped into memory and used
+// without any parsing. It contains the script with all includes expanded
+// and the information that is normally computed while loading.
+//
+//   BundleHeader
+//   BundleLine[num_lines]
+//   BundleToken[num_tokens]
+//   BundleString[num_command_names]
+//   char text[text_size]
+//
+// All string offsets are relative to the start of the text section. Token
+// and argument offsets are relative to the start of their line. The hash
+// is the FNV-1a hash of everything following the header.
+
+const char     bundle_magic[4] = {'G','S','C','B'};
+const uint32_t bundle_version  = 1;
+
+struct BundleString
+{
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct BundleHeader
+{
+  char     magic[4];
+  uint32_t version;
+  uint64_t hash;
+  uint64_t num_lines;
+  uint64_t num_tokens;
+  uint64_t num_command_names;
+  uint64_t text_size;
+  BundleString render_stag;
+  BundleString render_etag;
+};
+
+// line flags
+const uint32_t BUNDLE_LINE_HAS_STAG = 1; // line contains the start tag. it may need rendering.
+
+struct BundleLine
+{
+  uint64_t offset;
+  uint32_t length;
+  uint32_t flags;
+  uint32_t command;   // 0 for lines without a command. otherwise, index+1 into the command names.
+  uint32_t argument;  // offset of the command argument.
+  uint32_t first_token;
+  uint32_t num_tokens;
+};
+
+// a template token (start tag, name, end tag)
+struct BundleToken
+{
+  uint32_t offset;
+  uint32_t length;
+};
+
+uint64_t bundle_hash(const char* data, size_t size);
+bool is_script_bundle(const std::string& filename);
+
+#endif // include protector
@@ -0,0 +1,119 @@
+#include "./ScriptLines.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+class ScriptLines::Arena
+{
+  public:
+    char* allocate(size_t n)
+    {
+      if(n > left)
+      {
+        // blocks double in size so that small scripts stay small and large
+        // scripts only need a few blocks
+        block_size = std::min<size_t>(block_size * 2, max_block_size);
+        size_t size = std::max(n, block_size);
+        blocks.emplace_back(new char[size]);
+        next = blocks.back().get();
+        left = size;
+      }
+      char* p = next;
+      next += n;
+      left -= n;
+      return p;
+    }
+
+  private:
+    static constexpr size_t max_block_size = 1 << 20;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* next = nullptr;
+    size_t left = 0;
+    size_t block_size = 2048;
+};
+
+ScriptLines::ScriptLines(std::initializer_list<std::string_view> a_lines)
+{
+  *this = a_lines;
+}
+
+ScriptLines::ScriptLines(const ScriptLines& other)
+{
+  *this = other;
+}
+
+ScriptLines& ScriptLines::operator=(const ScriptLines& other)
+{
+  if(this == &other)
+    return *this;
+  // the copy doesn't write to other's arena, it only keeps it alive
+  lines = other.lines;
+  arena.reset();
+  shared = other.shared;
+  if(other.arena)
+    shared.push_back(other.arena);
+  return *this;
+}
+
+ScriptLines& ScriptLines::operator=(std::initializer_list<std::string_view> a_lines)
+{
+  clear();
+  for(auto& l : a_lines)
+    push_back(l);
+  return *this;
+}
+
+void ScriptLines::clear()
+{
+  lines.clear();
+  arena.reset();
+  shared.clear();
+}
+
+void ScriptLines::truncate(size_t n)
+{
+  if(n < lines.size())
+    lines.resize(n);
+}
+
+char* ScriptLines::allocate(size_t n)
+{
+  if(!arena)
+    arena = std::make_shared<Arena>();
+  return arena->allocate(n);
+}
+
+void ScriptLines::push_back(std::string_view line)
+{
+  char* p = allocate(line.size());
+  if(!line.empty())
+    std::memcpy(p, line.data(), line.size());
+  lines.emplace_back(p, line.size());
+}
+
+void ScriptLines::share(const std::shared_ptr<const Arena>& other)
+{
+  if(!other || other == arena || std::find(shared.begin(), shared.end(), other) != shared.end())
+    return;
+  shared.push_back(other);
+}
+
+void ScriptLines::append(const ScriptLines& other, size_t first, size_t last)
+{
+  if(first >= last)
+    return;
+  share(other.arena);
+  for(auto& a : other.shared)
+    share(a);
+  lines.insert(lines.end(), other.lines.begin() + first, other.lines.begin() + last);
+}
+
+bool operator==(const ScriptLines& a, const ScriptLines& b)
+{
+  return std::equal(a.begin(), a.end(), b.begin(), b.end());
+}
+
+bool operator==(const ScriptLines& a, const std::vector<std::string>& b)
+{
+  return std::equal(a.begin(), a.end(), b.begin(), b.end());
+}
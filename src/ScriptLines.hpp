@@ -0,0 +1,85 @@
+#ifndef ScriptLines_hpp
+#define ScriptLines_hpp
+
+/** @file ScriptLines.hpp
+  * @brief The lines of a script, stored in an arena.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * A list of lines that are string_views into a monotonic arena.
+ *
+ * Text is copied into large blocks that are never freed or moved until the
+ * list is destroyed, so adding a line doesn't allocate and the lines of a
+ * script are next to each other in memory. Lines can be removed (which
+ * only drops the view) but not modified in place.
+ *
+ * Copying or appending lines from another list shares its arena instead of
+ * copying the text. Only the list that created an arena writes to it, so
+ * lists that share text can still be used on different threads.
+ */
+class ScriptLines
+{
+  public:
+    using value_type = std::string_view;
+    using const_iterator = std::vector<std::string_view>::const_iterator;
+    using iterator = const_iterator;
+
+    ScriptLines() = default;
+    ScriptLines(std::initializer_list<std::string_view> a_lines);
+    ScriptLines(const ScriptLines& other);
+    ScriptLines(ScriptLines&& other) = default;
+    ScriptLines& operator=(const ScriptLines& other);
+    ScriptLines& operator=(ScriptLines&& other) = default;
+    ScriptLines& operator=(std::initializer_list<std::string_view> a_lines);
+
+    size_t size() const { return lines.size(); }
+    bool empty() const { return lines.empty(); }
+    std::string_view operator[](size_t i) const { return lines[i]; }
+    std::string_view front() const { return lines.front(); }
+    std::string_view back() const { return lines.back(); }
+    const_iterator begin() const { return lines.begin(); }
+    const_iterator end() const { return lines.end(); }
+
+    void reserve(size_t n) { lines.reserve(n); }
+    void clear();
+    // drop the lines after the first n. the text stays in the arena.
+    void truncate(size_t n);
+
+    // copy line into the arena
+    void push_back(std::string_view line);
+    // add a line whose text is already kept alive by this list, e.g. memory
+    // returned by allocate() or a line that was removed by truncate()
+    void push_back_view(std::string_view line) { lines.push_back(line); }
+    // lines [first,last) of other, without copying their text
+    void append(const ScriptLines& other, size_t first, size_t last);
+    void append(const ScriptLines& other) { append(other, 0, other.size()); }
+
+    // n bytes of arena memory that lines can be added from with push_back_view()
+    char* allocate(size_t n);
+
+  private:
+    class Arena;
+
+    std::vector<std::string_view> lines;
+    // the arena this list writes to, and the arenas of other lists that
+    // its lines point into.
+    std::shared_ptr<Arena> arena;
+    std::vector<std::shared_ptr<const Arena>> shared;
+
+    void share(const std::shared_ptr<const Arena>& other);
+};
+
+bool operator==(const ScriptLines& a, const ScriptLines& b);
+bool operator==(const ScriptLines& a, const std::vector<std::string>& b);
+inline bool operator!=(const ScriptLines& a, const ScriptLines& b) { return !(a == b); }
+inline bool operator!=(const ScriptLines& a, const std::vector<std::string>& b) { return !(a == b); }
+
+#endif // include protector
@@ -1,10 +1,14 @@
 #include "./Session.hpp"
 
+#include <fstream>
 #include <iostream>
+#include <regex>
+#include <sstream>
 
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/trim.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/process.hpp>
@@ -16,9 +20,12 @@
 #include <sys/poll.h>
 #include <sys/wait.h>
 
-Session::Session(std::string filename, std::string shell, int monitor_port)
+Session::Session(std::string filename, std::string shell, int monitor_port,
+                 int stdinfd, int stdoutfd)
 {
   this->filename = filename;
+  this->state.stdinfd  = stdinfd;
+  this->state.stdoutfd = stdoutfd;
   this->shell    = shell;
   if (this->shell == "")
     this->shell = getenv("SHELL") == NULL ? "sh" : getenv("SHELL");
@@ -41,7 +48,7 @@ Session::Session(std::string filename, std::string shell, int monitor_port)
   multi_char_keys.add("[6~");  // page down
 
   int rc;
-  rc = tcgetattr(0, &terminal_settings);
+  rc = tcgetattr(state.stdinfd, &terminal_settings);
   if (rc == -1)
     throw std::runtime_error(
         "Could not retrieve terminal settings on stdin file descriptor.");
@@ -50,6 +57,8 @@ Session::Session(std::string filename, std::string shell, int monitor_port)
 
   // open a pseudoterminal
   state.masterfd = posix_openpt(O_RDWR);
+  slave_writer.fd    = state.masterfd;
+  slave_writer.stats = &stats;
   // setup the save device
   if (state.masterfd < 0)
     throw std::runtime_error("There was a problem opening pty.");
@@ -158,6 +167,31 @@ Session::Session(std::string filename, std::string shell, int monitor_port)
       BOOST_LOG_TRIVIAL(debug) << "Monitor server disabled.";
     }
 
+    // writes to the slave must not block the main thread when the
+    // shell is busy. whatever can't be written is queued and written
+    // by the output thread.
+    int wakeup[2];
+    if (pipe2(wakeup, O_NONBLOCK | O_CLOEXEC) != 0)
+      throw std::runtime_error("Could not create wakeup pipe.");
+    state.wakeup_readfd     = wakeup[0];
+    state.wakeup_writefd    = wakeup[1];
+    slave_writer.wakeup_fd = state.wakeup_writefd;
+    broadcast.resync_wakeup_fd = state.wakeup_writefd;
+    if (pipe2(wakeup, O_NONBLOCK | O_CLOEXEC) != 0)
+      throw std::runtime_error("Could not create interrupt pipe.");
+    state.interrupt_readfd  = wakeup[0];
+    state.interrupt_writefd = wakeup[1];
+
+    // signals are handled by the output thread. the window size is
+    // synced when the terminal is resized, and the session ends if gsc
+    // is interrupted or the shell exits.
+    for (int sig : {SIGWINCH, SIGINT, SIGQUIT, SIGTERM, SIGCHLD})
+      Signals::watch(sig);
+    fcntl(state.masterfd, F_SETFL, fcntl(state.masterfd, F_GETFL) | O_NONBLOCK);
+
+    stdout_ring.stats = &stats;
+    stdout_writer_thread = std::thread(&Session::daemon_write_stdout, this);
+
     // create a thread to process output from the
     // slave device.
     slave_output_thread =
@@ -167,7 +201,7 @@ Session::Session(std::string filename, std::string shell, int monitor_port)
 
     // set terminal to raw mode
     cfmakeraw(&(state.terminal_settings));
-    tcsetattr(0, TCSANOW, &(state.terminal_settings));
+    tcsetattr(state.stdinfd, TCSANOW, &(state.terminal_settings));
 
     // set the slave window size to match parents
     sync_window_size();
@@ -182,19 +216,38 @@ Session::~Session()
   // signal the threads to shutdown
   state.shutdown = true;
   // wait for the threads to terminate
+  bool checkpointed = checkpoint_thread.joinable();
+  stop_checkpoints();
+  // gsc is exiting normally, so there is nothing to resume. the checkpoint
+  // is only left behind if gsc or the terminal is killed.
+  if (checkpointed) std::remove(checkpoint_filename.c_str());
   slave_output_thread.join();
+  for (int sig : {SIGWINCH, SIGINT, SIGQUIT, SIGTERM, SIGCHLD})
+    Signals::unwatch(sig);
+  broadcast.stop();
   if (state.monitor_port > 0) {
     monitor_handler_thread.join();
     close(state.monitor_serverfd);
   }
+  // write whatever output is left
+  stdout_ring.close();
+  stdout_writer_thread.join();
   close(state.masterfd);
-  tcsetattr(0, TCSANOW, &terminal_settings);
-
-  // kill the child process
-  BOOST_LOG_TRIVIAL(debug) << "killing slave process";
-  kill(state.slavePID, SIGKILL);
-  BOOST_LOG_TRIVIAL(debug) << "waiting for slave process";
-  waitpid(state.slavePID, NULL, WNOHANG);
+  close(state.wakeup_readfd);
+  close(state.wakeup_writefd);
+  close(state.interrupt_readfd);
+  close(state.interrupt_writefd);
+  tcsetattr(state.stdinfd, TCSANOW, &terminal_settings);
+
+  terminate_slave();
+
+  if (stats_filename != "") {
+    BOOST_LOG_TRIVIAL(debug) << "Writing stats to " << stats_filename;
+    std::ofstream out(stats_filename.c_str());
+    out << to_json(stats);
+  } else {
+    BOOST_LOG_TRIVIAL(debug) << "Session stats: " << to_json(stats);
+  }
 
   BOOST_LOG_TRIVIAL(debug) << "Session::~Session finished";
 }
@@ -204,7 +257,27 @@ int Session::run()
   BOOST_LOG_TRIVIAL(debug) << "Beginning session run.";
 
   this->script.load(this->filename);
-  state.script_line_it = this->script.lines.begin();
+  state.script_line_index = 0;
+  // the monitor thread only reads the published copy
+  published_state.publish_lines(script.lines);
+
+  // only collect output for matching if the script needs it
+  for (size_t i = 0; i < script.lines.size(); ++i) {
+    auto &match = script.command(i);
+    if (match && (match->first == "EXPECT" || match->first == "EXPECT_SCREEN" ||
+                  match->first == "CAPTURE"))
+      output_matcher.enabled = true;
+  }
+
+  if (amParent() && checkpoint_filename != "" &&
+      state.checkpoint_interval_milliseconds > 0) {
+    Checkpoint checkpoint;
+    checkpoint.script =
+        boost::filesystem::canonical(this->filename).string();
+    checkpoint.context = script.context;
+    checkpoint_thread  = std::thread(&Session::daemon_write_checkpoints,
+                                     this, checkpoint);
+  }
 
   if (amParent()) {
     // some vars for processing
@@ -215,34 +288,53 @@ int Session::run()
 
     // run setup commands first
     BOOST_LOG_TRIVIAL(debug) << "Running setup commands";
-    for (auto &l : setup_commands) {
+    for (auto &l : setup_commands)
       BOOST_LOG_TRIVIAL(debug) << "  setup command: " << l;
-      for (auto &c : l) {
-        send_to_slave(c);
-      }
-      send_to_slave('\r');
-    }
+    send_lines_to_slave(setup_commands);
     // process script and user input
-    state.script_line_it = this->script.lines.begin();
-    while (state.script_line_it != this->script.lines.end()) {
+    state.script_line_index = 0;
+    if (resume_from) {
+      BOOST_LOG_TRIVIAL(debug) << "Resuming at line " << resume_from->line;
+      // captures that are replayed will replace these
+      captured = resume_from->captured;
+      published_state.publish_captured(captured);
+      fast_forward(resume_from->line);
+      state.input_mode      = resume_from->input_mode;
+      state.auto_pilot_mode = resume_from->auto_pilot_mode;
+      if (resume_from->output_mode == OutputMode::NONE)
+        state.output_mode = OutputMode::NONE;
+    } else if (start_at != "") {
+      auto line = find_line(start_at);
+      if (!line)
+        throw std::runtime_error("No line or label '" + start_at +
+                                 "' in the session script.");
+      BOOST_LOG_TRIVIAL(debug) << "Starting at line " << *line;
+      fast_forward(*line);
+    }
+    while (state.script_line_index < script.lines.size()) {
+      int64_t line_start = now_ns();
       // process line for commands, comments, etc.
       process_script_line();
+      // the script may end with commands
+      if (state.script_line_index >= script.lines.size()) break;
       if (state.skipping) {
-        state.script_line_it++;
+        state.next_line();
         continue;
       }
 
-      std::string &line = *state.script_line_it;
+      const std::string line = render_captured(script.lines[state.script_line_index]);
+      published_state.publish_typed_line(state.script_line_index, line);
 
       // send line to shell
-      state.line_status       = LineStatus::EMPTY;
-      state.line_character_it = line.begin();
+      state.line_status          = LineStatus::EMPTY;
+      state.line_character_index = 0;
+      publish_state();
       while (state.line_status !=
              LineStatus::LOADED) {  // loop until the line has been marked as
                                     // loaded
 
-        while (state.line_character_it !=
-               line.end()) {  // loop until the last character has been loaded
+        while (state.line_character_index <
+               line.size()) {  // loop until the last character has been loaded
 
           // process user input
           process_user_input();
@@ -250,20 +342,24 @@ int Session::run()
             break;  // exit without processing char
 
           // need to get char(s) to load AFTER user input because
-          // the user might change the iterator
+          // the user might change the cursor
           n = 1;
           // check if the next characters are part of a multi-character
           // key that should all be sent at the same time.
           if (state.process_mutli_char_keys) {
-            auto ptr = multi_char_keys.match(state.line_character_it,
-                                             state.script_line_it->end());
+            auto ptr = multi_char_keys.match(
+                line.begin() + state.line_character_index, line.end());
             if (ptr != nullptr) n = ptr->depth();
           }
-          for (i = 0; i < n; ++i) {
-            ch = *state.line_character_it++;
-            send_to_slave(ch);
-          }
+          // don't type ahead of a busy shell
+          wait_for_slave_writer(slave_writer.high_water_mark / 2);
+          // all characters of a key are sent with one write
+          for (i = 0; i < n; ++i)
+            slave_writer.put(line[state.line_character_index++]);
+          slave_writer.flush();
+          stats.key_sent();
           state.line_status = LineStatus::INPROCESS;
+          publish_state();
         }
         if (state.line_status == LineStatus::RELOAD)
           break;  // go back to top and start over
@@ -275,23 +371,28 @@ int Session::run()
         // the line status will be reset to processing
         // and we will need to go back to the top.
         process_user_input();
-        if (state.line_status == LineStatus::LOADED) send_to_slave('\r');
+        if (state.line_status == LineStatus::LOADED) {
+          // output of the command is expected after this
+          output_matcher.mark();
+          send_to_slave('\r');
+          stats.key_sent();
+        }
       }
 
-      if (state.line_status != LineStatus::RELOAD)
-        state.script_line_it++;  // don't advance line pointer if we need to
-                                 // reload
+      if (state.line_status != LineStatus::RELOAD) {
+        state.next_line();  // don't advance line pointer if we need to
+                            // reload
+        stats.script_line.record(now_ns() - line_start);
+      }
     }
 
     // run cleanup commands first
     BOOST_LOG_TRIVIAL(debug) << "Running cleanup commands";
-    for (auto &l : cleanup_commands) {
+    for (auto &l : cleanup_commands)
       BOOST_LOG_TRIVIAL(debug) << "  cleanup command: " << l;
-      for (auto &c : l) {
-        send_to_slave(c);
-      }
-      send_to_slave('\r');
-    }
+    send_lines_to_slave(cleanup_commands);
+    // make sure the cleanup commands are delivered before we shutdown
+    wait_for_slave_writer(0);
 
     if (state.input_mode != UserInputMode::AUTO) do {
         get_from_stdin(ch);
@@ -305,7 +406,186 @@ int Session::run()
       } while (ch != '\r');
   }
 
+  publish_state();
   BOOST_LOG_TRIVIAL(debug) << "Session run completed.";
+  return exit_code();
+}
+
+/**
+ * Move the script cursor to the start of a line. The line is loaded from
+ * the start.
+ */
+void Session::jump_to_line(size_t line)
+{
+  state.script_line_index    = line;
+  state.line_character_index = 0;
+  state.line_status          = LineStatus::RELOAD;
+}
+
+/**
+ * Read text typed in command mode, e.g. a line number to jump to. The text
+ * is not shown. Return accepts it and Esc cancels. on_change is called
+ * after each edit.
+ */
+bool Session::read_prompt(std::string                                    &text,
+                          const std::function<void(const std::string &)> &on_change)
+{
+  char c;
+  while (get_from_stdin(c) > 0) {
+    if (c == '\r') return true;
+    if (c == '\x1b') return false;
+    if (c == 127 || c == 8) {
+      if (text.empty()) continue;
+      text.pop_back();
+    } else if (static_cast<unsigned char>(c) >= ' ') {
+      text += c;
+    } else {
+      continue;
+    }
+    if (on_change) on_change(text);
+  }
+  return false;
+}
+
+/**
+ * Bring the shell to the state it would be in after running the script
+ * from the cursor up to line, without the typing effect. Each line is sent
+ * with one write and the next line waits until the shell has gone quiet.
+ * If the current line has been partly typed, the rest of it is sent. Lines
+ * in #SKIP blocks and lines marked with #NOREPLAY are not sent. A
+ * #CAPTURE after a line that was sent is taken from its output, otherwise
+ * the variable keeps its value. The other commands (#PAUSE, #WAIT,
+ * #EXPECT, #RUN, ...) are ignored.
+ */
+void Session::fast_forward(size_t line)
+{
+  line = std::min(line, script.lines.size());
+  if (line <= state.script_line_index) return;
+
+  OutputMode output_mode = state.output_mode;
+  if (state.fast_forward_hide_output) state.output_mode = OutputMode::NONE;
+
+  size_t start = state.script_line_index;
+  size_t typed = state.line_character_index;
+  bool replay  = true;
+  bool sent    = false;
+  for (size_t i = start; i < line; ++i) {
+    if (state.interrupt_signal || state.slave_exited) break;
+    auto &match = script.command(i);
+    if (match) {
+      if (match->first == "SKIP") state.skipping = true;
+      if (match->first == "RESUME") state.skipping = false;
+      if (match->first == "NOREPLAY") replay = false;
+      if (match->first == "CAPTURE" && sent && !state.skipping)
+        capture(render_captured(match->second), OutputMatcher::clock::now(), false);
+      continue;
+    }
+    sent = replay && !state.skipping;
+    if (sent) {
+      state.script_line_index = i;
+      publish_state();
+      std::string text = render_captured(script.lines[i]);
+      output_matcher.mark();
+      slave_writer.put(i == start ? text.substr(std::min(typed, text.size())) : text);
+      slave_writer.put('\r');
+      slave_writer.flush();
+      wait_for_quiet_slave();
+    }
+    replay = true;
+  }
+  state.output_mode          = output_mode;
+  state.script_line_index    = line;
+  state.line_character_index = 0;
+  publish_state();
+}
+
+/**
+ * Find a line given as a line number (starting from 1) or a label.
+ */
+std::optional<size_t> Session::find_line(const std::string &text)
+{
+  size_t n = 0;
+  if (boost::conversion::try_lexical_convert(text, n))
+    return n >= 1 && n <= script.lines.size() ? std::optional<size_t>(n - 1)
+                                              : std::nullopt;
+  return script.label(text);
+}
+
+/**
+ * Wait until everything has been written to the shell and it hasn't
+ * written anything back for a while.
+ */
+void Session::wait_for_quiet_slave()
+{
+  wait_for_slave_writer(0);
+  auto     quiet = std::chrono::milliseconds(state.fast_forward_quiet_milliseconds);
+  uint64_t bytes = stats.slave_bytes_read;
+  auto     last_output = std::chrono::steady_clock::now();
+  while (!state.shutdown && !state.slave_exited && !state.interrupt_signal) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto now = std::chrono::steady_clock::now();
+    if (stats.slave_bytes_read != bytes) {
+      bytes       = stats.slave_bytes_read;
+      last_output = now;
+    } else if (now - last_output >= quiet) {
+      return;
+    }
+  }
+}
+
+/**
+ * Incremental search. The cursor follows the first line matching the
+ * text typed so far, and goes back to where it was if the search is
+ * cancelled. Returns true if a line was found.
+ */
+bool Session::search_script()
+{
+  size_t origin    = state.script_line_index;
+  size_t character = state.line_character_index;
+  std::optional<size_t> line;
+  std::string           text;
+  bool accepted = read_prompt(text, [&](const std::string &t) {
+    line = script.search(t, origin, last_search.forward);
+    state.script_line_index    = line ? *line : origin;
+    state.line_character_index = line ? 0 : character;
+    publish_state();
+  });
+
+  state.script_line_index    = origin;
+  state.line_character_index = character;
+  if (!accepted || !line) {
+    publish_state();
+    return false;
+  }
+  last_search.text = text;
+  jump_to_line(*line);
+  return true;
+}
+
+/**
+ * Publish the script position and modes for other threads to read.
+ * Only called by the main thread.
+ */
+void Session::publish_state()
+{
+  SessionStateSnapshot snapshot;
+  snapshot.input_mode      = state.input_mode;
+  snapshot.auto_pilot_mode = state.auto_pilot_mode;
+  snapshot.output_mode     = state.output_mode;
+  snapshot.num_lines       = script.lines.size();
+  snapshot.line            = state.script_line_index;
+  snapshot.character       = state.line_character_index;
+  published_state.publish(snapshot);
+}
+
+/**
+ * 4 if an expectation failed, otherwise the exit status of the shell if
+ * it exited by itself.
+ */
+int Session::exit_code()
+{
+  if (state.expect_failures > 0) return 4;
+  if (state.slave_exited) return state.slave_exit_status;
   return 0;
 }
 
@@ -313,35 +593,196 @@ bool Session::amChild() { return state.slavePID == 0; }
 
 bool Session::amParent() { return state.slavePID > 0; }
 
-int Session::get_from_stdin(char &c) { return read(0, &c, 1); }
+int Session::get_from_stdin(char &c)
+{
+  wait_for_stdin();
+  int rc = read(state.stdinfd, &c, 1);
+  if (rc > 0) stats.key_read();
+  return rc;
+}
 
 template<size_t N>
 int Session::get_from_stdin(char (&c)[N])
 {
-  return read(0, c, N);
+  wait_for_stdin();
+  int rc = read(state.stdinfd, c, N);
+  if (rc > 0) stats.key_read();
+  return rc;
+}
+
+/**
+ * Block until there is input, or end the session if gsc is interrupted
+ * while waiting.
+ */
+void Session::wait_for_stdin()
+{
+  pollfd polls[2];
+  polls[0].fd     = state.stdinfd;
+  polls[0].events = POLLIN;
+  polls[1].fd     = state.interrupt_readfd;
+  polls[1].events = POLLIN;
+  while (!state.interrupt_signal && !state.slave_exited) {
+    int rc = poll(polls, 2, -1);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0 || (polls[0].revents & (POLLIN | POLLHUP | POLLERR))) return;
+  }
+  shutdown(state.interrupt_signal != 0);
+}
+
+/**
+ * Send the signal for Ctl-C or Ctl-\ to the foreground process group of
+ * the shell, i.e. whatever command is running in the session. Returns true
+ * if c was one of those keys.
+ */
+bool Session::forward_signal_key(char c)
+{
+  int sig = c == 3 ? SIGINT : c == 28 ? SIGQUIT : 0;
+  if (sig == 0) return false;
+  pid_t pgrp = tcgetpgrp(state.masterfd);
+  if (pgrp > 0) killpg(pgrp, sig);
+  return true;
 }
 
 int Session::send_to_stdout(char c)
 {
-  if (state.output_mode == OutputMode::ALL) return write(1, &c, 1);
+  // messages from gsc itself are not filtered, and never dropped
   if (state.output_mode == OutputMode::NONE) return 0;
-  // handle output filtering...
+  stdout_ring.push(&c, 1, false);
+  return 1;
+}
 
-  return 0;
+int Session::send_to_stdout(const char *buffer, size_t n)
+{
+  if (state.output_mode == OutputMode::NONE) return 0;
+  if (state.output_mode == OutputMode::ALL) {
+    stdout_ring.push(buffer, n);
+    broadcast.publish(buffer, n);
+    return n;
+  }
+
+  filtered_output.clear();
+  output_filter.process(buffer, n, filtered_output);
+  stdout_ring.push(filtered_output.data(), filtered_output.size());
+  broadcast.publish(filtered_output.data(), filtered_output.size());
+  return n;
+}
+
+int Session::flush_output_filter()
+{
+  filtered_output.clear();
+  output_filter.flush_idle(filtered_output);
+  if (state.output_mode != OutputMode::FILTERED) return 0;
+  stdout_ring.push(filtered_output.data(), filtered_output.size());
+  broadcast.publish(filtered_output.data(), filtered_output.size());
+  return filtered_output.size();
+}
+
+/**
+ * Repaint the terminal from the virtual screen after output has been
+ * dropped. Only called by the output thread.
+ */
+void Session::resync_stdout()
+{
+  stdout_ring.end_drop();
+  if (state.output_mode == OutputMode::NONE) return;
+
+  std::string repaint = to_ansi(screen.snapshot());
+  if (state.output_mode == OutputMode::FILTERED) {
+    // use a copy so that the partial line and escape sequence that the
+    // filter is holding still continue with the output after the repaint
+    OutputFilter filter = output_filter;
+    std::string filtered;
+    filter.reset();
+    filter.process(repaint.data(), repaint.size(), filtered);
+    filter.flush(filtered);
+    repaint.swap(filtered);
+  }
+  // the repaint must not be dropped, or we would never catch up
+  stdout_ring.push(repaint.data(), repaint.size(), false);
+}
+
+/**
+ * Repaint the viewers that have just connected or have fallen behind.
+ * Only called by the output thread, so the repaint matches the output
+ * that has been published.
+ */
+void Session::resync_broadcast()
+{
+  std::string repaint;
+  if (state.output_mode != OutputMode::NONE)
+    repaint = to_ansi(screen.snapshot());
+  if (state.output_mode == OutputMode::FILTERED) {
+    // use a copy so that output held back by the filter still goes to stdout
+    OutputFilter filter = output_filter;
+    std::string filtered;
+    filter.reset();
+    filter.process(repaint.data(), repaint.size(), filtered);
+    filter.flush(filtered);
+    repaint.swap(filtered);
+  }
+  broadcast.resync(repaint);
+}
+
+int Session::write_to_stdout(const char *buffer, size_t n)
+{
+  size_t written = 0;
+  while (written < n) {
+    int rc = write(state.stdoutfd, buffer + written, n - written);
+    stats.stdout_writes++;
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0) return rc;
+    written += rc;
+  }
+  stats.stdout_bytes_written += written;
+  return written;
+}
+
+OutputMode Session::visible_output_mode()
+{
+  return output_filter.empty() ? OutputMode::ALL : OutputMode::FILTERED;
 }
 
 int Session::get_from_slave(char &c)
+{
+  return get_from_slave(&c, 1);
+}
+
+int Session::get_from_slave(char *buffer, size_t n)
 {
   // output of slave is read from master input
-  return read(state.masterfd, &c, 1);
+  int rc = read(state.masterfd, buffer, n);
+  if (rc > 0) stats.slave_read(rc);
+  return rc;
 }
 
 int Session::send_to_slave(char c)
 {
-  // some translation
-  if (c == '\n') c = '\r';
+  slave_writer.put(c);
+  return slave_writer.flush();
+}
 
-  return write(state.masterfd, &c, 1);
+int Session::send_to_slave(const std::string &text)
+{
+  slave_writer.put(text);
+  return slave_writer.flush();
+}
+
+int Session::send_lines_to_slave(const std::vector<std::string> &lines)
+{
+  return slave_writer.write_lines(lines);
+}
+
+/**
+ * Pause while the queue of characters waiting to be written to the slave is
+ * above the high-water mark, until it has drained down to bytes.
+ */
+void Session::wait_for_slave_writer(size_t bytes)
+{
+  if (bytes > 0 && slave_writer.pending() <= slave_writer.high_water_mark)
+    return;
+  while (!state.shutdown && !state.slave_exited &&
+         !slave_writer.wait_until_below(bytes, std::chrono::milliseconds(100)))
+    ;
 }
 
 void Session::init_shell_args()
@@ -360,12 +801,17 @@ void Session::process_user_input()
   int  count;
   bool cont;
 
+  // auto mode doesn't wait for input, so check for interrupts here
+  if (state.interrupt_signal) shutdown(true);
+  if (state.slave_exited) shutdown();
+
   // this function would probably be
   // better with a goto.
   cont = true;
   while (cont) {
     // by default, we loop once.
     cont = false;
+    publish_state();
 
     if (state.input_mode == UserInputMode::COMMAND) {
       // =command mode=
@@ -381,16 +827,8 @@ void Session::process_user_input()
         if (count > 1) continue;
 
         c = buffer[0];
-        if (c == 3)  // Ctl-C
-        {
-          // if the user presses Ctl-C, we need to send SIGINT to everybody in
-          // our process group
-          kill(0, SIGINT);
-        }
-        if (c == 28)  // Ctl-\, which means quit
-        {
-          kill(0, SIGQUIT);
-        }
+        // Ctl-C and Ctl-\ interrupt whatever is running in the shell
+        forward_signal_key(c);
 
         key_bindings.get(c, action);
 
@@ -413,18 +851,18 @@ void Session::process_user_input()
           state.output_mode = OutputMode::NONE;
         }
         if (action == CommandModeActions::TurnOnStdout) {
-          state.output_mode = OutputMode::ALL;
+          state.output_mode = visible_output_mode();
         }
         if (action == CommandModeActions::ToggleStdout) {
           if (state.output_mode == OutputMode::NONE)
-            state.output_mode = OutputMode::ALL;
-          else if (state.output_mode == OutputMode::ALL)
+            state.output_mode = visible_output_mode();
+          else
             state.output_mode = OutputMode::NONE;
         }
 
         if (action == CommandModeActions::NextLine) {
-          if (state.script_line_it < script.lines.end() - 1)
-            state.script_line_it++;
+          if (state.script_line_index + 1 < script.lines.size())
+            state.next_line();
           state.line_status = LineStatus::RELOAD;
           break;
         }
@@ -433,15 +871,57 @@ void Session::process_user_input()
           // it will be immediatly re-evaluated. so we need to
           // backup until we read a non-command, or the
           // first line.
-          do {
-            if (state.script_line_it > script.lines.begin())
-              state.script_line_it--;
-            else
-              break;
-          } while (command_parser.parse(*state.script_line_it));
-          state.line_status = LineStatus::RELOAD;
+          std::optional<size_t> prev;
+          if (state.script_line_index > 0)
+            prev = script.previous_typeable_line(state.script_line_index - 1);
+          jump_to_line(prev ? *prev : 0);
           break;
         }
+        if (action == CommandModeActions::GotoLine) {
+          std::string text;
+          size_t      n = 0;
+          if (read_prompt(text) &&
+              boost::conversion::try_lexical_convert(text, n) && n >= 1 &&
+              n <= script.lines.size()) {
+            jump_to_line(n - 1);
+            break;
+          }
+        }
+        if (action == CommandModeActions::GotoLabel) {
+          std::string text;
+          if (read_prompt(text)) {
+            auto line = script.label(text);
+            if (line) {
+              jump_to_line(*line);
+              break;
+            }
+          }
+        }
+        if (action == CommandModeActions::FastForward) {
+          std::string text;
+          if (read_prompt(text)) {
+            auto line = find_line(text);
+            if (line) {
+              // lines that have already been run can only be jumped to
+              fast_forward(*line);
+              jump_to_line(*line);
+              break;
+            }
+          }
+        }
+        if (action == CommandModeActions::SearchForward ||
+            action == CommandModeActions::SearchBackward) {
+          last_search.forward = action == CommandModeActions::SearchForward;
+          if (search_script()) break;
+        }
+        if (action == CommandModeActions::SearchNext) {
+          auto line = script.search(last_search.text, state.script_line_index,
+                                    last_search.forward);
+          if (line) {
+            jump_to_line(*line);
+            break;
+          }
+        }
 
         if (action == CommandModeActions::Return) {
           break;
@@ -466,16 +946,9 @@ void Session::process_user_input()
         if (count > 1) continue;
         c = buffer[0];
 
-        if (c == 3)  // Ctl-C
-        {
-          // if the user presses Ctl-C, we need to send SIGINT to everybody in
-          // our process group
-          kill(0, SIGINT);
-        }
-        if (c == 28)  // Ctl-\, which means quit
-        {
-          kill(0, SIGQUIT);
-        }
+        // Ctl-C and Ctl-\ interrupt whatever is running in the shell.
+        // they don't type the next character of the script.
+        if (forward_signal_key(c)) continue;
 
         key_bindings.get(c, action);
 
@@ -483,14 +956,13 @@ void Session::process_user_input()
           // need to: send backspace to shell, rewind the line character
           // iterator, and start over
           LineStatus init_line_status = state.line_status;
-          if (state.line_character_it >
-              state.script_line_it->begin()) {  // only delete characters if at
-                                                // least one is loaded.
+          if (state.line_character_index >
+              0) {  // only delete characters if at least one is loaded.
             send_to_slave('');
-            state.line_character_it--;
+            state.line_character_index--;
             state.line_status = LineStatus::INPROCESS;
           }
-          if (state.line_character_it == state.script_line_it->begin()) {
+          if (state.line_character_index == 0) {
             state.line_status = LineStatus::EMPTY;
           }
           if (init_line_status != LineStatus::LOADED)
@@ -549,7 +1021,7 @@ void Session::process_user_input()
     if (state.input_mode == UserInputMode::AUTO) {
       fd_set fds;
       FD_ZERO(&fds);
-      FD_SET(STDIN_FILENO, &fds);
+      FD_SET(state.stdinfd, &fds);
 
       timeval timeout;
       timeout.tv_sec  = 0;
@@ -557,7 +1029,7 @@ void Session::process_user_input()
 
       int rc;
 
-      rc = select(1, &fds, NULL, NULL, &timeout);
+      rc = select(state.stdinfd + 1, &fds, NULL, NULL, &timeout);
       if (rc < 0)
         throw std::runtime_error("There was a problem polling stdin fd.");
 
@@ -573,16 +1045,8 @@ void Session::process_user_input()
         get_from_stdin(c);
         key_bindings.get(c, action);
 
-        if (c == 3)  // Ctl-C
-        {
-          // if the user presses Ctl-C, we need to send SIGINT to everybody in
-          // our process group
-          kill(0, SIGINT);
-        }
-        if (c == 28)  // Ctl-\, which means quit
-        {
-          kill(0, SIGQUIT);
-        }
+        // Ctl-C and Ctl-\ interrupt whatever is running in the shell
+        forward_signal_key(c);
 
         if (action == AutoModeActions::SwitchToCommandMode) {
           state.input_mode = UserInputMode::COMMAND;
@@ -609,21 +1073,25 @@ void Session::process_user_input()
 
 void Session::process_script_line()
 {
-  while (state.script_line_it != this->script.lines.end()) {
-    auto match = command_parser.parse(*state.script_line_it);
+  while (state.script_line_index < script.lines.size()) {
+    publish_state();
+    auto &match = script.command(state.script_line_index);
     if (match) {
+      std::string argument = render_captured(match->second);
       if (match->first == "COMMENT") {
       }
       if (match->first == "RUN") {
         // WARNING: MAKE SURE YOU KNOW WHO WROTE THE SESSION SCRIPT
-        std::string name = boost::replace_all_copy(match->second, " ", "_");
+        std::string name = boost::replace_all_copy(argument, " ", "_");
         std::string num  = boost::lexical_cast<std::string>(
-            state.script_line_it - script.lines.begin());
+            state.script_line_index);
         std::string out = num + "-" + name + ".out";
         std::string err = num + "-" + name + ".err";
-        boost::process::system(match->second.c_str(),
+        int64_t     start = now_ns();
+        boost::process::system(argument.c_str(),
                                boost::process::std_out > out,
                                boost::process::std_err > err);
+        stats.run_command.record(now_ns() - start);
       }
       if (match->first == "EXIT") {
         shutdown();
@@ -649,10 +1117,10 @@ void Session::process_script_line()
       }
       if (match->first == "PAUSE") {
         std::this_thread::sleep_for(
-            std::chrono::milliseconds(boost::lexical_cast<int>(match->second)));
+            std::chrono::milliseconds(boost::lexical_cast<int>(argument)));
       }
       if (match->first == "STDOUT") {
-          state.output_mode = OutputMode::ALL;
+          state.output_mode = visible_output_mode();
       }
       if (match->first == "NOSTDOUT") {
           state.output_mode = OutputMode::NONE;
@@ -661,8 +1129,18 @@ void Session::process_script_line()
         char ch;
         get_from_stdin(ch);
       }
+      if (match->first == "EXPECT" && !state.skipping) {
+        expect(argument);
+      }
+      if (match->first == "EXPECT_SCREEN" && !state.skipping) {
+        expect_screen(argument);
+      }
+      if (match->first == "CAPTURE" && !state.skipping) {
+        capture(argument, OutputMatcher::clock::now() +
+                              std::chrono::milliseconds(state.expect_timeout_milliseconds));
+      }
 
-      state.script_line_it++;
+      state.next_line();
       continue;
     }
 
@@ -670,32 +1148,284 @@ void Session::process_script_line()
   }
 }
 
+/**
+ * Wait for a line of output since the last command was submitted to match
+ * pattern.
+ */
+bool Session::expect(const std::string &pattern)
+{
+  auto deadline = OutputMatcher::clock::now() +
+                  std::chrono::milliseconds(state.expect_timeout_milliseconds);
+  try {
+    if (output_matcher.wait_for(std::regex(pattern), deadline)) return true;
+  } catch (const std::regex_error &e) {
+    report_expect_failure("EXPECT", pattern, {std::string("invalid regex: ") + e.what()});
+    return false;
+  }
+  report_expect_failure("EXPECT", pattern, output_matcher.unmatched());
+  return false;
+}
+
+/**
+ * Set a variable from the output of the last command. The argument is
+ * "name = regex", and the variable is set to the first group of the
+ * first line that matches (or the whole match if there are no groups).
+ * If report is false a failure is not reported as a failed expectation.
+ */
+bool Session::capture(const std::string &argument,
+                      OutputMatcher::clock::time_point deadline, bool report)
+{
+  size_t      eq   = argument.find('=');
+  std::string name = boost::algorithm::trim_copy(argument.substr(0, eq));
+  std::string pattern =
+      eq == std::string::npos ? "" : boost::algorithm::trim_copy(argument.substr(eq + 1));
+  if (name.empty() || pattern.empty()) {
+    if (report)
+      report_expect_failure("CAPTURE", argument, {"expected #CAPTURE: name = regex"});
+    return false;
+  }
+
+  std::string value;
+  try {
+    if (!output_matcher.capture(std::regex(pattern), deadline, value)) {
+      if (report) report_expect_failure("CAPTURE", pattern, output_matcher.unmatched());
+      return false;
+    }
+  } catch (const std::regex_error &e) {
+    if (report)
+      report_expect_failure("CAPTURE", pattern, {std::string("invalid regex: ") + e.what()});
+    return false;
+  }
+  BOOST_LOG_TRIVIAL(debug) << "Captured " << name << " = " << value;
+  captured[name] = value;
+  published_state.publish_captured(captured);
+  return true;
+}
+
+/**
+ * Render the captured variables into a script line.
+ */
+std::string Session::render_captured(std::string_view text)
+{
+  Renderer renderer(captured, script.render_stag, script.render_etag);
+  return std::string(renderer.render(text));
+}
+
+/**
+ * Wait for a row of the screen to match pattern. Only rows that have
+ * changed are tested again.
+ */
+bool Session::expect_screen(const std::string &pattern)
+{
+  auto deadline = OutputMatcher::clock::now() +
+                  std::chrono::milliseconds(state.expect_timeout_milliseconds);
+  std::regex re;
+  try {
+    re = std::regex(pattern);
+  } catch (const std::regex_error &e) {
+    report_expect_failure("EXPECT_SCREEN", pattern, {std::string("invalid regex: ") + e.what()});
+    return false;
+  }
+
+  uint64_t       checked = 0;
+  ScreenSnapshot snapshot;
+  do {
+    uint64_t bytes = output_matcher.bytes();
+    snapshot       = screen.snapshot();
+    for (int r : snapshot.dirty_rows(checked))
+      if (std::regex_search(snapshot.row_text(r), re)) return true;
+    checked = snapshot.generation;
+    output_matcher.wait_for_output(bytes, deadline);
+  } while (OutputMatcher::clock::now() < deadline);
+
+  std::vector<std::string> actual;
+  snapshot = screen.snapshot();
+  for (int r = 0; r < snapshot.rows; ++r)
+    actual.push_back(snapshot.row_text(r));
+  report_expect_failure("EXPECT_SCREEN", pattern, actual);
+  return false;
+}
+
+void Session::report_expect_failure(const std::string &command,
+                                    const std::string &pattern,
+                                    const std::vector<std::string> &actual)
+{
+  state.expect_failures++;
+  size_t line = state.script_line_index + 1;
+  BOOST_LOG_TRIVIAL(error) << "#" << command << " failed on line " << line
+                           << ": " << pattern;
+
+  std::stringstream msg;
+  msg << "\r\n#" << command << " failed on script line " << line
+      << " (waited " << state.expect_timeout_milliseconds << " ms)\r\n";
+  msg << "--- expected\r\n";
+  msg << "+++ actual\r\n";
+  msg << "-" << pattern << "\r\n";
+  for (auto &l : actual) msg << "+" << l << "\r\n";
+  std::cerr << msg.str() << std::flush;
+}
+
 void Session::daemon_process_slave_output()
 {
-  char ch;
+  char buffer[4096];
   int  rc;
-  // use a poll to check for data from the slave
-  pollfd polls;
-  polls.fd     = state.masterfd;
-  polls.events = POLLIN;
+  // use a poll to check for data from the slave, for room to
+  // write queued input to the slave, for wakeups when input is queued,
+  // and for signals.
+  pollfd polls[3];
+  polls[0].fd = state.masterfd;
+  polls[1].fd     = state.wakeup_readfd;
+  polls[1].events = POLLIN;
+  polls[2].fd     = Signals::fd();
+  polls[2].events = POLLIN;
+  // resizing a window sends a burst of SIGWINCH, so the window size is
+  // synced at most once per resize_interval.
+  const auto resize_interval = std::chrono::milliseconds(50);
+  bool       resize_pending = false;
+  std::chrono::steady_clock::time_point resize_time;
+  // the session ends once the shell has exited and its output has been read
+  bool slave_closed = false;
+  bool slave_reaped = false;
+  bool idle         = false;
+  int  slave_status = 0;
   while (!state.shutdown) {
+    if (slave_reaped && !state.slave_exited && (slave_closed || idle))
+      handle_slave_exit(slave_status);
+    polls[0].events = POLLIN;
+    if (slave_writer.pending() > 0) polls[0].events |= POLLOUT;
     // check for input from the master.
     // note: we currently need to timeout after
     // some time so that we can check the shutdown switch.
     // perhaps we could block indefinatly if we sent a signal instead?
-    while ((rc = poll(&polls, 1, 100))) {
-      if (rc < 0)
-        throw std::runtime_error("There was a problem polling masterfd.");
+    // output held back by the filter is released as soon
+    // as the slave goes quiet.
+    int timeout = output_filter.idle_pending() ? 10 : 100;
+    if (resize_pending) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          resize_time - std::chrono::steady_clock::now());
+      timeout = std::max(0, std::min<int>(timeout, remaining.count()));
+    }
+    rc = poll(polls, 3, timeout);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0)
+      throw std::runtime_error("There was a problem polling masterfd.");
+    idle = rc == 0;
+
+    if (rc > 0 && (polls[2].revents & POLLIN)) {
+      Signals::drain();
+      if (Signals::take(SIGWINCH) && !resize_pending) {
+        resize_pending = true;
+        resize_time    = std::chrono::steady_clock::now() + resize_interval;
+      }
+      for (int sig : {SIGINT, SIGQUIT, SIGTERM})
+        if (Signals::take(sig)) handle_interrupt(sig);
+      if (Signals::take(SIGCHLD) && !slave_reaped)
+        slave_reaped = reap_slave(slave_status);
+    }
+    if (resize_pending && std::chrono::steady_clock::now() >= resize_time) {
+      resize_pending = false;
+      handle_window_resize();
+    }
+
+    if (rc == 0) {
+      if (output_filter.idle_pending()) flush_output_filter();
+      if (stdout_ring.dropping() && stdout_ring.empty()) resync_stdout();
+      if (broadcast.needs_resync()) resync_broadcast();
+      continue;
+    }
 
-      get_from_slave(ch);
-      // check if slave output should be printed
-      send_to_stdout(ch);
+    if (polls[1].revents & POLLIN)
+      while (read(state.wakeup_readfd, buffer, sizeof(buffer)) > 0)
+        ;
+    if (polls[0].revents & POLLOUT) slave_writer.drain();
+    if (!(polls[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+    rc = get_from_slave(buffer, sizeof(buffer));
+    if (rc > 0) {
+      screen.process(buffer, rc);
+      output_matcher.feed(buffer, rc);
+      // check if slave output should be printed.
+      // output that is dropped because stdout can't keep up is
+      // recovered from the screen once the writer catches up.
+      send_to_stdout(buffer, rc);
+    } else if (rc == 0 || (errno != EAGAIN && errno != EINTR)) {
+      // all processes using the slave have closed it (reads fail with EIO),
+      // which usually means the shell has exited.
+      BOOST_LOG_TRIVIAL(debug) << "Slave closed.";
+      polls[0].fd  = -1;
+      slave_closed = true;
+      if (!slave_reaped) slave_reaped = reap_slave(slave_status);
     }
+    if (stdout_ring.dropping() && stdout_ring.empty()) resync_stdout();
+    if (broadcast.needs_resync()) resync_broadcast();
   }
 
   return;
 }
 
+void Session::daemon_write_stdout()
+{
+  char buffer[16 * 1024];
+  int  n;
+  while ((n = stdout_ring.pop(buffer, sizeof(buffer),
+                              std::chrono::milliseconds(100))) >= 0) {
+    if (n > 0) write_to_stdout(buffer, n);
+    // the output thread repaints the screen when we have caught up
+    if (n > 0 && stdout_ring.dropping() && stdout_ring.empty()) {
+      char c = 0;
+      if (write(state.wakeup_writefd, &c, 1) < 0) {
+      }
+    }
+  }
+}
+
+/**
+ * Write the position to the checkpoint file every checkpoint interval, if
+ * it has changed. The position is read from the published state, so the
+ * main thread is never held up.
+ */
+void Session::daemon_write_checkpoints(Checkpoint checkpoint)
+{
+  auto interval = std::chrono::milliseconds(state.checkpoint_interval_milliseconds);
+  auto next     = std::chrono::steady_clock::now() + interval;
+  bool written  = false;
+  std::shared_ptr<const Context> saved_captured;
+  while (!state.shutdown && !checkpoint_done) {
+    std::this_thread::sleep_for(std::min(interval, std::chrono::milliseconds(50)));
+    if (std::chrono::steady_clock::now() < next) continue;
+    next += interval;
+
+    SessionStateSnapshot snapshot = published_state.read();
+    auto captured_now = published_state.read_captured();
+    if (snapshot.num_lines == 0) continue;
+    if (written && snapshot.line == checkpoint.line &&
+        captured_now == saved_captured &&
+        snapshot.input_mode == checkpoint.input_mode &&
+        snapshot.auto_pilot_mode == checkpoint.auto_pilot_mode &&
+        snapshot.output_mode == checkpoint.output_mode)
+      continue;
+
+    checkpoint.line            = snapshot.line;
+    checkpoint.input_mode      = snapshot.input_mode;
+    checkpoint.auto_pilot_mode = snapshot.auto_pilot_mode;
+    checkpoint.output_mode     = snapshot.output_mode;
+    checkpoint.captured        = *captured_now;
+    saved_captured             = captured_now;
+    try {
+      checkpoint.save(checkpoint_filename);
+      written = true;
+    } catch (const std::runtime_error &e) {
+      BOOST_LOG_TRIVIAL(error) << e.what();
+    }
+  }
+}
+
+void Session::stop_checkpoints()
+{
+  checkpoint_done = true;
+  if (checkpoint_thread.joinable()) checkpoint_thread.join();
+}
+
 void Session::daemon_process_monitor_requests()
 {
   int rc;
@@ -715,13 +1445,19 @@ void Session::daemon_process_monitor_requests()
       if (rc < 0)
         throw std::runtime_error("There was a problem polling monitor socket.");
 
+      addrlen = sizeof(address);
       n = recvfrom(state.monitor_serverfd, buffer, REQ_BUF_SIZE, 0,
                    (sockaddr *)&address, &addrlen);
       buffer[REQ_BUF_SIZE - 1] = '\0';
       BOOST_LOG_TRIVIAL(debug)
           << "Received " << n << " bytes from monitor: " << buffer;
 
-      send_state_to_monitor(&address);
+      if (n >= 5 && strncmp(buffer, "stats", 5) == 0)
+        send_stats_to_monitor(&address);
+      else if (n >= 6 && strncmp(buffer, "screen", 6) == 0)
+        send_screen_to_monitor(&address);
+      else
+        send_state_to_monitor(&address);
     }
   }
 
@@ -730,51 +1466,31 @@ void Session::daemon_process_monitor_requests()
 
 int Session::send_state_to_monitor(sockaddr_in *address)
 {
-  boost::property_tree::ptree state_t;
-  std::stringstream           state_s;
-  std::string                 tmp;
-
-  if (state.input_mode == UserInputMode::INSERT)
-    state_t.put("input mode", "I");
-  else if (state.input_mode == UserInputMode::COMMAND)
-    state_t.put("input mode", "C");
-  else if (state.input_mode == UserInputMode::PASSTHROUGH)
-    state_t.put("input mode", "P");
-  else if (state.input_mode == UserInputMode::AUTO &&
-           state.auto_pilot_mode == AutoPilotMode::FULL)
-    state_t.put("input mode", "FA");
-  else if (state.input_mode == UserInputMode::AUTO)
-    state_t.put("input mode", "SA");
-
-  if (script.lines.end() - state.script_line_it > 0)
-    state_t.put("current line", *state.script_line_it);
-  else
-    state_t.put("current line", "None");
+  auto        lines   = published_state.read_lines();
+  auto        typed   = published_state.read_typed_line();
+  std::string state_s = to_json(published_state.read(), *lines, typed.get());
 
-  if (state.script_line_it - script.lines.begin() > 0)
-    state_t.put("previous line", *(state.script_line_it - 1));
-  else
-    state_t.put("previous line", "None");
+  sendto(state.monitor_serverfd, state_s.c_str(), state_s.size(), 0,
+         (sockaddr *)address, sizeof(sockaddr_in));
 
-  if (script.lines.end() - state.script_line_it > 1)
-    state_t.put("next line", *(state.script_line_it + 1));
-  else
-    state_t.put("next line", "None");
+  return 0;
+}
 
-  if (script.lines.end() - state.script_line_it > 0) {
-    tmp = std::string(state.script_line_it->begin(), state.line_character_it);
-    state_t.put("current line progress", tmp);
-  } else {
-    state_t.put("current line progress", "");
-  }
+int Session::send_stats_to_monitor(sockaddr_in *address)
+{
+  std::string stats_s = to_json(stats);
 
-  state_t.put("current line number",
-              1 + state.script_line_it - script.lines.begin());
-  state_t.put("total number lines", script.lines.size());
+  sendto(state.monitor_serverfd, stats_s.c_str(), stats_s.size(), 0,
+         (sockaddr *)address, sizeof(sockaddr_in));
 
-  write_json(state_s, state_t);
+  return 0;
+}
+
+int Session::send_screen_to_monitor(sockaddr_in *address)
+{
+  std::string screen_s = to_json(screen.snapshot());
 
-  sendto(state.monitor_serverfd, state_s.str().c_str(), state_s.str().size(), 0,
+  sendto(state.monitor_serverfd, screen_s.c_str(), screen_s.size(), 0,
          (sockaddr *)address, sizeof(sockaddr_in));
 
   return 0;
@@ -782,10 +1498,101 @@ int Session::send_state_to_monitor(sockaddr_in *address)
 
 void Session::sync_window_size()
 {
-  if (ioctl(0, TIOCGWINSZ, &state.window_size) == -1)
+  // called by both the main and output threads, so the size is only
+  // shared through the published state.
+  winsize window_size;
+  if (ioctl(state.stdinfd, TIOCGWINSZ, &window_size) == -1)
     throw std::runtime_error("Could not get current window size");
-  if (ioctl(state.masterfd, TIOCSWINSZ, &state.window_size) == -1)
+  if (ioctl(state.masterfd, TIOCSWINSZ, &window_size) == -1)
     throw std::runtime_error("Could not set psuedo-terminal window size");
+  screen.resize(window_size.ws_row, window_size.ws_col);
+  published_state.publish_window_size(window_size.ws_row, window_size.ws_col);
+}
+
+/**
+ * Called by the output thread when gsc receives SIGINT, SIGQUIT or SIGTERM.
+ * The main thread ends the session the next time it checks for input.
+ */
+void Session::handle_interrupt(int sig)
+{
+  BOOST_LOG_TRIVIAL(debug) << "Received signal: " << sig;
+  int expected = 0;
+  if (!state.interrupt_signal.compare_exchange_strong(expected, sig)) return;
+  char c = 0;
+  if (write(state.interrupt_writefd, &c, 1) < 0) {
+  }
+}
+
+/**
+ * Collect the exit status of the shell without blocking. returns true if
+ * the shell has exited. only called by the output thread.
+ */
+bool Session::reap_slave(int &status)
+{
+  int   wstatus;
+  pid_t rc = waitpid(state.slavePID, &wstatus, WNOHANG);
+  if (rc != state.slavePID) return false;
+  // report a shell killed by a signal the way shells do
+  status = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+  BOOST_LOG_TRIVIAL(debug) << "Slave process exited with status " << status;
+  return true;
+}
+
+/**
+ * Called by the output thread when the shell has exited. The main thread
+ * ends the session the next time it checks for input.
+ */
+void Session::handle_slave_exit(int status)
+{
+  state.slave_exit_status = status;
+  state.slave_exited      = true;
+  char c = 0;
+  if (write(state.interrupt_writefd, &c, 1) < 0) {
+  }
+}
+
+/**
+ * Stop the shell if it is still running. It is sent SIGHUP, like a
+ * terminal being closed, and killed if it hasn't exited after
+ * slave_exit_timeout_milliseconds.
+ */
+void Session::terminate_slave()
+{
+  auto exited = [this]() {
+    pid_t rc = waitpid(state.slavePID, NULL, WNOHANG);
+    return rc == state.slavePID || (rc < 0 && errno == ECHILD);
+  };
+  if (state.slave_exited || exited()) return;
+
+  BOOST_LOG_TRIVIAL(debug) << "hanging up slave process";
+  kill(state.slavePID, SIGHUP);
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(state.slave_exit_timeout_milliseconds);
+  while (!exited()) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      BOOST_LOG_TRIVIAL(debug) << "killing slave process";
+      kill(state.slavePID, SIGKILL);
+      waitpid(state.slavePID, NULL, 0);
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+/**
+ * Called by the output thread when the terminal has been resized.
+ */
+void Session::handle_window_resize()
+{
+  try {
+    sync_window_size();
+    SessionStateSnapshot snapshot = published_state.read();
+    BOOST_LOG_TRIVIAL(debug) << "Window resized to " << snapshot.window_rows
+                             << "x" << snapshot.window_cols;
+  } catch (const std::runtime_error &e) {
+    // stdin is not a terminal
+    BOOST_LOG_TRIVIAL(debug) << e.what();
+  }
 }
 
 void Session::shutdown(bool early)
@@ -7,11 +7,15 @@
   * @date 01/11/19
   */
 
+#include <atomic>
+#include <functional>
+#include <optional>
 #include <thread>
 #include <string>
 #include <vector>
 
 #include <termios.h>
+#include <unistd.h>
 #include <netinet/in.h>
 
 #include "./SessionState.hpp"
@@ -19,6 +23,15 @@
 #include "./CharTree.hpp"
 #include "./Keybindings.hpp"
 #include "./CommandParser.hpp"
+#include "./Stats.hpp"
+#include "./OutputFilter.hpp"
+#include "./VirtualScreen.hpp"
+#include "./OutputMatcher.hpp"
+#include "./SlaveWriter.hpp"
+#include "./OutputRing.hpp"
+#include "./Broadcast.hpp"
+#include "./Signals.hpp"
+#include "./Checkpoint.hpp"
 
 
 
@@ -40,15 +53,58 @@ struct Session
 
   std::thread slave_output_thread;
   std::thread monitor_handler_thread;
+  std::thread stdout_writer_thread;
+  std::thread checkpoint_thread;
 
 
   SessionScript script;
+  // variables set by #CAPTURE. lines are rendered with them just before
+  // they are typed.
+  Context captured;
   SessionState state;
+  // what other threads see of the state
+  SessionStatePublisher published_state;
+  // repeated by SearchNext
+  struct
+  {
+    std::string text;
+    bool forward = true;
+  } last_search;
   termios terminal_settings;
 
   CommandParser command_parser;
 
-  Session(std::string filename, std::string shell = "", int monitor_prot = 3000);
+  // used when the output mode is FILTERED
+  OutputFilter output_filter;
+  std::string  filtered_output;
+
+  // what the terminal currently shows
+  VirtualScreen screen;
+  // used by #EXPECT
+  OutputMatcher output_matcher;
+
+  SessionStats stats;
+  // used for writes that don't need the typing effect
+  SlaveWriter slave_writer;
+  // output waiting to be written to stdout
+  OutputRing stdout_ring;
+  // viewers that the output is mirrored to
+  BroadcastHub broadcast;
+  // file that stats are written to when the session ends
+  std::string stats_filename;
+  // file the position is checkpointed to while the session runs. it is
+  // removed when the session exits. empty disables checkpoints.
+  std::string checkpoint_filename;
+  std::atomic<bool> checkpoint_done{false};
+  // position to fast-forward to before the script starts
+  std::optional<Checkpoint> resume_from;
+  // line number or label to fast-forward to if not resuming
+  std::string start_at;
+
+  // stdinfd and stdoutfd are the terminal the session is presented on.
+  // they only need to be changed to drive a session from another program.
+  Session(std::string filename, std::string shell = "", int monitor_prot = 3000,
+          int stdinfd = STDIN_FILENO, int stdoutfd = STDOUT_FILENO);
   ~Session();
 
 
@@ -56,11 +112,24 @@ struct Session
   int get_from_stdin(char& c);
   template<size_t N>
   int get_from_stdin(char (&c)[N]);
+  void wait_for_stdin();
+  bool forward_signal_key(char c);
   int send_to_stdout(char c);
+  int send_to_stdout(const char* buffer, size_t n);
+  int flush_output_filter();
+  int write_to_stdout(const char* buffer, size_t n);
+  void resync_stdout();
+  void resync_broadcast();
   int get_from_slave(char& c);
+  int get_from_slave(char* buffer, size_t n);
   int send_to_slave(char c);
+  int send_to_slave(const std::string& text);
+  int send_lines_to_slave(const std::vector<std::string>& lines);
+  void wait_for_slave_writer(size_t bytes);
 
   int send_state_to_monitor(sockaddr_in*);
+  int send_stats_to_monitor(sockaddr_in*);
+  int send_screen_to_monitor(sockaddr_in*);
 
   void daemon_process_monitor_requests();
 
@@ -68,7 +137,18 @@ struct Session
   void process_user_input();
   void process_script_line();
 
+  bool expect(const std::string& pattern);
+  bool expect_screen(const std::string& pattern);
+  bool capture(const std::string& argument, OutputMatcher::clock::time_point deadline,
+               bool report = true);
+  std::string render_captured(std::string_view text);
+  void report_expect_failure(const std::string& command, const std::string& pattern,
+                             const std::vector<std::string>& actual);
+
   void daemon_process_slave_output();
+  void daemon_write_stdout();
+  void daemon_write_checkpoints(Checkpoint checkpoint);
+  void stop_checkpoints();
 
 
   void init_shell_args();
@@ -77,6 +157,22 @@ struct Session
   bool amChild();
 
   void sync_window_size();
+  void handle_window_resize();
+  void handle_interrupt(int sig);
+  bool reap_slave(int& status);
+  void handle_slave_exit(int status);
+  void terminate_slave();
+  int exit_code();
+  void publish_state();
+  void jump_to_line(size_t line);
+  void fast_forward(size_t line);
+  std::optional<size_t> find_line(const std::string& text);
+  void wait_for_quiet_slave();
+  bool read_prompt(std::string& text,
+                   const std::function<void(const std::string&)>& on_change = nullptr);
+  bool search_script();
+
+  OutputMode visible_output_mode();
 
   void shutdown(bool early = false);
 
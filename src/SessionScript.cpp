@@ -1,44 +1,537 @@
 #include "./SessionScript.hpp"
+#include "./ScriptBundle.hpp"
 
 #include <string>
 #include <fstream>
 #include <algorithm>
+#include <functional>
+#include <iterator>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <stdexcept>
 #include <boost/filesystem.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
 
 #include <iostream>
 
+#include <sys/stat.h>
+
 void SessionScript::load(const std::string& filename)
 {
-  return this->load(filename, this->lines);
+  indexed = false;
+  if( commands.size() != lines.size() )
+  {
+    // lines were added without commands. they will be re-parsed by command().
+    commands.clear();
+    return this->load(filename, this->lines);
+  }
+  // only a script loaded from scratch is cached
+  bool cache = !cache_dir.empty() && lines.empty() && !is_script_bundle(filename);
+  if( cache && this->load_cached(filename) )
+    return;
+  this->load(filename, this->lines, this->commands);
+  if( cache )
+    this->save_cached(filename);
+}
+void SessionScript::load(const std::string& filename, ScriptLines& a_lines)
+{
+  indexed = false;
+  std::vector<CommandParser::Match> a_commands;
+  return this->load(filename, a_lines, a_commands);
+}
+void SessionScript::load(const std::string& filename, ScriptLines& a_lines, std::vector<CommandParser::Match>& a_commands)
+{
+  size_t start = a_lines.size();
+  if( is_script_bundle(filename) )
+  {
+    this->load_bundle(filename, a_lines, a_commands, this->context);
+  }
+  else
+  {
+    std::vector<std::string> include_chain;
+    auto& file = this->load_file(filename, include_chain);
+    // the text is shared with the cached file, not copied
+    a_lines.append(file.lines);
+    a_commands.insert(a_commands.end(), file.commands.begin(), file.commands.end());
+  }
+  if( expand_directives )
+    this->expand(a_lines, a_commands, start);
+}
+
+namespace {
+bool is_block_directive(const CommandParser::Match& match)
+{
+  return match && (match->first == "IF" || match->first == "ELSE" || match->first == "ENDIF"
+                || match->first == "FOR" || match->first == "ENDFOR");
+}
+}
+
+/**
+ * Expand the #IF and #FOR blocks in the lines loaded after start.
+ *
+ * The lines have already been rendered with the context. The output is
+ * written in a single pass: each line in a loop is rendered with the loop
+ * variables once per item (with a Renderer, which doesn't compile a
+ * regex), straight into the script, and lines outside of
+ * loops are kept. Directives are matched up front so that nothing has to
+ * be searched for while expanding.
+ */
+void SessionScript::expand(ScriptLines& a_lines, std::vector<CommandParser::Match>& a_commands, size_t start)
+{
+  if( std::none_of(a_commands.begin() + start, a_commands.end(), is_block_directive) )
+    return;
+
+  ScriptLines in_lines;
+  in_lines.append(a_lines, start, a_lines.size());
+  std::vector<CommandParser::Match> in_commands(std::make_move_iterator(a_commands.begin() + start), std::make_move_iterator(a_commands.end()));
+  a_lines.truncate(start);
+  a_commands.resize(start);
+
+  // partner[i] is the #ELSE or #ENDIF that closes the #IF on line i, the
+  // #ENDIF that closes the #ELSE on line i, or the #ENDFOR that closes
+  // the #FOR on line i.
+  size_t n = in_lines.size();
+  std::vector<size_t> partner(n, n);
+  std::vector<size_t> open;
+  auto unclosed = [&](size_t i) {
+    const std::string& name = in_commands[i]->first;
+    if( name == "FOR" )
+      return std::runtime_error("#FOR without #ENDFOR: "+std::string(in_lines[i]));
+    return std::runtime_error("#IF without #ENDIF: "+std::string(in_lines[i]));
+  };
+  for( size_t i = 0; i < n; ++i )
+  {
+    if( !is_block_directive(in_commands[i]) )
+      continue;
+    const std::string& name = in_commands[i]->first;
+    const std::string* top = open.empty() ? nullptr : &in_commands[open.back()]->first;
+    if( name == "IF" || name == "FOR" )
+    {
+      open.push_back(i);
+      continue;
+    }
+    if( name == "ELSE" && (!top || *top != "IF") )
+      throw std::runtime_error("#ELSE without #IF: "+std::string(in_lines[i]));
+    if( name == "ENDIF" && !top )
+      throw std::runtime_error("#ENDIF without #IF: "+std::string(in_lines[i]));
+    if( name == "ENDFOR" && !top )
+      throw std::runtime_error("#ENDFOR without #FOR: "+std::string(in_lines[i]));
+    // the innermost block has to be closed first
+    if( name != "ELSE" && (name == "ENDIF") == (*top == "FOR") )
+      throw unclosed(open.back());
+    partner[open.back()] = i;
+    open.pop_back();
+    if( name == "ELSE" )
+      open.push_back(i);
+  }
+  if( !open.empty() )
+    throw unclosed(open.back());
+
+  // the text of in_lines is still kept alive by a_lines, so lines that
+  // don't change are added without copying.
+  Context loop_context;
+  std::function<void(size_t,size_t)> emit = [&](size_t b, size_t e)
+  {
+    // the loop context doesn't change until the next call
+    Renderer renderer(loop_context, render_stag, render_etag);
+    for( size_t i = b; i < e; ++i )
+    {
+      if( !is_block_directive(in_commands[i]) )
+      {
+        if( loop_context.empty() )
+        {
+          a_lines.push_back_view(in_lines[i]);
+          a_commands.push_back(std::move(in_commands[i]));
+          continue;
+        }
+        std::string_view rendered = renderer.render(in_lines[i]);
+        // commands are evaluated on the rendered line. only a line that
+        // starts with the marker can be one.
+        size_t first = rendered.find_first_not_of(" \t\r\n\f\v");
+        if( rendered == in_lines[i] || first == std::string::npos || rendered[first] != '#' )
+          a_commands.push_back(rendered == in_lines[i] ? in_commands[i] : std::nullopt);
+        else
+          a_commands.push_back(command_parser.parse(rendered));
+        if( rendered.data() == in_lines[i].data() )
+          a_lines.push_back_view(rendered);
+        else
+          a_lines.push_back(rendered);
+        continue;
+      }
+
+      const std::string& name = in_commands[i]->first;
+      // rendered like the lines, so a variable has the same value in both
+      std::string argument(renderer.render(in_commands[i]->second));
+      if( name == "IF" )
+      {
+        size_t middle = partner[i];
+        size_t end = in_commands[middle]->first == "ELSE" ? partner[middle] : middle;
+        if( condition(argument, loop_context) )
+          emit(i+1, middle);
+        else if( middle != end )
+          emit(middle+1, end);
+        i = end;
+      }
+      else if( name == "FOR" )
+      {
+        std::vector<std::string> words;
+        boost::algorithm::split(words, argument, boost::algorithm::is_any_of(" \t,"), boost::algorithm::token_compress_on);
+        words.erase(std::remove(words.begin(), words.end(), ""), words.end());
+        if( words.size() < 2 || words[1] != "in" )
+          throw std::runtime_error("Invalid #FOR directive '"+std::string(in_lines[i])+"'. Expected #FOR: name in item1 item2 ...");
+
+        // loops may be nested, so a variable that is shadowed is put back
+        // when the loop ends.
+        const std::string& var = words[0];
+        auto shadowed = loop_context.find(var);
+        std::optional<std::string> saved;
+        if( shadowed != loop_context.end() )
+          saved = shadowed->second;
+        for( size_t j = 2; j < words.size(); ++j )
+        {
+          loop_context[var] = words[j];
+          emit(i+1, partner[i]);
+        }
+        if( saved )
+          loop_context[var] = *saved;
+        else
+          loop_context.erase(var);
+        i = partner[i];
+      }
+    }
+  };
+  emit(0, n);
+}
+
+/**
+ * Evaluate the condition of an #IF. The condition is a variable name,
+ * which is true if the variable is set and not empty, or NAME=VALUE or
+ * NAME!=VALUE. A leading ! negates it. Loop variables are looked up first.
+ */
+bool SessionScript::condition(const std::string& expression, const Context& loop_context) const
+{
+  std::string e = boost::algorithm::trim_copy(expression);
+  bool negate = !e.empty() && e[0] == '!';
+  if( negate )
+    e.erase(0, 1);
+
+  auto lookup = [&](const std::string& name) -> std::optional<std::string> {
+    auto it = loop_context.find(name);
+    if( it != loop_context.end() )
+      return it->second;
+    it = context.find(name);
+    if( it != context.end() )
+      return it->second;
+    return std::nullopt;
+  };
+
+  bool result;
+  size_t ne = e.find("!=");
+  size_t eq = e.find('=');
+  if( ne != std::string::npos && ne < eq )
+    result = lookup(boost::algorithm::trim_copy(e.substr(0, ne))).value_or("")
+          != boost::algorithm::trim_copy(e.substr(ne + 2));
+  else if( eq != std::string::npos )
+    result = lookup(boost::algorithm::trim_copy(e.substr(0, eq))).value_or("")
+          == boost::algorithm::trim_copy(e.substr(eq + 1));
+  else
+  {
+    boost::algorithm::trim(e);
+    if( e.empty() )
+      throw std::runtime_error("#IF needs a condition");
+    auto value = lookup(e);
+    result = value && !value->empty();
+  }
+  return negate ? !result : result;
 }
-void SessionScript::load(const std::string& filename, std::vector<std::string>& a_lines)
+
+/**
+ * Return the rendered lines of a file with all of its includes expanded.
+ *
+ * Files are read at most once. Later requests for the same file (for example, a snippet
+ * that is included several times) are served from the cache. The include chain is used
+ * to detect include cycles.
+ */
+const SessionScript::CachedFile& SessionScript::load_file(const std::string& filename, std::vector<std::string>& include_chain)
 {
   if(!boost::filesystem::exists(filename) || boost::filesystem::is_directory(filename))
     throw std::runtime_error("No such file "+filename);
 
-  std::ifstream in(filename.c_str());
+  boost::filesystem::path path = boost::filesystem::canonical(filename);
+  std::string key = path.string();
+
+  if( std::find(include_chain.begin(), include_chain.end(), key) != include_chain.end() )
+  {
+    std::string chain;
+    for( auto &f : include_chain )
+      chain += f + " -> ";
+    throw std::runtime_error("Include cycle detected: "+chain+key);
+  }
+
+  auto cached = file_cache.find(key);
+  if( cached != file_cache.end()
+   && cached->second.context == this->context
+   && cached->second.render_stag == this->render_stag
+   && cached->second.render_etag == this->render_etag )
+  {
+    auto& file = cached->second;
+    bool unchanged = true;
+    for( size_t i = 0; unchanged && i < file.dependencies.size(); ++i )
+      unchanged = stamp(file.dependencies[i]) == file.stamps[i];
+    if( unchanged )
+      return file;
+  }
+
+  CachedFile entry;
+  entry.context = this->context;
+  entry.render_stag = this->render_stag;
+  entry.render_etag = this->render_etag;
+
+  include_chain.push_back(key);
+  // stamped before reading, so that a change made while the file is read
+  // is seen the next time
+  entry.dependencies.push_back(key);
+  entry.stamps.push_back(stamp(key));
+
+  std::string text;
+  {
+    std::ifstream in(key.c_str(), std::ios::binary);
+    in.seekg(0, std::ios::end);
+    auto size = in.tellg();
+    if( size > 0 )
+    {
+      text.resize(static_cast<size_t>(size));
+      in.seekg(0, std::ios::beg);
+      in.read(&text[0], size);
+      text.resize(static_cast<size_t>(in.gcount()));
+    }
+  }
+
+  // split the file into chunks that end on a newline and parse them concurrently.
+  // small files are a single chunk parsed on this thread.
+  size_t threads = this->load_threads > 0 ? this->load_threads : std::thread::hardware_concurrency();
+  size_t chunk_bytes = std::max<size_t>( this->load_chunk_bytes, 1 );
+  size_t num_chunks = std::max<size_t>( 1, std::min<size_t>( threads, text.size() / chunk_bytes ) );
+
+  std::vector<const char*> bounds{text.data()};
+  for( size_t i = 1; i < num_chunks; ++i )
+  {
+    const char* target = text.data() + i*text.size()/num_chunks;
+    if( target < bounds.back() )
+      continue;
+    const char* newline = static_cast<const char*>(memchr(target, '\n', text.data() + text.size() - target));
+    if( !newline )
+      break;
+    if( newline+1 < text.data() + text.size() )
+      bounds.push_back(newline+1);
+  }
+  bounds.push_back(text.data() + text.size());
+
+  std::vector<ParsedChunk> chunks(bounds.size()-1);
+  std::vector<std::future<void>> tasks;
+  for( size_t i = 1; i < chunks.size(); ++i )
+    tasks.push_back( std::async(std::launch::async, [this,&chunks,&bounds,i](){ this->parse_chunk(bounds[i], bounds[i+1], chunks[i]); }) );
+  this->parse_chunk(bounds[0], bounds[1], chunks[0]);
+  for( auto& t : tasks )
+    t.get();
 
-  std::string line;
-  while( std::getline(in,line) )
+  // stitch the chunks back together in order. includes are loaded here, on
+  // this thread, because they share the file cache and the include chain.
+  size_t total = 0;
+  for( auto& c : chunks )
+    total += c.lines.size();
+  entry.lines.reserve(total);
+  entry.commands.reserve(total);
+  for( auto& c : chunks )
   {
-    // check for 
+    size_t next = 0;
+    auto append = [&entry,&c,&next](size_t until)
+    {
+      entry.lines.append(c.lines, next, until);
+      std::move(c.commands.begin()+next, c.commands.begin()+until, std::back_inserter(entry.commands));
+      next = until;
+    };
+    for( auto& inc : c.includes )
+    {
+      append(inc.first);
+      // included files are relative to the including file. fall back
+      // to the name as given (relative to the cwd) if there is no such file.
+      boost::filesystem::path include = inc.second;
+      if( include.is_relative() && boost::filesystem::exists(path.parent_path()/include) )
+        include = path.parent_path()/include;
+      auto& included = this->load_file( include.string(), include_chain );
+      entry.lines.append(included.lines);
+      entry.commands.insert(entry.commands.end(), included.commands.begin(), included.commands.end());
+      entry.dependencies.insert(entry.dependencies.end(), included.dependencies.begin(), included.dependencies.end());
+      entry.stamps.insert(entry.stamps.end(), included.stamps.begin(), included.stamps.end());
+    }
+    append(c.lines.size());
+  }
+
+  include_chain.pop_back();
+
+  return file_cache[key] = std::move(entry);
+}
+
+SessionScript::FileStamp SessionScript::stamp(const std::string& filename)
+{
+  FileStamp s;
+  struct stat st;
+  if( ::stat(filename.c_str(), &st) == 0 )
+  {
+    s.size = st.st_size;
+    s.sec = st.st_mtim.tv_sec;
+    s.nsec = st.st_mtim.tv_nsec;
+  }
+  return s;
+}
+
+/**
+ * Parse and render the lines in [begin,end).
+ *
+ * Lines are split the same way std::getline would split them. #INCLUDE lines are not
+ * added to the chunk, they are recorded with the position their lines go at so that
+ * load_file() can splice the included file in.
+ */
+void SessionScript::parse_chunk(const char* begin, const char* end, ParsedChunk& chunk)
+{
+  Renderer renderer(this->context, this->render_stag, this->render_etag);
+  while( begin < end )
+  {
+    const char* newline = static_cast<const char*>(memchr(begin, '\n', end - begin));
+    std::string_view line(begin, (newline ? newline : end) - begin);
+    begin = newline ? newline + 1 : end;
+
     auto match = command_parser.parse(line);
-    if(match)
+    if(match && match->first == "INCLUDE")
     {
-      if( match->first == "INCLUDE" )
-      {
-        this->load( match->second, a_lines );
-        continue; // don't add this line to script
-      }
+      chunk.includes.emplace_back(chunk.lines.size(), std::move(match->second));
+      continue; // don't add this line to script
     }
 
-    a_lines.push_back(::render(line, this->context,this->render_stag, this->render_etag));
+    std::string_view rendered = renderer.render(line);
+    // commands are evaluated on the rendered line.
+    if( rendered != line )
+      match = command_parser.parse(rendered);
+    chunk.lines.push_back(rendered);
+    chunk.commands.push_back(std::move(match));
   }
-  in.close();
 }
 
 void SessionScript::render()
 {
-  std::transform( this->lines.begin(), this->lines.end(), this->lines.begin(), [this](std::string& s){ return ::render(s,this->context,this->render_stag, this->render_etag); } );
+  Renderer renderer(this->context, this->render_stag, this->render_etag);
+  // lines that don't change keep their text, so the copy shares the old arena
+  ScriptLines rendered(this->lines);
+  rendered.truncate(0);
+  for( auto line : this->lines )
+  {
+    auto r = renderer.render(line);
+    if( r.data() == line.data() )
+      rendered.push_back_view(line);
+    else
+      rendered.push_back(r);
+  }
+  this->lines = std::move(rendered);
+  // rendering may have changed which lines are commands
+  this->commands.clear();
+  this->indexed = false;
+}
+
+/**
+ * Return the inline command on line i, if it has one.
+ */
+const CommandParser::Match& SessionScript::command(size_t i)
+{
+  if( commands.size() != lines.size() )
+  {
+    commands.resize(lines.size());
+    std::transform( this->lines.begin(), this->lines.end(), this->commands.begin(), [this](std::string_view s){ return command_parser.parse(s); } );
+  }
+  return commands[i];
+}
+
+/**
+ * Build the label table and the typeable line indexes.
+ */
+void SessionScript::build_index()
+{
+  const size_t none = lines.size();
+  labels.clear();
+  previous_typeable.assign(lines.size(), none);
+  next_typeable.assign(lines.size(), none);
+  indexed = true;
+
+  size_t last = none;
+  for( size_t i = 0; i < lines.size(); ++i )
+  {
+    auto& match = command(i);
+    if( !match )
+      last = i;
+    else if( match->first == "LABEL" )
+      labels.emplace( boost::algorithm::trim_copy(match->second), i );
+    previous_typeable[i] = last;
+  }
+  last = none;
+  for( size_t i = lines.size(); i-- > 0; )
+  {
+    if( !command(i) )
+      last = i;
+    next_typeable[i] = last;
+  }
 }
 
+/**
+ * Return the line of a #LABEL, if there is one with this name.
+ */
+std::optional<size_t> SessionScript::label(const std::string& name)
+{
+  if( !indexed || previous_typeable.size() != lines.size() )
+    build_index();
+  auto it = labels.find( boost::algorithm::trim_copy(name) );
+  if( it == labels.end() )
+    return std::nullopt;
+  return it->second;
+}
+
+/**
+ * Return line i if it is typed, otherwise the closest line before it that is.
+ */
+std::optional<size_t> SessionScript::previous_typeable_line(size_t i)
+{
+  if( !indexed || previous_typeable.size() != lines.size() )
+    build_index();
+  if( i >= lines.size() || previous_typeable[i] == lines.size() )
+    return std::nullopt;
+  return previous_typeable[i];
+}
+
+/**
+ * Return line i if it is typed, otherwise the closest line after it that is.
+ */
+std::optional<size_t> SessionScript::next_typeable_line(size_t i)
+{
+  if( !indexed || previous_typeable.size() != lines.size() )
+    build_index();
+  if( i >= lines.size() || next_typeable[i] == lines.size() )
+    return std::nullopt;
+  return next_typeable[i];
+}
+
+std::optional<size_t> SessionScript::search(const std::string& text, size_t from, bool forward) const
+{
+  size_t n = lines.size();
+  if( text.empty() || n == 0 )
+    return std::nullopt;
+  from %= n;
+  for( size_t k = 1; k <= n; ++k )
+  {
+    size_t i = forward ? (from + k) % n : (from + n - k) % n;
+    if( lines[i].find(text) != std::string::npos )
+      return i;
+  }
+  return std::nullopt;
+}
@@ -9,22 +9,119 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <optional>
 
 #include "./Utils.hpp"
 #include "./CommandParser.hpp"
+#include "./ScriptLines.hpp"
 
 struct SessionScript
 {
-  std::vector<std::string> lines;
+  // the script text is stored in an arena, see ScriptLines.hpp
+  ScriptLines lines;
+  // inline command found on each line (std::nullopt for lines that are sent to the shell).
+  // kept in sync with lines by load(). use command() to access.
+  std::vector<CommandParser::Match> commands;
   Context context;
   CommandParser command_parser;
   std::string render_stag = "%";
   std::string render_etag = "%";
+  // expand #IF:var/#ELSE/#ENDIF and #FOR:x in items/#ENDFOR when a script
+  // is loaded. turned off when compiling a bundle, so that they are
+  // expanded with the context the bundle is run with.
+  bool expand_directives = true;
+  // directory of the persistent cache of loaded scripts. empty disables
+  // the cache. entries are rendered scripts, so they contain the context,
+  // and the directory and files are only accessible by the user. entries
+  // that haven't been used for cache_max_age seconds are removed, and then
+  // the least recently used ones until the cache fits in cache_max_bytes.
+  std::string cache_dir;
+  size_t cache_max_bytes = 64 << 20;
+  long long cache_max_age = 30 * 24 * 60 * 60;
+  // large files are split into chunks that are parsed on separate threads.
+  // load_threads is the most chunks a file is split into (0 uses the number
+  // of cores), and a file is only split into chunks of at least load_chunk_bytes.
+  unsigned int load_threads = 0;
+  size_t load_chunk_bytes = 1 << 20;
 
   void load(const std::string& filename);
-  void load(const std::string& filename, std::vector<std::string>& a_lines);
+  void load(const std::string& filename, ScriptLines& a_lines);
   void render();
 
+  const CommandParser::Match& command(size_t i);
+
+  // navigation. the label table and the nearest typeable line (a line that
+  // is not a command) before/after each line are built once, so jumps are
+  // O(1) or O(log n).
+  std::optional<size_t> label(const std::string& name);
+  std::optional<size_t> previous_typeable_line(size_t i);
+  std::optional<size_t> next_typeable_line(size_t i);
+  // next line after from (or before it) that contains text, wrapping around
+  std::optional<size_t> search(const std::string& text, size_t from, bool forward = true) const;
+
+  void save_bundle(const std::string& filename);
+
+  protected:
+    // size and modification time of a file. size is -1 if the file
+    // could not be stat'ed.
+    struct FileStamp
+    {
+      long long size = -1;
+      long long sec = 0;
+      long long nsec = 0;
+      bool operator==(const FileStamp& other) const { return size == other.size && sec == other.sec && nsec == other.nsec; }
+    };
+    static FileStamp stamp(const std::string& filename);
+
+    // parsed files, keyed by canonical path. an entry is reused
+    // as long as neither the file nor anything it includes has been
+    // modified and it was rendered with the same context and tags.
+    struct CachedFile
+    {
+      Context context;
+      std::string render_stag;
+      std::string render_etag;
+      ScriptLines lines;
+      std::vector<CommandParser::Match> commands;
+      // canonical paths of the file and everything it includes, and
+      // their stamps from before they were read
+      std::vector<std::string> dependencies;
+      std::vector<FileStamp> stamps;
+    };
+    std::map<std::string,CachedFile> file_cache;
+
+    // lines parsed from one chunk of a file. includes holds the position
+    // in lines and the argument of each #INCLUDE in the chunk.
+    struct ParsedChunk
+    {
+      ScriptLines lines;
+      std::vector<CommandParser::Match> commands;
+      std::vector<std::pair<size_t,std::string>> includes;
+    };
+
+    // built from commands by build_index(). indexed is cleared when the
+    // script is loaded or rendered, since the lines may change without
+    // changing how many there are.
+    std::map<std::string,size_t> labels;
+    std::vector<size_t> previous_typeable;
+    std::vector<size_t> next_typeable;
+    bool indexed = false;
+    void build_index();
+
+    void load(const std::string& filename, ScriptLines& a_lines, std::vector<CommandParser::Match>& a_commands);
+    void expand(ScriptLines& a_lines, std::vector<CommandParser::Match>& a_commands, size_t start);
+    bool condition(const std::string& expression, const Context& loop_context) const;
+    const CachedFile& load_file(const std::string& filename, std::vector<std::string>& include_chain);
+    void parse_chunk(const char* begin, const char* end, ParsedChunk& chunk);
+    void load_bundle(const std::string& filename, ScriptLines& a_lines, std::vector<CommandParser::Match>& a_commands, const Context& a_context);
+
+    // the persistent cache. see ScriptBundle.cpp
+    std::string cache_filename(const std::string& filename) const;
+    bool load_cached(const std::string& filename);
+    void prune_cache() const;
+    void save_cached(const std::string& filename);
+
 };
 
 
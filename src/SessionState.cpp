@@ -0,0 +1,147 @@
+#include "./SessionState.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+void SessionStatePublisher::publish(const SessionStateSnapshot& snapshot)
+{
+  // an odd sequence tells readers that a publish is in progress
+  uint64_t seq = sequence.load(std::memory_order_relaxed);
+  sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  input_mode.store(static_cast<int>(snapshot.input_mode), std::memory_order_relaxed);
+  auto_pilot_mode.store(static_cast<int>(snapshot.auto_pilot_mode), std::memory_order_relaxed);
+  output_mode.store(static_cast<int>(snapshot.output_mode), std::memory_order_relaxed);
+  line.store(snapshot.line, std::memory_order_relaxed);
+  character.store(snapshot.character, std::memory_order_relaxed);
+  num_lines.store(snapshot.num_lines, std::memory_order_relaxed);
+
+  sequence.store(seq + 2, std::memory_order_release);
+}
+
+void SessionStatePublisher::publish_window_size(unsigned short rows, unsigned short cols)
+{
+  window_size.store(static_cast<uint32_t>(rows) << 16 | cols, std::memory_order_relaxed);
+}
+
+void SessionStatePublisher::publish_captured(const Context& a_captured)
+{
+  std::atomic_store(&captured, std::make_shared<const Context>(a_captured));
+}
+
+std::shared_ptr<const Context> SessionStatePublisher::read_captured() const
+{
+  return std::atomic_load(&captured);
+}
+
+void SessionStatePublisher::publish_lines(const ScriptLines& a_lines)
+{
+  // the copy shares the text of a_lines
+  std::atomic_store(&lines, std::make_shared<const ScriptLines>(a_lines));
+}
+
+std::shared_ptr<const ScriptLines> SessionStatePublisher::read_lines() const
+{
+  return std::atomic_load(&lines);
+}
+
+void SessionStatePublisher::publish_typed_line(size_t a_line, const std::string& text)
+{
+  std::atomic_store(&typed_line, std::make_shared<const TypedLine>(TypedLine{a_line, text}));
+}
+
+std::shared_ptr<const TypedLine> SessionStatePublisher::read_typed_line() const
+{
+  return std::atomic_load(&typed_line);
+}
+
+SessionStateSnapshot SessionStatePublisher::read() const
+{
+  SessionStateSnapshot snapshot;
+  uint64_t seq;
+  do {
+    seq = sequence.load(std::memory_order_acquire);
+    if (seq & 1) continue;
+
+    snapshot.input_mode = static_cast<UserInputMode>(input_mode.load(std::memory_order_relaxed));
+    snapshot.auto_pilot_mode = static_cast<AutoPilotMode>(auto_pilot_mode.load(std::memory_order_relaxed));
+    snapshot.output_mode = static_cast<OutputMode>(output_mode.load(std::memory_order_relaxed));
+    snapshot.line = line.load(std::memory_order_relaxed);
+    snapshot.character = character.load(std::memory_order_relaxed);
+    snapshot.num_lines = num_lines.load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) || sequence.load(std::memory_order_relaxed) != seq);
+
+  uint32_t window = window_size.load(std::memory_order_relaxed);
+  snapshot.window_rows = window >> 16;
+  snapshot.window_cols = window & 0xffff;
+  return snapshot;
+}
+
+/**
+ * Serialize the session state to the JSON document sent to monitors.
+ * lines must not be modified while this runs, so the session passes the
+ * copy it published after loading the script. If typed is the line at the
+ * snapshot's position, it is shown instead of the script line, so that the
+ * progress matches the characters that have been typed.
+ */
+std::string to_json(const SessionStateSnapshot& state, const ScriptLines& lines, const TypedLine* typed)
+{
+  boost::property_tree::ptree state_t;
+  std::stringstream           state_s;
+
+  if (state.input_mode == UserInputMode::INSERT)
+    state_t.put("input mode", "I");
+  else if (state.input_mode == UserInputMode::COMMAND)
+    state_t.put("input mode", "C");
+  else if (state.input_mode == UserInputMode::PASSTHROUGH)
+    state_t.put("input mode", "P");
+  else if (state.input_mode == UserInputMode::AUTO &&
+           state.auto_pilot_mode == AutoPilotMode::FULL)
+    state_t.put("input mode", "FA");
+  else if (state.input_mode == UserInputMode::AUTO)
+    state_t.put("input mode", "SA");
+
+  size_t num_lines = std::min(state.num_lines, lines.size());
+  size_t line      = state.line;
+  std::string current;
+  if (typed && typed->line == line)
+    current = typed->text;
+  else if (line < num_lines)
+    current = std::string(lines[line]);
+
+  if (line < num_lines)
+    state_t.put("current line", current);
+  else
+    state_t.put("current line", "None");
+
+  if (line > 0 && line - 1 < num_lines)
+    state_t.put("previous line", std::string(lines[line - 1]));
+  else
+    state_t.put("previous line", "None");
+
+  if (line + 1 < num_lines)
+    state_t.put("next line", std::string(lines[line + 1]));
+  else
+    state_t.put("next line", "None");
+
+  if (line < num_lines)
+    state_t.put("current line progress", current.substr(0, state.character));
+  else
+    state_t.put("current line progress", "");
+
+  state_t.put("current line number", 1 + line);
+  state_t.put("total number lines", num_lines);
+  // so that monitors can follow the presenter's terminal size
+  state_t.put("window rows", state.window_rows);
+  state_t.put("window cols", state.window_cols);
+
+  write_json(state_s, state_t);
+
+  return state_s.str();
+}
@@ -10,11 +10,15 @@
 #include <vector>
 #include <string>
 #include <atomic>
+#include <cstdint>
+#include <memory>
 
-//#include <termios.h>
+#include <termios.h>
 #include <sys/ioctl.h>
 
 #include "./Enums.hpp"
+#include "./Utils.hpp"
+#include "./ScriptLines.hpp"
 
 struct SessionState
 {
@@ -23,11 +27,29 @@ struct SessionState
   OutputMode output_mode = OutputMode::ALL;
   AutoPilotMode auto_pilot_mode = AutoPilotMode::FULL;
 
+  int stdinfd = 0;
+  int stdoutfd = 1;
+
   int masterfd = -2;
   int slavefd = -2;
 
+  // pipe used to wake up the output thread
+  int wakeup_readfd = -2;
+  int wakeup_writefd = -2;
+
+  // pipe used to wake up the main thread when gsc is interrupted
+  int interrupt_readfd = -2;
+  int interrupt_writefd = -2;
+  // signal that gsc was interrupted by, 0 if it wasn't
+  std::atomic<int> interrupt_signal{0};
+
   char *slave_device_name = NULL;
   pid_t slavePID = -2;
+  // set by the output thread when the shell exits by itself
+  std::atomic<bool> slave_exited{false};
+  std::atomic<int> slave_exit_status{0};
+  // how long the shell has to exit after being hung up before it is killed
+  int slave_exit_timeout_milliseconds = 1000;
   std::atomic<bool> shutdown;
 
   int monitor_port = 3000;
@@ -35,19 +57,108 @@ struct SessionState
 
   int auto_pilot_pause_milliseconds = 100;
 
+  // how often the position is checkpointed. 0 disables checkpoints.
+  int checkpoint_interval_milliseconds = 2000;
+  // how long the shell has to be silent before the next line is sent
+  // when fast-forwarding
+  int fast_forward_quiet_milliseconds = 100;
+  // turn stdout off while fast-forwarding
+  bool fast_forward_hide_output = false;
+
+  // how long #EXPECT waits for output to match
+  int expect_timeout_milliseconds = 10000;
+  int expect_failures = 0;
+
   bool process_mutli_char_keys = true;
 
   bool skipping = false;
 
   termios terminal_settings;
-  winsize window_size;
 
-  std::vector<std::string>::iterator script_line_it;
-  std::string::iterator line_character_it;
+  // the script cursor. indices stay valid when the script is copied,
+  // and can be shared with other threads or saved.
+  size_t script_line_index = 0;
+  size_t line_character_index = 0;
+
+  // move the cursor to the start of the next/previous line
+  void next_line() { ++script_line_index; line_character_index = 0; }
+  void previous_line() { --script_line_index; line_character_index = 0; }
 
   SessionState():shutdown(false){}
 };
 
+/**
+ * The part of the session state that other threads (e.g. the monitor)
+ * read. Positions are indices, so a snapshot stays valid while the main
+ * thread moves through the script.
+ */
+struct SessionStateSnapshot
+{
+  UserInputMode input_mode = UserInputMode::INSERT;
+  AutoPilotMode auto_pilot_mode = AutoPilotMode::FULL;
+  OutputMode output_mode = OutputMode::ALL;
+  // index of the current script line
+  size_t line = 0;
+  // index of the next character of the current line to be typed
+  size_t character = 0;
+  // number of script lines. zero until the script has been loaded.
+  size_t num_lines = 0;
+  unsigned short window_rows = 0;
+  unsigned short window_cols = 0;
+};
+
+// the text that is typed for a script line, i.e. the line rendered with
+// the captured variables. character counts keys in this text.
+struct TypedLine
+{
+  size_t line;
+  std::string text;
+};
+
+/**
+ * Publishes state snapshots from the main thread to any number of readers
+ * with a sequence lock. Publishing is a handful of relaxed stores, and
+ * readers retry instead of locking if they raced with a publish, so
+ * neither side ever waits on the other.
+ *
+ * The window size is updated separately by the output thread.
+ *
+ * Variables captured while the script runs, the loaded script and the line
+ * being typed are published as immutable copies. They change rarely, so a new
+ * copy is made for every change and readers share it without locking. Readers
+ * never touch the session's own script, which is written while it loads.
+ */
+class SessionStatePublisher
+{
+  public:
+    // only called by one thread
+    void publish(const SessionStateSnapshot& snapshot);
+    void publish_window_size(unsigned short rows, unsigned short cols);
+    void publish_captured(const Context& captured);
+    void publish_lines(const ScriptLines& lines);
+    void publish_typed_line(size_t line, const std::string& text);
+    SessionStateSnapshot read() const;
+    std::shared_ptr<const Context> read_captured() const;
+    std::shared_ptr<const ScriptLines> read_lines() const;
+    std::shared_ptr<const TypedLine> read_typed_line() const;
+
+  protected:
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<int> input_mode{0};
+    std::atomic<int> auto_pilot_mode{0};
+    std::atomic<int> output_mode{0};
+    std::atomic<uint64_t> line{0};
+    std::atomic<uint64_t> character{0};
+    std::atomic<uint64_t> num_lines{0};
+    std::atomic<uint32_t> window_size{0};
+    // only accessed with std::atomic_load/std::atomic_store
+    std::shared_ptr<const Context> captured = std::make_shared<const Context>();
+    std::shared_ptr<const ScriptLines> lines = std::make_shared<const ScriptLines>();
+    std::shared_ptr<const TypedLine> typed_line;
+};
+
+std::string to_json(const SessionStateSnapshot& state, const ScriptLines& lines, const TypedLine* typed = nullptr);
+
 
 
 #endif // include protector
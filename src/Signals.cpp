@@ -0,0 +1,74 @@
+#include "./Signals.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace {
+int pipe_fds[2] = {-1, -1};
+std::once_flag pipe_created;
+std::atomic<bool> pending[NSIG];
+
+void handler(int sig)
+{
+  int saved_errno = errno;
+  pending[sig] = true;
+  char c = 0;
+  // if the pipe is full the reader has a wakeup coming already
+  if(write(pipe_fds[1], &c, 1) < 0) { }
+  errno = saved_errno;
+}
+}
+
+void Signals::watch(int sig)
+{
+  if(sig <= 0 || sig >= NSIG)
+    throw std::runtime_error("Invalid signal number "+std::to_string(sig));
+  std::call_once(pipe_created, []() {
+    if(pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+      throw std::runtime_error("Could not create signal pipe.");
+  });
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handler;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if(sigaction(sig, &action, nullptr) != 0)
+    throw std::runtime_error("Could not setup handler for signal "+std::to_string(sig));
+}
+
+void Signals::unwatch(int sig)
+{
+  if(sig <= 0 || sig >= NSIG)
+    return;
+  signal(sig, SIG_DFL);
+  pending[sig] = false;
+}
+
+int Signals::fd()
+{
+  return pipe_fds[0];
+}
+
+void Signals::drain()
+{
+  if(pipe_fds[0] < 0)
+    return;
+  char buffer[64];
+  while(read(pipe_fds[0], buffer, sizeof(buffer)) > 0) { }
+}
+
+bool Signals::take(int sig)
+{
+  if(sig <= 0 || sig >= NSIG)
+    return false;
+  return pending[sig].exchange(false);
+}
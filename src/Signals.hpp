@@ -0,0 +1,33 @@
+#ifndef Signals_hpp
+#define Signals_hpp
+
+/** @file Signals.hpp
+  * @brief Delivers signals as events that can be polled for.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+/**
+ * Routes signals through a pipe (the self-pipe trick).
+ *
+ * The installed handler only records the signal and writes a byte to a
+ * pipe, which is all that is safe to do from a signal handler. Everything
+ * else happens in the thread that polls fd(): it calls drain() to empty the
+ * pipe and take() to find out which signals have arrived.
+ */
+class Signals
+{
+  public:
+    // throws std::runtime_error if the handler can't be installed
+    static void watch(int sig);
+    // restore the default action
+    static void unwatch(int sig);
+
+    // readable when a watched signal has arrived
+    static int fd();
+    static void drain();
+    // true if sig has arrived since the last call
+    static bool take(int sig);
+};
+
+#endif // include protector
@@ -0,0 +1,203 @@
+#include "./SlaveWriter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+#include <unistd.h>
+
+void SlaveWriter::put(char c)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  buffer += c == '\n' ? '\r' : c;
+}
+
+void SlaveWriter::put(const std::string& text)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t start = buffer.size();
+  buffer += text;
+  std::replace(buffer.begin() + start, buffer.end(), '\n', '\r');
+}
+
+size_t SlaveWriter::buffered() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return buffer.size();
+}
+
+size_t SlaveWriter::pending() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return queue.size() - queue_head;
+}
+
+int SlaveWriter::flush()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if(buffer.empty())
+    return 0;
+  std::string text;
+  text.swap(buffer);
+  iovec iov;
+  iov.iov_base = const_cast<char*>(text.data());
+  iov.iov_len = text.size();
+  return send(&iov, 1);
+}
+
+int SlaveWriter::write_lines(const std::vector<std::string>& lines)
+{
+  // lines with newlines need to be translated, so they are copied.
+  std::vector<std::string> translated;
+  translated.reserve(lines.size());
+  static char cr = '\r';
+  std::vector<iovec> iov;
+  iov.reserve(2 * lines.size());
+  for(auto& l : lines)
+  {
+    const std::string* line = &l;
+    if(l.find('\n') != std::string::npos)
+    {
+      translated.push_back(l);
+      std::replace(translated.back().begin(), translated.back().end(), '\n', '\r');
+      line = &translated.back();
+    }
+    if(!line->empty())
+      iov.push_back(iovec{const_cast<char*>(line->data()), line->size()});
+    iov.push_back(iovec{&cr, 1});
+  }
+
+  if(flush() < 0)
+    return -1;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  int total = 0;
+  for(size_t i = 0; i < iov.size(); i += IOV_MAX)
+  {
+    int rc = send(iov.data() + i, std::min<size_t>(IOV_MAX, iov.size() - i));
+    if(rc < 0)
+      return rc;
+    total += rc;
+  }
+  return total;
+}
+
+int SlaveWriter::drain()
+{
+  int rc;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    rc = drain_queue();
+  }
+  drained.notify_all();
+  return rc;
+}
+
+bool SlaveWriter::wait_until_below(size_t bytes, std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return drained.wait_for(lock, timeout, [&]() { return queue.size() - queue_head <= bytes; });
+}
+
+/**
+ * Write iov, queueing whatever can't be written now. Data is only written
+ * directly if nothing is queued, so the order is kept. iov is modified.
+ * mutex must be held.
+ */
+int SlaveWriter::send(iovec* iov, int count)
+{
+  int total = 0;
+  for(int i = 0; i < count; ++i)
+    total += iov[i].iov_len;
+
+  if(queue_head == queue.size() && write_some(iov, count) < 0)
+    return -1;
+
+  if(count > 0)
+  {
+    for(int i = 0; i < count; ++i)
+      queue.append(static_cast<char*>(iov[i].iov_base), iov[i].iov_len);
+    wakeup();
+  }
+  return total;
+}
+
+/**
+ * writev as much as possible without blocking. iov and count are advanced
+ * past the bytes that were written. returns the number of bytes written,
+ * or -1 on error.
+ */
+ssize_t SlaveWriter::write_some(iovec*& iov, int& count)
+{
+  ssize_t total = 0;
+  while(count > 0)
+  {
+    ssize_t rc = writev(fd, iov, count);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if(rc < 0)
+      return -1;
+    if(stats != nullptr)
+      stats->slave_written(rc);
+    total += rc;
+
+    size_t n = rc;
+    while(count > 0 && n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if(count > 0)
+    {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return total;
+}
+
+/**
+ * mutex must be held.
+ */
+int SlaveWriter::drain_queue()
+{
+  if(queue_head == queue.size())
+    return 0;
+  iovec iov;
+  iov.iov_base = const_cast<char*>(queue.data() + queue_head);
+  iov.iov_len = queue.size() - queue_head;
+  iovec* iovp = &iov;
+  int count = 1;
+  ssize_t rc = write_some(iovp, count);
+  if(rc < 0)
+  {
+    // the slave is gone. nothing more can be written.
+    queue.clear();
+    queue_head = 0;
+    return -1;
+  }
+  queue_head += rc;
+  if(queue_head == queue.size())
+  {
+    queue.clear();
+    queue_head = 0;
+  }
+  else if(queue_head > queue.size() / 2)
+  {
+    queue.erase(0, queue_head);
+    queue_head = 0;
+  }
+  return rc;
+}
+
+void SlaveWriter::wakeup()
+{
+  if(wakeup_fd < 0)
+    return;
+  char c = 0;
+  // if the pipe is full, the reader is already going to wake up
+  if(write(wakeup_fd, &c, 1) < 0) {}
+}
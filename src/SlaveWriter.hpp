@@ -0,0 +1,80 @@
+#ifndef SlaveWriter_hpp
+#define SlaveWriter_hpp
+
+/** @file SlaveWriter.hpp
+  * @brief Buffered, non-blocking writes to the slave (pty master) device.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "./Stats.hpp"
+
+/**
+ * Writes characters to the slave.
+ *
+ * Characters are buffered with put() and written with a single write() when
+ * flush() is called, so text that does not need the typing effect costs one
+ * syscall instead of one per character. write_lines() sends a block of
+ * lines, each terminated by a carriage return, with vectored writes.
+ *
+ * The fd may be non-blocking. When the slave's input buffer is full (the
+ * shell is busy), the part that could not be written is queued and
+ * written by drain() once the fd becomes writable. The thread that calls
+ * drain() is woken by a byte written to wakeup_fd whenever data is queued.
+ * Writers can pause with wait_until_below() to keep the queue from growing
+ * past a high-water mark.
+ *
+ * Newlines are translated to carriage returns, which is what the Enter key
+ * sends.
+ */
+class SlaveWriter
+{
+  public:
+    int fd = -1;
+    int wakeup_fd = -1;
+    SessionStats* stats = nullptr;
+    // the typing engine pauses while more than this many bytes are queued
+    size_t high_water_mark = 4096;
+
+    void put(char c);
+    void put(const std::string& text);
+    // send everything that has been put. returns the number of bytes
+    // accepted (written or queued), or -1 on error.
+    int flush();
+    size_t buffered() const;
+
+    // send each line followed by a carriage return. buffered characters
+    // are flushed first.
+    int write_lines(const std::vector<std::string>& lines);
+
+    // number of bytes queued but not written yet
+    size_t pending() const;
+    // write queued bytes. called when fd is writable. returns the number of
+    // bytes written, or -1 on error.
+    int drain();
+    // wait until no more than bytes are queued. returns false on timeout.
+    bool wait_until_below(size_t bytes, std::chrono::milliseconds timeout);
+
+  protected:
+    mutable std::mutex mutex;
+    std::condition_variable drained;
+
+    std::string buffer;
+    std::string queue;
+    size_t queue_head = 0;
+
+    int send(iovec* iov, int count);
+    ssize_t write_some(iovec*& iov, int& count);
+    int drain_queue();
+    void wakeup();
+};
+
+#endif // include protector
@@ -0,0 +1,163 @@
+#include "./Stats.hpp"
+
+#include <chrono>
+#include <sstream>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+int64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int Histogram::bucket(uint64_t value)
+{
+  // values below sub_buckets get a bucket each. above that, the bucket is
+  // given by the magnitude and the next sub_bucket_bits bits of the value.
+  if(value < sub_buckets)
+    return value;
+  int magnitude = 63 - __builtin_clzll(value) - sub_bucket_bits + 1;
+  return magnitude * sub_buckets + ((value >> (magnitude - 1)) & (sub_buckets - 1));
+}
+
+int64_t Histogram::bucket_value(int b)
+{
+  // largest value that falls in the bucket
+  int magnitude = b / sub_buckets;
+  uint64_t sub = b % sub_buckets;
+  if(magnitude == 0)
+    return sub;
+  uint64_t value = ((sub_buckets + sub + 1) << (magnitude - 1)) - 1;
+  return value > INT64_MAX ? INT64_MAX : value;
+}
+
+void Histogram::record(int64_t value)
+{
+  if(value < 0)
+    value = 0;
+  counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+
+  int64_t m = min_value.load(std::memory_order_relaxed);
+  while(value < m && !min_value.compare_exchange_weak(m, value, std::memory_order_relaxed));
+  m = max_value.load(std::memory_order_relaxed);
+  while(value > m && !max_value.compare_exchange_weak(m, value, std::memory_order_relaxed));
+}
+
+uint64_t Histogram::count() const
+{
+  return total.load(std::memory_order_relaxed);
+}
+
+int64_t Histogram::min() const
+{
+  return count() > 0 ? min_value.load(std::memory_order_relaxed) : 0;
+}
+
+int64_t Histogram::max() const
+{
+  return max_value.load(std::memory_order_relaxed);
+}
+
+double Histogram::mean() const
+{
+  uint64_t n = count();
+  return n > 0 ? static_cast<double>(sum.load(std::memory_order_relaxed)) / n : 0;
+}
+
+int64_t Histogram::percentile(double p) const
+{
+  uint64_t n = count();
+  if(n == 0)
+    return 0;
+  uint64_t target = static_cast<uint64_t>(p * n);
+  if(target >= n)
+    target = n - 1;
+  uint64_t seen = 0;
+  for(int b = 0; b < num_buckets; ++b)
+  {
+    seen += counts[b].load(std::memory_order_relaxed);
+    if(seen > target)
+      return std::min(bucket_value(b), max());
+  }
+  return max();
+}
+
+void SessionStats::key_read()
+{
+  key_time = now_ns();
+}
+
+void SessionStats::key_sent()
+{
+  if(key_time == 0)
+    return;
+  keystroke.record(now_ns() - key_time);
+  key_time = 0;
+}
+
+void SessionStats::slave_written(size_t bytes)
+{
+  slave_writes.fetch_add(1, std::memory_order_relaxed);
+  slave_bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+  int64_t none = 0;
+  echo_pending.compare_exchange_strong(none, now_ns(), std::memory_order_relaxed);
+}
+
+void SessionStats::slave_read(size_t bytes)
+{
+  slave_reads.fetch_add(1, std::memory_order_relaxed);
+  slave_bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+  int64_t sent = echo_pending.exchange(0, std::memory_order_relaxed);
+  if(sent != 0)
+    echo.record(now_ns() - sent);
+}
+
+namespace {
+boost::property_tree::ptree to_ptree(const Histogram& h)
+{
+  boost::property_tree::ptree t;
+  t.put("count", h.count());
+  t.put("mean_us", h.mean() / 1e3);
+  t.put("min_us", h.min() / 1e3);
+  t.put("p50_us", h.percentile(0.5) / 1e3);
+  t.put("p99_us", h.percentile(0.99) / 1e3);
+  t.put("p999_us", h.percentile(0.999) / 1e3);
+  t.put("max_us", h.max() / 1e3);
+  return t;
+}
+}
+
+std::string to_json(const SessionStats& stats)
+{
+  boost::property_tree::ptree stats_t;
+  std::stringstream stats_s;
+
+  double seconds = (now_ns() - stats.start_time) / 1e9;
+  uint64_t bytes_read = stats.slave_bytes_read.load();
+  uint64_t syscalls = stats.slave_reads.load() + stats.stdout_writes.load();
+
+  stats_t.put("elapsed seconds", seconds);
+  stats_t.put("output.slave bytes read", bytes_read);
+  stats_t.put("output.slave reads", stats.slave_reads.load());
+  stats_t.put("output.stdout bytes written", stats.stdout_bytes_written.load());
+  stats_t.put("output.stdout writes", stats.stdout_writes.load());
+  stats_t.put("output.stdout bytes dropped", stats.stdout_dropped_bytes.load());
+  stats_t.put("output.stdout bytes spilled", stats.stdout_spilled_bytes.load());
+  stats_t.put("output.bytes per second", seconds > 0 ? bytes_read / seconds : 0);
+  stats_t.put("output.syscalls per byte", bytes_read > 0 ? static_cast<double>(syscalls) / bytes_read : 0);
+  stats_t.put("input.slave bytes written", stats.slave_bytes_written.load());
+  stats_t.put("input.slave writes", stats.slave_writes.load());
+  stats_t.add_child("latency.keystroke", to_ptree(stats.keystroke));
+  stats_t.add_child("latency.echo", to_ptree(stats.echo));
+  stats_t.add_child("latency.run command", to_ptree(stats.run_command));
+  stats_t.add_child("latency.script line", to_ptree(stats.script_line));
+
+  write_json(stats_s, stats_t);
+
+  return stats_s.str();
+}
@@ -0,0 +1,92 @@
+#ifndef Stats_hpp
+#define Stats_hpp
+
+/** @file Stats.hpp
+  * @brief Latency and throughput instrumentation for sessions.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// nanoseconds on the steady clock
+int64_t now_ns();
+
+/**
+ * A lock-free histogram of durations in nanoseconds.
+ *
+ * Buckets are log-linear (like HDR histograms): each power of two is split into
+ * 2^sub_bucket_bits linear sub-buckets, so values are recorded with a relative
+ * error of about 3%. Recording is a few relaxed atomic increments, so it can be
+ * done from any thread without slowing down the hot path.
+ */
+class Histogram
+{
+  public:
+    static const int sub_bucket_bits = 5;
+    static const int sub_buckets = 1 << sub_bucket_bits;
+    static const int magnitudes = 64 - sub_bucket_bits;
+    static const int num_buckets = (magnitudes + 1) * sub_buckets;
+
+    void record(int64_t value);
+
+    uint64_t count() const;
+    int64_t min() const;
+    int64_t max() const;
+    double mean() const;
+    // smallest value that is larger than the fraction p of recorded values
+    int64_t percentile(double p) const;
+
+  protected:
+    std::atomic<uint64_t> counts[num_buckets] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<int64_t>  sum{0};
+    std::atomic<int64_t>  min_value{INT64_MAX};
+    std::atomic<int64_t>  max_value{0};
+
+    static int bucket(uint64_t value);
+    static int64_t bucket_value(int bucket);
+};
+
+/**
+ * Counters and histograms kept by a Session.
+ */
+struct SessionStats
+{
+  int64_t start_time = now_ns();
+
+  // time from reading a key press to sending the character(s) to the slave
+  Histogram keystroke;
+  // time from sending characters to the slave to the first byte read back
+  Histogram echo;
+  // time spent executing #RUN commands
+  Histogram run_command;
+  // time spent on each script line
+  Histogram script_line;
+
+  std::atomic<uint64_t> slave_bytes_read{0};
+  std::atomic<uint64_t> slave_reads{0};
+  std::atomic<uint64_t> slave_bytes_written{0};
+  std::atomic<uint64_t> slave_writes{0};
+  std::atomic<uint64_t> stdout_bytes_written{0};
+  std::atomic<uint64_t> stdout_writes{0};
+  // output that didn't fit in the stdout buffer
+  std::atomic<uint64_t> stdout_dropped_bytes{0};
+  std::atomic<uint64_t> stdout_spilled_bytes{0};
+
+  // time that the last key was read. only used by the main thread.
+  int64_t key_time = 0;
+  // time of the first write to the slave that has not been echoed yet.
+  std::atomic<int64_t> echo_pending{0};
+
+  void key_read();
+  void key_sent();
+  void slave_written(size_t bytes);
+  void slave_read(size_t bytes);
+};
+
+std::string to_json(const SessionStats& stats);
+
+#endif // include protector
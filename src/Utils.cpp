@@ -1,7 +1,13 @@
 #include <string>
 #include <regex>
+#include <stdexcept>
 #include "./Utils.hpp"
 
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/filesystem.hpp>
+
+#include <sys/stat.h>
+
 /**
  * Render a template string using a context
  */
@@ -16,3 +22,65 @@ std::string render( std::string templ, const Context& context, std::string stag,
 
   return templ;
 }
+
+bool has_regex_chars( const std::string& s )
+{
+  return s.find_first_of("\\^$.|?*+()[]{}") != std::string::npos;
+}
+
+Renderer::Renderer( const Context& a_context, const std::string& a_stag, const std::string& a_etag )
+: context(a_context), stag(a_stag), etag(a_etag)
+{
+  // render() matches each token with a regex and uses the value as a
+  // regex_replace format, where '$' is special.
+  plain_tags = !has_regex_chars(stag) && !has_regex_chars(etag);
+  plain = plain_tags;
+  for( auto &c : context )
+  {
+    tokens.emplace_back(stag+c.first+etag, c.second);
+    if( has_regex_chars(c.first) || tokens.back().first.empty() || c.second.find('$') != std::string::npos )
+      plain = false;
+  }
+}
+
+std::string_view Renderer::render( std::string_view text )
+{
+  if( context.empty() || (plain_tags && text.find(stag) == std::string_view::npos) )
+    return text;
+  if( !plain )
+  {
+    buffer = ::render(std::string(text), context, stag, etag);
+    return buffer;
+  }
+
+  // variables are replaced one after the other, like render() does
+  buffer.assign(text.data(), text.size());
+  for( auto &t : tokens )
+  {
+    size_t pos = buffer.find(t.first);
+    if( pos == std::string::npos )
+      continue;
+    scratch.clear();
+    size_t last = 0;
+    for( ; pos != std::string::npos; pos = buffer.find(t.first, last) )
+    {
+      scratch.append(buffer, last, pos - last);
+      scratch += t.second;
+      last = pos + t.first.size();
+    }
+    scratch.append(buffer, last, std::string::npos);
+    buffer.swap(scratch);
+  }
+  return buffer;
+}
+
+void create_private_directory( const std::string& path )
+{
+  try {
+    boost::filesystem::create_directories(path);
+  } catch(const boost::filesystem::filesystem_error& e) {
+    throw std::runtime_error("Could not create directory "+path+": "+e.what());
+  }
+  if( chmod(path.c_str(), S_IRWXU) != 0 )
+    throw std::runtime_error("Could not make directory "+path+" private");
+}
@@ -9,6 +9,9 @@
 #include <map>
 #include <exception>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 class normal_exit_exception : public std::exception {};
 class early_exit_exception : public std::exception {};
@@ -17,6 +20,37 @@ using Context = std::map<std::string, std::string>;
 
 
 std::string render( std::string templ, const Context& context, std::string stag="%", std::string etag="%" );
+// true if s contains characters that are special in a regex. render() is only
+// equivalent to a plain text replacement if the tags don't.
+bool has_regex_chars( const std::string& s );
+
+// render() for many lines with the same context. tokens are built once and
+// the result is written to a buffer that is reused, so rendering a line
+// doesn't allocate. falls back to render() when plain text replacement would
+// give a different result.
+class Renderer
+{
+  public:
+    Renderer( const Context& context, const std::string& stag="%", const std::string& etag="%" );
+    // the returned view is valid until the next call
+    std::string_view render( std::string_view text );
+
+  private:
+    const Context& context;
+    std::string stag;
+    std::string etag;
+    bool plain = true;
+    // the tags are plain text, so a line without stag has no tokens
+    bool plain_tags = true;
+    std::vector<std::pair<std::string,std::string>> tokens;
+    std::string buffer;
+    std::string scratch;
+};
+
+// create a directory (and its parents) that only the user can access, for
+// files that may contain context values. an existing directory is made
+// private too. throws std::runtime_error.
+void create_private_directory( const std::string& path );
 
 
 #endif // include protector
@@ -0,0 +1,879 @@
+#include "./VirtualScreen.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace {
+void append_utf8(std::string& out, uint32_t ch)
+{
+  if(ch < 0x80)
+  {
+    out += static_cast<char>(ch);
+  }
+  else if(ch < 0x800)
+  {
+    out += static_cast<char>(0xC0 | (ch >> 6));
+    out += static_cast<char>(0x80 | (ch & 0x3F));
+  }
+  else if(ch < 0x10000)
+  {
+    out += static_cast<char>(0xE0 | (ch >> 12));
+    out += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (ch & 0x3F));
+  }
+  else
+  {
+    out += static_cast<char>(0xF0 | (ch >> 18));
+    out += static_cast<char>(0x80 | ((ch >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (ch & 0x3F));
+  }
+}
+
+inline bool is_printable_ascii(unsigned char c)
+{
+  return c >= 0x20 && c < 0x7f;
+}
+}
+
+std::string ScreenSnapshot::row_text(int row) const
+{
+  std::string text;
+  const ScreenRow& cells = *lines[row];
+  size_t n = cells.size();
+  while(n > 0 && cells[n - 1].ch == ' ')
+    --n;
+  for(size_t i = 0; i < n; ++i)
+    append_utf8(text, cells[i].ch);
+  return text;
+}
+
+std::string ScreenSnapshot::text() const
+{
+  std::string text;
+  for(int r = 0; r < rows; ++r)
+  {
+    text += row_text(r);
+    text += '\n';
+  }
+  return text;
+}
+
+std::vector<int> ScreenSnapshot::dirty_rows(uint64_t since) const
+{
+  std::vector<int> dirty;
+  for(int r = 0; r < rows; ++r)
+    if(row_generations[r] > since)
+      dirty.push_back(r);
+  return dirty;
+}
+
+std::string to_json(const ScreenSnapshot& snapshot)
+{
+  boost::property_tree::ptree screen_t;
+  std::stringstream screen_s;
+
+  screen_t.put("rows", snapshot.rows);
+  screen_t.put("cols", snapshot.cols);
+  screen_t.put("generation", snapshot.generation);
+  screen_t.put("cursor.row", snapshot.cursor_row);
+  screen_t.put("cursor.col", snapshot.cursor_col);
+  screen_t.put("cursor.visible", snapshot.cursor_visible);
+  boost::property_tree::ptree lines_t;
+  for(int r = 0; r < snapshot.rows; ++r)
+  {
+    boost::property_tree::ptree line_t;
+    line_t.put("", snapshot.row_text(r));
+    lines_t.push_back(std::make_pair("", line_t));
+  }
+  screen_t.add_child("lines", lines_t);
+
+  write_json(screen_s, screen_t);
+
+  return screen_s.str();
+}
+
+namespace {
+void append_sgr(std::string& out, const ScreenCell& cell)
+{
+  out += "\x1b[0";
+  if(cell.attrs & ScreenCell::BOLD) out += ";1";
+  if(cell.attrs & ScreenCell::DIM) out += ";2";
+  if(cell.attrs & ScreenCell::ITALIC) out += ";3";
+  if(cell.attrs & ScreenCell::UNDERLINE) out += ";4";
+  if(cell.attrs & ScreenCell::BLINK) out += ";5";
+  if(cell.attrs & ScreenCell::INVERSE) out += ";7";
+  auto color = [&out](int base, int bright, int extended, uint8_t c) {
+    if(c < 8)
+      out += ";" + std::to_string(base + c);
+    else if(c < 16)
+      out += ";" + std::to_string(bright + c - 8);
+    else
+      out += ";" + std::to_string(extended) + ";5;" + std::to_string(c);
+  };
+  if(cell.attrs & ScreenCell::FG) color(30, 90, 38, cell.fg);
+  if(cell.attrs & ScreenCell::BG) color(40, 100, 48, cell.bg);
+  out += 'm';
+}
+}
+
+std::string to_ansi(const ScreenSnapshot& snapshot)
+{
+  // CAN aborts any escape sequence the terminal is in the middle of
+  std::string out = "\x18\x1b[0m\x1b[H\x1b[2J";
+  ScreenCell pen;
+  for(int r = 0; r < snapshot.rows; ++r)
+  {
+    const ScreenRow& cells = *snapshot.lines[r];
+    // trailing blanks with the default background don't need to be drawn
+    size_t n = cells.size();
+    while(n > 0 && cells[n - 1] == ScreenCell())
+      --n;
+    if(n == 0)
+      continue;
+    out += "\x1b[" + std::to_string(r + 1) + ";1H";
+    for(size_t c = 0; c < n; ++c)
+    {
+      if(cells[c].attrs != pen.attrs || cells[c].fg != pen.fg || cells[c].bg != pen.bg)
+      {
+        append_sgr(out, cells[c]);
+        pen = cells[c];
+      }
+      append_utf8(out, cells[c].ch);
+    }
+  }
+  append_sgr(out, snapshot.cursor_pen);
+  out += "\x1b[" + std::to_string(snapshot.cursor_row + 1) + ";" + std::to_string(snapshot.cursor_col + 1) + "H";
+  out += snapshot.cursor_visible ? "\x1b[?25h" : "\x1b[?25l";
+  return out;
+}
+
+VirtualScreen::VirtualScreen(int a_rows, int a_cols)
+    : rows(std::max(1, a_rows)), cols(std::max(1, a_cols))
+{
+  reset_state();
+}
+
+void VirtualScreen::reset()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  reset_state();
+}
+
+void VirtualScreen::reset_state()
+{
+  lines.clear();
+  for(int r = 0; r < rows; ++r)
+    lines.push_back(std::make_shared<ScreenRow>(cols));
+  row_generations.assign(rows, ++generation);
+  saved_lines.clear();
+  alternate = false;
+
+  cursor = Cursor();
+  saved_cursor = Cursor();
+  wrap_pending = false;
+  auto_wrap = true;
+  cursor_visible = true;
+  origin_mode = false;
+  scroll_top = 0;
+  scroll_bottom = rows - 1;
+
+  parser_state = ParserState::GROUND;
+  utf8_remaining = 0;
+}
+
+void VirtualScreen::resize(int a_rows, int a_cols)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  a_rows = std::max(1, a_rows);
+  a_cols = std::max(1, a_cols);
+  if(a_rows == rows && a_cols == cols)
+    return;
+
+  auto resize_lines = [&](std::vector<std::shared_ptr<ScreenRow>>& l, int keep_row) {
+    if(l.empty())
+      return;
+    // lines are pushed off the top if the row to keep would be cut off
+    int drop = std::max(0, keep_row - a_rows + 1);
+    l.erase(l.begin(), l.begin() + drop);
+    l.resize(a_rows);
+    for(auto& r : l)
+    {
+      if(!r)
+        r = std::make_shared<ScreenRow>(a_cols);
+      else if(static_cast<int>(r->size()) != a_cols)
+      {
+        r = std::make_shared<ScreenRow>(*r);
+        r->resize(a_cols);
+      }
+    }
+  };
+
+  int drop = std::max(0, cursor.row - a_rows + 1);
+  resize_lines(lines, cursor.row);
+  resize_lines(saved_lines, saved_cursor.row);
+  cursor.row -= drop;
+
+  rows = a_rows;
+  cols = a_cols;
+  row_generations.assign(rows, ++generation);
+  scroll_top = 0;
+  scroll_bottom = rows - 1;
+  wrap_pending = false;
+  cursor.row = std::min(cursor.row, rows - 1);
+  cursor.col = std::min(cursor.col, cols - 1);
+  saved_cursor.row = std::min(saved_cursor.row, rows - 1);
+  saved_cursor.col = std::min(saved_cursor.col, cols - 1);
+}
+
+ScreenSnapshot VirtualScreen::snapshot() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  ScreenSnapshot snap;
+  snap.rows = rows;
+  snap.cols = cols;
+  snap.cursor_row = cursor.row;
+  snap.cursor_col = cursor.col;
+  snap.cursor_visible = cursor_visible;
+  snap.cursor_pen = cursor.pen;
+  snap.generation = generation;
+  snap.lines.assign(lines.begin(), lines.end());
+  snap.row_generations = row_generations;
+  return snap;
+}
+
+/**
+ * Get a row for writing. Rows that are shared with a snapshot are copied first.
+ */
+ScreenRow& VirtualScreen::row(int r)
+{
+  auto& l = lines[r];
+  // use_count can only be too large here (a snapshot may be released
+  // concurrently), which just causes an unneeded copy.
+  if(l.use_count() > 1)
+    l = std::make_shared<ScreenRow>(*l);
+  row_generations[r] = generation;
+  return *l;
+}
+
+ScreenCell VirtualScreen::blank() const
+{
+  // erased cells get the current background color
+  ScreenCell cell;
+  cell.bg = cursor.pen.bg;
+  cell.attrs = cursor.pen.attrs & ScreenCell::BG;
+  return cell;
+}
+
+/**
+ * Feed a chunk of output to the screen.
+ */
+void VirtualScreen::process(const char* data, size_t size)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  ++generation;
+
+  size_t i = 0;
+  while(i < size)
+  {
+    unsigned char c = data[i];
+
+    if(parser_state == ParserState::GROUND)
+    {
+      if(utf8_remaining > 0)
+      {
+        if((c & 0xC0) == 0x80)
+        {
+          utf8_char = (utf8_char << 6) | (c & 0x3F);
+          if(--utf8_remaining == 0)
+            print(utf8_char);
+          ++i;
+          continue;
+        }
+        // truncated character
+        utf8_remaining = 0;
+        print(0xFFFD);
+      }
+
+      if(is_printable_ascii(c))
+      {
+        i += print_ascii(data + i, size - i);
+        continue;
+      }
+      ++i;
+      if(c < 0x20)
+        control(c);
+      else if(c >= 0xC2 && c <= 0xDF)
+        utf8_char = c & 0x1F, utf8_remaining = 1;
+      else if(c >= 0xE0 && c <= 0xEF)
+        utf8_char = c & 0x0F, utf8_remaining = 2;
+      else if(c >= 0xF0 && c <= 0xF4)
+        utf8_char = c & 0x07, utf8_remaining = 3;
+      else if(c != 0x7f)
+        print(0xFFFD);
+      continue;
+    }
+
+    ++i;
+    // control characters are executed in the middle of sequences
+    if(c == 0x18 || c == 0x1a)
+    {
+      parser_state = ParserState::GROUND;
+      continue;
+    }
+    if(c == 0x1b && parser_state != ParserState::OSC && parser_state != ParserState::STRING)
+    {
+      parser_state = ParserState::ESCAPE;
+      continue;
+    }
+    if(c < 0x20 && c != 0x1b && parser_state != ParserState::OSC && parser_state != ParserState::STRING)
+    {
+      control(c);
+      continue;
+    }
+
+    switch(parser_state)
+    {
+      case ParserState::ESCAPE:
+        if(c == '[')
+        {
+          parser_state = ParserState::CSI;
+          num_params = 1;
+          params[0] = -1;
+          private_marker = false;
+          intermediate = 0;
+        }
+        else if(c == ']')
+          parser_state = ParserState::OSC;
+        else if(c == 'P' || c == 'X' || c == '^' || c == '_')
+          parser_state = ParserState::STRING;
+        else if(c >= 0x20 && c <= 0x2f)
+        {
+          intermediate = c;
+          parser_state = ParserState::ESCAPE_INTERMEDIATE;
+        }
+        else
+        {
+          parser_state = ParserState::GROUND;
+          escape_dispatch(c);
+        }
+        break;
+      case ParserState::ESCAPE_INTERMEDIATE:
+        // character set designations, etc. are ignored
+        if(!(c >= 0x20 && c <= 0x2f))
+          parser_state = ParserState::GROUND;
+        break;
+      case ParserState::CSI:
+        if(c >= '0' && c <= '9')
+        {
+          int& p = params[num_params - 1];
+          p = std::min(65535, (p < 0 ? 0 : p) * 10 + (c - '0'));
+        }
+        else if(c == ';' || c == ':')
+        {
+          if(num_params < max_params)
+            params[num_params++] = -1;
+        }
+        else if(c >= 0x3c && c <= 0x3f)
+          private_marker = true;
+        else if(c >= 0x20 && c <= 0x2f)
+          intermediate = c;
+        else
+        {
+          parser_state = ParserState::GROUND;
+          if(c >= 0x40 && c <= 0x7e)
+            csi_dispatch(c);
+        }
+        break;
+      case ParserState::OSC:
+      case ParserState::STRING:
+        // window titles, etc. are ignored
+        if(c == 0x07)
+          parser_state = ParserState::GROUND;
+        else if(c == 0x1b)
+          parser_state = parser_state == ParserState::OSC ? ParserState::OSC_ESCAPE : ParserState::STRING_ESCAPE;
+        break;
+      case ParserState::OSC_ESCAPE:
+      case ParserState::STRING_ESCAPE:
+        if(c == '\\')
+          parser_state = ParserState::GROUND;
+        else
+          parser_state = parser_state == ParserState::OSC_ESCAPE ? ParserState::OSC : ParserState::STRING;
+        break;
+      case ParserState::GROUND:
+        break;
+    }
+  }
+}
+
+/**
+ * Write a run of printable ASCII. Returns the number of bytes consumed.
+ */
+size_t VirtualScreen::print_ascii(const char* data, size_t size)
+{
+  size_t n = 0;
+  while(n < size && is_printable_ascii(data[n]))
+  {
+    if(wrap_pending)
+    {
+      print(static_cast<unsigned char>(data[n++]));
+      continue;
+    }
+
+    ScreenRow& cells = row(cursor.row);
+    ScreenCell cell = cursor.pen;
+    int col = cursor.col;
+    while(n < size && col < cols && is_printable_ascii(data[n]))
+    {
+      cell.ch = static_cast<unsigned char>(data[n++]);
+      cells[col++] = cell;
+    }
+    if(col >= cols)
+    {
+      cursor.col = cols - 1;
+      wrap_pending = auto_wrap;
+    }
+    else
+    {
+      cursor.col = col;
+    }
+  }
+  return n;
+}
+
+void VirtualScreen::print(uint32_t ch)
+{
+  if(wrap_pending)
+  {
+    cursor.col = 0;
+    line_feed();
+    wrap_pending = false;
+  }
+  ScreenCell cell = cursor.pen;
+  cell.ch = ch;
+  row(cursor.row)[cursor.col] = cell;
+  if(cursor.col + 1 < cols)
+    ++cursor.col;
+  else
+    wrap_pending = auto_wrap;
+}
+
+void VirtualScreen::control(unsigned char c)
+{
+  switch(c)
+  {
+    case 0x08: // BS
+      if(cursor.col > 0)
+        --cursor.col;
+      wrap_pending = false;
+      break;
+    case 0x09: // HT
+      cursor.col = std::min(cols - 1, (cursor.col / 8 + 1) * 8);
+      break;
+    case 0x0a: // LF
+    case 0x0b: // VT
+    case 0x0c: // FF
+      line_feed();
+      break;
+    case 0x0d: // CR
+      cursor.col = 0;
+      wrap_pending = false;
+      break;
+    case 0x1b:
+      parser_state = ParserState::ESCAPE;
+      break;
+    default:
+      break;
+  }
+}
+
+void VirtualScreen::escape_dispatch(unsigned char c)
+{
+  switch(c)
+  {
+    case '7':
+      saved_cursor = cursor;
+      break;
+    case '8':
+      cursor = saved_cursor;
+      wrap_pending = false;
+      break;
+    case 'D':
+      line_feed();
+      break;
+    case 'E':
+      cursor.col = 0;
+      line_feed();
+      break;
+    case 'M':
+      reverse_line_feed();
+      break;
+    case 'c':
+      reset_state();
+      break;
+    default:
+      break;
+  }
+}
+
+int VirtualScreen::param(int i, int def) const
+{
+  return i < num_params && params[i] >= 0 ? params[i] : def;
+}
+
+void VirtualScreen::csi_dispatch(unsigned char c)
+{
+  if(private_marker)
+  {
+    if(c != 'h' && c != 'l')
+      return;
+    bool on = c == 'h';
+    for(int i = 0; i < num_params; ++i)
+    {
+      switch(params[i])
+      {
+        case 6:
+          origin_mode = on;
+          move_to(0, 0);
+          break;
+        case 7:
+          auto_wrap = on;
+          break;
+        case 25:
+          cursor_visible = on;
+          break;
+        case 47:
+        case 1047:
+          set_alternate(on);
+          break;
+        case 1049:
+          if(on)
+            saved_cursor = cursor;
+          set_alternate(on);
+          if(!on)
+            cursor = saved_cursor;
+          break;
+        default:
+          break;
+      }
+    }
+    return;
+  }
+  if(intermediate != 0)
+    return;
+
+  int n = std::max(1, param(0, 1));
+  int top = cursor.row >= scroll_top && cursor.row <= scroll_bottom ? scroll_top : 0;
+  int bottom = cursor.row >= scroll_top && cursor.row <= scroll_bottom ? scroll_bottom : rows - 1;
+  wrap_pending = false;
+
+  switch(c)
+  {
+    case '@': // ICH
+    {
+      ScreenRow& cells = row(cursor.row);
+      n = std::min(n, cols - cursor.col);
+      std::copy_backward(cells.begin() + cursor.col, cells.end() - n, cells.end());
+      std::fill(cells.begin() + cursor.col, cells.begin() + cursor.col + n, blank());
+      break;
+    }
+    case 'A': // CUU
+      cursor.row = std::max(top, cursor.row - n);
+      break;
+    case 'B': // CUD
+    case 'e': // VPR
+      cursor.row = std::min(bottom, cursor.row + n);
+      break;
+    case 'C': // CUF
+    case 'a': // HPR
+      cursor.col = std::min(cols - 1, cursor.col + n);
+      break;
+    case 'D': // CUB
+      cursor.col = std::max(0, cursor.col - n);
+      break;
+    case 'E': // CNL
+      cursor.row = std::min(bottom, cursor.row + n);
+      cursor.col = 0;
+      break;
+    case 'F': // CPL
+      cursor.row = std::max(top, cursor.row - n);
+      cursor.col = 0;
+      break;
+    case 'G': // CHA
+    case '`': // HPA
+      cursor.col = std::min(cols - 1, n - 1);
+      break;
+    case 'H': // CUP
+    case 'f': // HVP
+      move_to(std::max(1, param(0, 1)) - 1, std::max(1, param(1, 1)) - 1);
+      break;
+    case 'd': // VPA
+      move_to(n - 1, cursor.col);
+      break;
+    case 'J': // ED
+      switch(param(0, 0))
+      {
+        case 0:
+          erase(cursor.row, cursor.col, cols);
+          for(int r = cursor.row + 1; r < rows; ++r)
+            erase(r, 0, cols);
+          break;
+        case 1:
+          for(int r = 0; r < cursor.row; ++r)
+            erase(r, 0, cols);
+          erase(cursor.row, 0, cursor.col + 1);
+          break;
+        case 2:
+        case 3:
+          for(int r = 0; r < rows; ++r)
+            erase(r, 0, cols);
+          break;
+      }
+      break;
+    case 'K': // EL
+      switch(param(0, 0))
+      {
+        case 0:
+          erase(cursor.row, cursor.col, cols);
+          break;
+        case 1:
+          erase(cursor.row, 0, cursor.col + 1);
+          break;
+        case 2:
+          erase(cursor.row, 0, cols);
+          break;
+      }
+      break;
+    case 'L': // IL
+      if(cursor.row >= scroll_top && cursor.row <= scroll_bottom)
+        scroll_down(cursor.row, scroll_bottom, n);
+      cursor.col = 0;
+      break;
+    case 'M': // DL
+      if(cursor.row >= scroll_top && cursor.row <= scroll_bottom)
+        scroll_up(cursor.row, scroll_bottom, n);
+      cursor.col = 0;
+      break;
+    case 'P': // DCH
+    {
+      ScreenRow& cells = row(cursor.row);
+      n = std::min(n, cols - cursor.col);
+      std::copy(cells.begin() + cursor.col + n, cells.end(), cells.begin() + cursor.col);
+      std::fill(cells.end() - n, cells.end(), blank());
+      break;
+    }
+    case 'X': // ECH
+      erase(cursor.row, cursor.col, std::min(cols, cursor.col + n));
+      break;
+    case 'S': // SU
+      scroll_up(scroll_top, scroll_bottom, n);
+      break;
+    case 'T': // SD
+      scroll_down(scroll_top, scroll_bottom, n);
+      break;
+    case 'm':
+      sgr();
+      break;
+    case 'r': // DECSTBM
+    {
+      int t = std::max(1, param(0, 1)) - 1;
+      int b = std::min(rows, std::max(1, param(1, rows))) - 1;
+      if(t < b)
+      {
+        scroll_top = t;
+        scroll_bottom = b;
+        move_to(0, 0);
+      }
+      break;
+    }
+    case 's':
+      saved_cursor = cursor;
+      break;
+    case 'u':
+      cursor = saved_cursor;
+      break;
+    default:
+      break;
+  }
+}
+
+void VirtualScreen::sgr()
+{
+  ScreenCell& pen = cursor.pen;
+  for(int i = 0; i < num_params; ++i)
+  {
+    int p = params[i] < 0 ? 0 : params[i];
+    switch(p)
+    {
+      case 0:
+        pen = ScreenCell();
+        break;
+      case 1:
+        pen.attrs |= ScreenCell::BOLD;
+        break;
+      case 2:
+        pen.attrs |= ScreenCell::DIM;
+        break;
+      case 3:
+        pen.attrs |= ScreenCell::ITALIC;
+        break;
+      case 4:
+        pen.attrs |= ScreenCell::UNDERLINE;
+        break;
+      case 5:
+        pen.attrs |= ScreenCell::BLINK;
+        break;
+      case 7:
+        pen.attrs |= ScreenCell::INVERSE;
+        break;
+      case 22:
+        pen.attrs &= ~(ScreenCell::BOLD | ScreenCell::DIM);
+        break;
+      case 23:
+        pen.attrs &= ~ScreenCell::ITALIC;
+        break;
+      case 24:
+        pen.attrs &= ~ScreenCell::UNDERLINE;
+        break;
+      case 25:
+        pen.attrs &= ~ScreenCell::BLINK;
+        break;
+      case 27:
+        pen.attrs &= ~ScreenCell::INVERSE;
+        break;
+      case 39:
+        pen.attrs &= ~ScreenCell::FG;
+        pen.fg = 0;
+        break;
+      case 49:
+        pen.attrs &= ~ScreenCell::BG;
+        pen.bg = 0;
+        break;
+      case 38:
+      case 48:
+      {
+        // 38;5;n is a palette color. direct colors (38;2;r;g;b) are skipped.
+        int mode = param(i + 1, 0);
+        if(mode == 5 && i + 2 < num_params)
+        {
+          uint8_t color = std::min(255, param(i + 2, 0));
+          if(p == 38)
+            pen.fg = color, pen.attrs |= ScreenCell::FG;
+          else
+            pen.bg = color, pen.attrs |= ScreenCell::BG;
+          i += 2;
+        }
+        else if(mode == 2)
+        {
+          i += 4;
+        }
+        else
+        {
+          i += 1;
+        }
+        break;
+      }
+      default:
+        if(p >= 30 && p <= 37)
+          pen.fg = p - 30, pen.attrs |= ScreenCell::FG;
+        else if(p >= 40 && p <= 47)
+          pen.bg = p - 40, pen.attrs |= ScreenCell::BG;
+        else if(p >= 90 && p <= 97)
+          pen.fg = p - 90 + 8, pen.attrs |= ScreenCell::FG;
+        else if(p >= 100 && p <= 107)
+          pen.bg = p - 100 + 8, pen.attrs |= ScreenCell::BG;
+        break;
+    }
+  }
+}
+
+void VirtualScreen::line_feed()
+{
+  if(cursor.row == scroll_bottom)
+    scroll_up(scroll_top, scroll_bottom, 1);
+  else if(cursor.row < rows - 1)
+    ++cursor.row;
+}
+
+void VirtualScreen::reverse_line_feed()
+{
+  if(cursor.row == scroll_top)
+    scroll_down(scroll_top, scroll_bottom, 1);
+  else if(cursor.row > 0)
+    --cursor.row;
+}
+
+/**
+ * Scroll rows top..bottom (inclusive) up by n. Rows are moved, not copied.
+ */
+void VirtualScreen::scroll_up(int top, int bottom, int n)
+{
+  n = std::min(n, bottom - top + 1);
+  std::rotate(lines.begin() + top, lines.begin() + top + n, lines.begin() + bottom + 1);
+  for(int r = bottom - n + 1; r <= bottom; ++r)
+    clear_row(r);
+  for(int r = top; r <= bottom; ++r)
+    row_generations[r] = generation;
+}
+
+void VirtualScreen::scroll_down(int top, int bottom, int n)
+{
+  n = std::min(n, bottom - top + 1);
+  std::rotate(lines.begin() + top, lines.begin() + bottom + 1 - n, lines.begin() + bottom + 1);
+  for(int r = top; r < top + n; ++r)
+    clear_row(r);
+  for(int r = top; r <= bottom; ++r)
+    row_generations[r] = generation;
+}
+
+/**
+ * Blank a row that has been scrolled in. The row that was scrolled out is
+ * reused unless a snapshot still holds it.
+ */
+void VirtualScreen::clear_row(int r)
+{
+  auto& l = lines[r];
+  if(l.use_count() > 1)
+    l = std::make_shared<ScreenRow>(cols, blank());
+  else
+    std::fill(l->begin(), l->end(), blank());
+}
+
+void VirtualScreen::erase(int r, int from, int to)
+{
+  if(from >= to)
+    return;
+  ScreenRow& cells = row(r);
+  std::fill(cells.begin() + from, cells.begin() + std::min(to, cols), blank());
+}
+
+void VirtualScreen::move_to(int r, int c)
+{
+  if(origin_mode)
+    r = std::min(scroll_bottom, r + scroll_top);
+  cursor.row = std::max(0, std::min(rows - 1, r));
+  cursor.col = std::max(0, std::min(cols - 1, c));
+  wrap_pending = false;
+}
+
+void VirtualScreen::set_alternate(bool on)
+{
+  if(on == alternate)
+    return;
+  alternate = on;
+  if(on)
+  {
+    saved_lines = lines;
+    for(auto& l : lines)
+      l = std::make_shared<ScreenRow>(cols);
+  }
+  else
+  {
+    lines = saved_lines;
+    saved_lines.clear();
+  }
+  row_generations.assign(rows, generation);
+}
@@ -0,0 +1,171 @@
+#ifndef VirtualScreen_hpp
+#define VirtualScreen_hpp
+
+/** @file VirtualScreen.hpp
+  * @brief Incremental VT100/xterm parser and in-memory screen model.
+  * @author C.D. Clark III
+  * @date 10/19/26
+  */
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * A single character cell. Kept to 8 bytes so that a row of a normal
+ * terminal fits in a few cache lines.
+ */
+struct ScreenCell
+{
+  enum Attributes : uint8_t {
+    BOLD      = 1 << 0,
+    DIM       = 1 << 1,
+    ITALIC    = 1 << 2,
+    UNDERLINE = 1 << 3,
+    BLINK     = 1 << 4,
+    INVERSE   = 1 << 5,
+    // fg/bg hold a palette index. default colors are used if not set.
+    FG        = 1 << 6,
+    BG        = 1 << 7
+  };
+
+  uint32_t ch = ' ';
+  uint8_t  fg = 0;
+  uint8_t  bg = 0;
+  uint8_t  attrs = 0;
+  uint8_t  reserved = 0;
+
+  bool operator==(const ScreenCell& o) const
+  {
+    return ch == o.ch && fg == o.fg && bg == o.bg && attrs == o.attrs;
+  }
+  bool operator!=(const ScreenCell& o) const { return !(*this == o); }
+};
+
+using ScreenRow = std::vector<ScreenCell>;
+
+/**
+ * An immutable copy of the screen. Rows are shared with the screen until
+ * the screen writes to them, so taking a snapshot only copies pointers.
+ */
+struct ScreenSnapshot
+{
+  int rows = 0;
+  int cols = 0;
+  int cursor_row = 0;
+  int cursor_col = 0;
+  bool cursor_visible = true;
+  // attributes that new characters are written with
+  ScreenCell cursor_pen;
+  // incremented each time the screen processes output
+  uint64_t generation = 0;
+
+  std::vector<std::shared_ptr<const ScreenRow>> lines;
+  // generation that each row was last changed in
+  std::vector<uint64_t> row_generations;
+
+  // text of a row, UTF-8 encoded with trailing blanks removed
+  std::string row_text(int row) const;
+  // text of the whole screen, one line per row
+  std::string text() const;
+  // rows that have changed since the given generation
+  std::vector<int> dirty_rows(uint64_t since) const;
+};
+
+std::string to_json(const ScreenSnapshot& snapshot);
+// escape sequences that repaint a terminal to show the snapshot
+std::string to_ansi(const ScreenSnapshot& snapshot);
+
+/**
+ * Tracks what the terminal shows by parsing the output stream.
+ *
+ * Output can be fed in arbitrary chunks; escape sequences and UTF-8
+ * characters that are split between chunks are handled. Printable ASCII is
+ * copied into the current row in runs, so the common case costs a few ns
+ * per byte.
+ *
+ * Supported are the usual cursor movement, erase, insert/delete, scroll
+ * region, SGR (including 256 color), save/restore cursor and the alternate
+ * screen sequences. Everything else is parsed and ignored. All characters
+ * are assumed to be one cell wide.
+ *
+ * The screen can be written by one thread and snapshot by others.
+ */
+class VirtualScreen
+{
+  public:
+    VirtualScreen(int rows = 24, int cols = 80);
+
+    void process(const char* data, size_t size);
+    void resize(int rows, int cols);
+    void reset();
+
+    ScreenSnapshot snapshot() const;
+
+  protected:
+    enum class ParserState { GROUND, ESCAPE, ESCAPE_INTERMEDIATE, CSI, OSC, OSC_ESCAPE, STRING, STRING_ESCAPE };
+
+    struct Cursor
+    {
+      int row = 0;
+      int col = 0;
+      ScreenCell pen;
+    };
+
+    mutable std::mutex mutex;
+
+    int rows;
+    int cols;
+    std::vector<std::shared_ptr<ScreenRow>> lines;
+    std::vector<uint64_t> row_generations;
+    uint64_t generation = 0;
+
+    Cursor cursor;
+    Cursor saved_cursor;
+    // xterm defers wrapping until the next character is printed
+    bool wrap_pending = false;
+    bool auto_wrap = true;
+    bool cursor_visible = true;
+    bool origin_mode = false;
+    int scroll_top = 0;
+    int scroll_bottom = 0;
+
+    // primary screen while the alternate screen is in use
+    std::vector<std::shared_ptr<ScreenRow>> saved_lines;
+    bool alternate = false;
+
+    ParserState parser_state = ParserState::GROUND;
+    static const int max_params = 16;
+    int params[max_params];
+    int num_params = 0;
+    bool private_marker = false;
+    char intermediate = 0;
+
+    uint32_t utf8_char = 0;
+    int utf8_remaining = 0;
+
+    void reset_state();
+    ScreenRow& row(int r);
+    ScreenCell blank() const;
+
+    void print(uint32_t ch);
+    size_t print_ascii(const char* data, size_t size);
+    void control(unsigned char c);
+    void escape_dispatch(unsigned char c);
+    void csi_dispatch(unsigned char c);
+    void sgr();
+
+    void line_feed();
+    void reverse_line_feed();
+    void scroll_up(int top, int bottom, int n);
+    void scroll_down(int top, int bottom, int n);
+    void clear_row(int r);
+    void erase(int r, int from, int to);
+    void move_to(int r, int c);
+    void set_alternate(bool on);
+    int param(int i, int def) const;
+};
+
+#endif // include protector
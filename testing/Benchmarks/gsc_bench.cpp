@@ -0,0 +1,400 @@
+/** @file gsc_bench.cpp
+  * @brief Micro-benchmarks for the script loading, parsing and keystroke hot paths.
+  *
+  * Run with --json <file> to save the results so that they can be compared
+  * between versions.
+  */
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "CharTree.hpp"
+#include "CommandParser.hpp"
+#include "Keybindings.hpp"
+#include "SessionScript.hpp"
+#include "SessionState.hpp"
+#include "Utils.hpp"
+#include "VirtualScreen.hpp"
+
+namespace po = boost::program_options;
+
+// prevent the compiler from optimizing away a result
+template<typename T>
+void do_not_optimize(const T& t)
+{
+  asm volatile("" : : "g"(&t) : "memory");
+}
+
+struct Benchmark
+{
+  std::string name;
+  // run the benchmarked operation n times
+  std::function<void(size_t n)> run;
+  // number of bytes processed by one operation. used to report throughput.
+  size_t bytes = 0;
+  // run exactly once per repetition. used for slow benchmarks.
+  bool single_shot = false;
+};
+
+struct Result
+{
+  std::string name;
+  size_t iterations;
+  double mean_ns;
+  double min_ns;
+  double max_ns;
+  size_t bytes;
+};
+
+Result measure(const Benchmark& b, double min_time, int repetitions)
+{
+  using clock = std::chrono::steady_clock;
+  auto time_n = [&b](size_t n) {
+    auto start = clock::now();
+    b.run(n);
+    return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+  };
+
+  // find the number of iterations needed to run for at least min_time.
+  size_t n = 1;
+  if(!b.single_shot)
+  {
+    for(;;)
+    {
+      double t = time_n(n);
+      if(t > min_time*1e9 || n > (1ul << 40))
+        break;
+      n = t < 1e3 ? n * 100 : static_cast<size_t>(n * 1.2 * min_time * 1e9 / t) + 1;
+    }
+  }
+
+  Result r;
+  r.name = b.name;
+  r.iterations = n;
+  r.bytes = b.bytes;
+  r.mean_ns = 0;
+  for(int i = 0; i < repetitions; ++i)
+  {
+    double t = time_n(n) / n;
+    r.mean_ns += t / repetitions;
+    r.min_ns = i == 0 ? t : std::min(r.min_ns, t);
+    r.max_ns = i == 0 ? t : std::max(r.max_ns, t);
+  }
+  return r;
+}
+
+std::vector<Benchmark> make_benchmarks(const std::vector<size_t>& script_sizes, const std::string& workdir)
+{
+  std::vector<Benchmark> benchmarks;
+
+  // render()
+  for(size_t size : {1, 10, 100})
+  {
+    Context context;
+    for(size_t i = 0; i < size; ++i)
+      context["var" + std::to_string(i)] = "value" + std::to_string(i);
+    std::string line = "echo %var0% and some text that is not a template token %missing%";
+    benchmarks.push_back({"render/context_size:" + std::to_string(size), [context, line](size_t n) {
+      for(size_t i = 0; i < n; ++i)
+      {
+        auto r = render(line, context);
+        do_not_optimize(r);
+      }
+    }, line.size()});
+  }
+
+  // CommandParser::parse
+  {
+    auto parser = std::make_shared<CommandParser>();
+    for(auto line : {std::string("# RUN: echo hello world"), std::string("ls -l /some/directory/with/a/long/name")})
+    {
+      std::string kind = line[0] == '#' ? "command" : "plain";
+      benchmarks.push_back({"CommandParser::parse/" + kind, [parser, line](size_t n) {
+        for(size_t i = 0; i < n; ++i)
+        {
+          auto r = parser->parse(line);
+          do_not_optimize(r);
+        }
+      }, line.size()});
+    }
+  }
+
+  // CharTree::match
+  {
+    auto tree = std::make_shared<CharTree>();
+    for(auto k : {"\x7f", "\x1bOA", "\x1bOB", "\x1bOC", "\x1bOD", "\x1b[2~", "\x1bOH", "\x1b[5~", "\x1b[3~", "\x1bOF", "\x1b[6~"})
+      tree->add(k);
+    for(auto text : {std::string("\x1b[5~ rest"), std::string("plain text")})
+    {
+      std::string kind = text[0] == '\x1b' ? "hit" : "miss";
+      benchmarks.push_back({"CharTree::match/" + kind, [tree, text](size_t n) {
+        for(size_t i = 0; i < n; ++i)
+        {
+          auto r = tree->match(text.begin(), text.end());
+          do_not_optimize(r);
+        }
+      }});
+    }
+  }
+
+  // Keybindings::get
+  {
+    auto key_bindings = std::make_shared<Keybindings>();
+    benchmarks.push_back({"Keybindings::get/insert", [key_bindings](size_t n) {
+      InsertModeActions a;
+      for(size_t i = 0; i < n; ++i)
+      {
+        key_bindings->get(static_cast<int>(i % 128), a);
+        do_not_optimize(a);
+      }
+    }});
+    benchmarks.push_back({"Keybindings::get/command", [key_bindings](size_t n) {
+      CommandModeActions a;
+      for(size_t i = 0; i < n; ++i)
+      {
+        key_bindings->get(static_cast<int>(i % 128), a);
+        do_not_optimize(a);
+      }
+    }});
+  }
+
+  // SessionScript::load
+  for(size_t size : script_sizes)
+  {
+    std::string filename = workdir + "/script-" + std::to_string(size) + ".sh";
+    {
+      std::ofstream out(filename.c_str());
+      for(size_t i = 0; i < size; ++i)
+      {
+        if(i % 10 == 0)
+          out << "# COMMENT: section " << i << "\n";
+        else if(i % 10 == 5)
+          out << "echo %user% is running step " << i << "\n";
+        else
+          out << "ls -l /tmp/directory-" << i << "\n";
+      }
+    }
+    size_t bytes = boost::filesystem::file_size(filename);
+    benchmarks.push_back({"SessionScript::load/lines:" + std::to_string(size), [filename](size_t n) {
+      for(size_t i = 0; i < n; ++i)
+      {
+        SessionScript script;
+        script.context["user"] = "gsc";
+        script.load(filename);
+        do_not_optimize(script.lines);
+      }
+    }, bytes, true});
+    // with a warm persistent cache
+    std::string cache_dir = workdir + "/cache";
+    benchmarks.push_back({"SessionScript::load/cached/lines:" + std::to_string(size), [filename, cache_dir](size_t n) {
+      for(size_t i = 0; i < n; ++i)
+      {
+        SessionScript script;
+        script.cache_dir = cache_dir;
+        script.context["user"] = "gsc";
+        script.load(filename);
+        do_not_optimize(script.lines);
+      }
+    }, bytes, true});
+  }
+
+  // SessionScript::load with a 10 line #FOR block
+  for(size_t items : {100, 10000})
+  {
+    std::string filename = workdir + "/loop-" + std::to_string(items) + ".sh";
+    {
+      std::ofstream out(filename.c_str());
+      out << "#FOR: item in %items%\n";
+      for(size_t i = 0; i < 10; ++i)
+        out << "echo step " << i << " of %item%\n";
+      out << "#ENDFOR\n";
+    }
+    std::string list;
+    for(size_t i = 0; i < items; ++i)
+      list += "item" + std::to_string(i) + " ";
+    benchmarks.push_back({"SessionScript::load/loop_items:" + std::to_string(items), [filename, list](size_t n) {
+      for(size_t i = 0; i < n; ++i)
+      {
+        SessionScript script;
+        script.context["items"] = list;
+        script.load(filename);
+        do_not_optimize(script.lines);
+      }
+    }, 0, true});
+  }
+
+  // monitor state serialization
+  {
+    auto lines = std::make_shared<ScriptLines>();
+    for(size_t i = 0; i < 1000; ++i)
+      lines->push_back("echo line number " + std::to_string(i));
+    auto state = std::make_shared<SessionStatePublisher>();
+    SessionStateSnapshot snapshot;
+    snapshot.line = 500;
+    snapshot.character = 5;
+    snapshot.num_lines = lines->size();
+    state->publish(snapshot);
+    benchmarks.push_back({"to_json/monitor_state", [lines, state](size_t n) {
+      for(size_t i = 0; i < n; ++i)
+      {
+        auto r = to_json(state->read(), *lines);
+        do_not_optimize(r);
+      }
+    }});
+    // done by the main thread for every key typed
+    benchmarks.push_back({"SessionStatePublisher::publish", [state, snapshot](size_t n) {
+      SessionStateSnapshot s = snapshot;
+      for(size_t i = 0; i < n; ++i)
+      {
+        s.character = i;
+        state->publish(s);
+      }
+      do_not_optimize(s);
+    }});
+  }
+
+  // virtual screen. plain text and text with color and cursor movement.
+  {
+    std::string plain;
+    std::string colored;
+    for(size_t i = 0; plain.size() < 64*1024; ++i)
+    {
+      plain += "line " + std::to_string(i) + ": the quick brown fox jumps over the lazy dog\r\n";
+      colored += "\x1b[01;34mdir" + std::to_string(i) + "\x1b[0m  \x1b[01;32mrun.sh\x1b[0m  \x1b[2K\x1b[1Gfile.txt\r\n";
+    }
+    for(auto& kind : std::vector<std::pair<std::string, std::string>>{{"plain", plain}, {"colored", colored}})
+    {
+      auto screen = std::make_shared<VirtualScreen>(24, 80);
+      auto text = kind.second;
+      benchmarks.push_back({"VirtualScreen::process/" + kind.first, [screen, text](size_t n) {
+        for(size_t i = 0; i < n; ++i)
+          screen->process(text.data(), text.size());
+      }, text.size()});
+    }
+
+    auto screen = std::make_shared<VirtualScreen>(50, 200);
+    screen->process(colored.data(), colored.size());
+    benchmarks.push_back({"VirtualScreen::snapshot/50x200", [screen](size_t n) {
+      for(size_t i = 0; i < n; ++i)
+      {
+        auto s = screen->snapshot();
+        do_not_optimize(s);
+        // write to one row, so it is copied the next time
+        screen->process("x", 1);
+      }
+    }});
+  }
+
+  return benchmarks;
+}
+
+int main(int argc, char *argv[])
+{
+  po::options_description options("Benchmark options");
+  options.add_options()
+    ("help,h"       , "print help message")
+    ("list"         , "list benchmarks and exit.")
+    ("filter"       , po::value<std::string>()->default_value(".*"), "only run benchmarks with names matching this regex.")
+    ("min-time"     , po::value<double>()->default_value(0.2), "minimum number of seconds to run each measurement.")
+    ("repetitions"  , po::value<int>()->default_value(5), "number of measurements for each benchmark.")
+    ("script-lines" , po::value<std::vector<size_t>>()->multitoken(), "sizes of the synthetic scripts used for the load benchmarks. default is 10000 100000 1000000.")
+    ("json"         , po::value<std::string>(), "write results to this file in JSON format.")
+    ("label"        , po::value<std::string>()->default_value(""), "label stored with the JSON results. for example, a version or commit.")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+
+  if(vm.count("help"))
+  {
+    std::cout << options << std::endl;
+    return 0;
+  }
+
+  std::vector<size_t> script_sizes = {10000, 100000, 1000000};
+  if(vm.count("script-lines"))
+    script_sizes = vm["script-lines"].as<std::vector<size_t>>();
+
+  auto workdir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("gsc_bench-%%%%%%");
+  boost::filesystem::create_directories(workdir);
+
+  std::regex filter(vm["filter"].as<std::string>());
+  std::vector<Benchmark> benchmarks;
+  for(auto& b : make_benchmarks(script_sizes, workdir.string()))
+    if(std::regex_search(b.name, filter))
+      benchmarks.push_back(b);
+
+  if(vm.count("list"))
+  {
+    for(auto& b : benchmarks)
+      std::cout << b.name << "\n";
+    boost::filesystem::remove_all(workdir);
+    return 0;
+  }
+
+  double min_time = vm["min-time"].as<double>();
+  int repetitions = std::max(1, vm["repetitions"].as<int>());
+
+  std::cout << std::left << std::setw(40) << "Benchmark"
+            << std::right << std::setw(14) << "Iterations"
+            << std::setw(16) << "Mean (ns/op)"
+            << std::setw(16) << "Min (ns/op)"
+            << std::setw(12) << "MB/s"
+            << "\n";
+  std::cout << std::string(98, '=') << "\n";
+
+  std::vector<Result> results;
+  for(auto& b : benchmarks)
+  {
+    Result r = measure(b, min_time, repetitions);
+    results.push_back(r);
+    std::cout << std::left << std::setw(40) << r.name
+              << std::right << std::setw(14) << r.iterations
+              << std::setw(16) << std::fixed << std::setprecision(1) << r.mean_ns
+              << std::setw(16) << r.min_ns;
+    if(r.bytes > 0)
+      std::cout << std::setw(12) << r.bytes / r.mean_ns * 1e3;
+    std::cout << std::endl;
+  }
+
+  boost::filesystem::remove_all(workdir);
+
+  if(vm.count("json"))
+  {
+    boost::property_tree::ptree tree;
+    tree.put("label", vm["label"].as<std::string>());
+    tree.put("min_time", min_time);
+    tree.put("repetitions", repetitions);
+    boost::property_tree::ptree results_t;
+    for(auto& r : results)
+    {
+      boost::property_tree::ptree r_t;
+      r_t.put("name", r.name);
+      r_t.put("iterations", r.iterations);
+      r_t.put("mean_ns_per_op", r.mean_ns);
+      r_t.put("min_ns_per_op", r.min_ns);
+      r_t.put("max_ns_per_op", r.max_ns);
+      if(r.bytes > 0)
+        r_t.put("mb_per_s", r.bytes / r.mean_ns * 1e3);
+      results_t.push_back(std::make_pair("", r_t));
+    }
+    tree.add_child("benchmarks", results_t);
+
+    std::ofstream out(vm["json"].as<std::string>().c_str());
+    boost::property_tree::write_json(out, tree);
+  }
+
+  return 0;
+}
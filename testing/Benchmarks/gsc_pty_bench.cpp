@@ -0,0 +1,303 @@
+/** @file gsc_pty_bench.cpp
+  * @brief End-to-end benchmark of the Session I/O path.
+  *
+  * A Session is ran on a virtual terminal (a pseudo-terminal owned by the
+  * benchmark) with this executable standing in for the shell. Key presses
+  * are written to the virtual terminal and the time until the echoed
+  * character comes back out of the Session is measured. Bulk throughput
+  * is measured by asking the stand-in program to write a large block of
+  * output.
+  */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/log/core.hpp>
+#include <boost/program_options.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "Session.hpp"
+
+namespace po = boost::program_options;
+using clock_type = std::chrono::steady_clock;
+
+const char* child_env = "GSC_PTY_BENCH_CHILD";
+const char* bytes_env = "GSC_PTY_BENCH_BYTES";
+const std::string flood_command = "flood";
+const std::string flood_marker = "END-OF-FLOOD";
+
+/**
+ * The deterministic program ran in place of the shell. It ignores its
+ * input, except for the flood command, which makes it write a block of
+ * output followed by a marker.
+ */
+int child_main()
+{
+  size_t bytes = std::strtoull(getenv(bytes_env), NULL, 10);
+  std::string block;
+  for(int i = 0; block.size() < 64*1024; ++i)
+    block += "line " + std::to_string(i) + ": the quick brown fox jumps over the lazy dog\n";
+
+  std::string line;
+  while(std::getline(std::cin, line))
+  {
+    if(line != flood_command)
+      continue;
+    size_t n = 0;
+    while(n < bytes)
+    {
+      size_t m = std::min(block.size(), bytes - n);
+      if(write(1, block.data(), m) != static_cast<ssize_t>(m))
+        return 1;
+      n += m;
+    }
+    std::string end = flood_marker + "\n";
+    if(write(1, end.data(), end.size()) != static_cast<ssize_t>(end.size()))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * The terminal that the Session is presented on.
+ */
+struct VirtualTerminal
+{
+  int masterfd = -1;
+  int slavefd = -1;
+  std::string buffer; // output that has been read but not consumed
+
+  VirtualTerminal()
+  {
+    masterfd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(masterfd < 0 || grantpt(masterfd) != 0 || unlockpt(masterfd) != 0)
+      throw std::runtime_error("Could not open virtual terminal.");
+    slavefd = open(ptsname(masterfd), O_RDWR | O_NOCTTY);
+    if(slavefd < 0)
+      throw std::runtime_error("Could not open virtual terminal slave device.");
+    // the shell stand-in should not inherit the virtual terminal
+    fcntl(masterfd, F_SETFD, FD_CLOEXEC);
+    fcntl(slavefd, F_SETFD, FD_CLOEXEC);
+
+    winsize ws;
+    std::memset(&ws, 0, sizeof(ws));
+    ws.ws_row = 24;
+    ws.ws_col = 80;
+    ioctl(masterfd, TIOCSWINSZ, &ws);
+  }
+  ~VirtualTerminal()
+  {
+    close(slavefd);
+    close(masterfd);
+  }
+
+  void press(char c)
+  {
+    if(write(masterfd, &c, 1) != 1)
+      throw std::runtime_error("Could not write to virtual terminal.");
+  }
+
+  // read output until str has been seen. returns the number of bytes read.
+  size_t wait_for(const std::string& str, int timeout_ms = 10000)
+  {
+    char chunk[64*1024];
+    size_t total = 0;
+    auto deadline = clock_type::now() + std::chrono::milliseconds(timeout_ms);
+    for(;;)
+    {
+      size_t pos = buffer.find(str);
+      if(pos != std::string::npos)
+      {
+        buffer.erase(0, pos + str.size());
+        return total;
+      }
+      // only keep enough to match a marker that is split between reads
+      if(buffer.size() > str.size())
+        buffer.erase(0, buffer.size() - str.size());
+
+      int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_type::now()).count();
+      pollfd p;
+      p.fd = masterfd;
+      p.events = POLLIN;
+      if(remaining <= 0 || poll(&p, 1, remaining) <= 0)
+        throw std::runtime_error("Timed out waiting for '" + str + "' from the session.");
+      ssize_t n = read(masterfd, chunk, sizeof(chunk));
+      if(n <= 0)
+        throw std::runtime_error("Could not read from virtual terminal.");
+      buffer.append(chunk, n);
+      total += n;
+    }
+  }
+};
+
+double percentile(std::vector<double> v, double p)
+{
+  if(v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+  return v[i];
+}
+
+int main(int argc, char *argv[])
+{
+  if(getenv(child_env) != NULL)
+    return child_main();
+
+  po::options_description options("Benchmark options");
+  options.add_options()
+    ("help,h"      , "print help message")
+    ("keys"        , po::value<size_t>()->default_value(2000), "number of key presses used to measure latency.")
+    ("bytes"       , po::value<size_t>()->default_value(8*1024*1024), "number of bytes written by the program for each throughput measurement.")
+    ("repetitions" , po::value<int>()->default_value(3), "number of throughput measurements.")
+    ("json"        , po::value<std::string>(), "write results to this file in JSON format.")
+    ("label"       , po::value<std::string>()->default_value(""), "label stored with the JSON results. for example, a version or commit.")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+
+  if(vm.count("help"))
+  {
+    std::cout << options << std::endl;
+    return 0;
+  }
+
+  // the session logs to the console when no log file is setup
+  boost::log::core::get()->set_logging_enabled(false);
+
+  size_t keys = std::max<size_t>(1, vm["keys"].as<size_t>());
+  size_t bytes = vm["bytes"].as<size_t>();
+  int repetitions = std::max(1, vm["repetitions"].as<int>());
+
+  auto workdir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("gsc_pty_bench-%%%%%%");
+  boost::filesystem::create_directories(workdir);
+  std::string script_filename = (workdir / "script.sh").string();
+
+  // the first line is typed one key press at a time to measure latency.
+  // the other lines make the program flood the terminal.
+  std::string latency_line;
+  for(size_t i = 0; i < keys; ++i)
+    latency_line += 'a' + i % 26;
+  {
+    std::ofstream out(script_filename.c_str());
+    out << latency_line << "\n";
+    for(int i = 0; i < repetitions; ++i)
+      out << flood_command << "\n";
+  }
+
+  std::vector<double> latencies;
+  std::vector<double> throughputs;
+  int rc = 0;
+  try {
+    VirtualTerminal terminal;
+
+    setenv(child_env, "1", 1);
+    setenv(bytes_env, std::to_string(bytes).c_str(), 1);
+    Session session(script_filename, "/proc/self/exe", -1, terminal.slavefd, terminal.slavefd);
+    unsetenv(child_env);
+
+    std::thread runner([&session]() {
+      try {
+        session.run();
+      } catch(...) {
+      }
+    });
+
+    try {
+      for(size_t i = 0; i < keys; ++i)
+      {
+        auto start = clock_type::now();
+        terminal.press('b');
+        terminal.wait_for(std::string(1, latency_line[i]));
+        latencies.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - start).count());
+      }
+      terminal.press('\r');
+      terminal.wait_for("\r\n");
+
+      for(int i = 0; i < repetitions; ++i)
+      {
+        for(auto c : flood_command)
+        {
+          terminal.press('b');
+          terminal.wait_for(std::string(1, c));
+        }
+        auto start = clock_type::now();
+        terminal.press('\r');
+        size_t n = terminal.wait_for(flood_marker, 60000);
+        double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+        throughputs.push_back(n / seconds / 1e6);
+      }
+
+      terminal.press('\r');
+      terminal.wait_for("Press Enter.");
+      terminal.press('\r');
+    } catch(const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      rc = 1;
+      // make sure the session finishes
+      session.state.input_mode = UserInputMode::AUTO;
+      terminal.press('\r');
+      terminal.press('\r');
+    }
+    runner.join();
+  } catch(const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    rc = 2;
+  }
+
+  boost::filesystem::remove_all(workdir);
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "Keystroke to echo latency (" << latencies.size() << " keys)\n";
+  std::cout << "  p50:  " << percentile(latencies, 0.5) << " us\n";
+  std::cout << "  p99:  " << percentile(latencies, 0.99) << " us\n";
+  std::cout << "  p999: " << percentile(latencies, 0.999) << " us\n";
+  std::cout << "  max:  " << percentile(latencies, 1.0) << " us\n";
+  std::cout << "Output throughput (" << bytes << " bytes x " << throughputs.size() << ")\n";
+  std::cout << "  mean: " << (throughputs.empty() ? 0 : std::accumulate(throughputs.begin(), throughputs.end(), 0.0) / throughputs.size()) << " MB/s\n";
+  std::cout << "  min:  " << percentile(throughputs, 0.0) << " MB/s\n";
+  std::cout << "  max:  " << percentile(throughputs, 1.0) << " MB/s\n";
+
+  if(vm.count("json"))
+  {
+    boost::property_tree::ptree tree;
+    tree.put("label", vm["label"].as<std::string>());
+    tree.put("latency.keys", latencies.size());
+    tree.put("latency.p50_us", percentile(latencies, 0.5));
+    tree.put("latency.p99_us", percentile(latencies, 0.99));
+    tree.put("latency.p999_us", percentile(latencies, 0.999));
+    tree.put("latency.max_us", percentile(latencies, 1.0));
+    tree.put("throughput.bytes", bytes);
+    boost::property_tree::ptree mbs;
+    for(auto t : throughputs)
+    {
+      boost::property_tree::ptree v;
+      v.put("", t);
+      mbs.push_back(std::make_pair("", v));
+    }
+    tree.add_child("throughput.mb_per_s", mbs);
+
+    std::ofstream out(vm["json"].as<std::string>().c_str());
+    boost::property_tree::write_json(out, tree);
+  }
+
+  return rc;
+}
@@ -1,15 +1,39 @@
 #include "catch.hpp"
 
 #include "SessionScript.hpp"
+#include "ScriptBundle.hpp"
+#include "SessionState.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <thread>
 #include <boost/filesystem.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 
 #include "CharTree.hpp"
 
 #include "Keybindings.hpp"
 
+#include "Stats.hpp"
+
+#include "OutputFilter.hpp"
+
+#include "VirtualScreen.hpp"
+
+#include "OutputMatcher.hpp"
+
+#include "SlaveWriter.hpp"
+#include "OutputRing.hpp"
+#include "Broadcast.hpp"
+#include "Signals.hpp"
+#include "Checkpoint.hpp"
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 
 using namespace std;
 
@@ -74,6 +98,483 @@ TEST_CASE("Session Script")
     CHECK(script.lines[3] == "pwd");
   }
 
+  SECTION("Load File With Includes.")
+  {
+    boost::filesystem::create_directories("include-dir");
+    ofstream out("include-dir/snippet.sh");
+    out << "pwd" << endl;
+    out << "%cmd%" << endl;
+    out.close();
+
+    out.open("include-dir/main-script.sh");
+    out << "ls" << endl;
+    out << "#INCLUDE: snippet.sh" << endl;
+    out << "#INCLUDE: snippet.sh" << endl;
+    out << "who" << endl;
+    out.close();
+
+    SessionScript script;
+    script.context["cmd"] = "date";
+
+    script.load("include-dir/main-script.sh");
+
+    CHECK(script.lines.size() == 6);
+    CHECK(script.lines[0] == "ls");
+    CHECK(script.lines[1] == "pwd");
+    CHECK(script.lines[2] == "date");
+    CHECK(script.lines[3] == "pwd");
+    CHECK(script.lines[4] == "date");
+    CHECK(script.lines[5] == "who");
+
+    SECTION("cached files are re-rendered when the context changes")
+    {
+      script.lines.clear();
+      script.context["cmd"] = "id";
+      script.load("include-dir/main-script.sh");
+
+      CHECK(script.lines.size() == 6);
+      CHECK(script.lines[2] == "id");
+      CHECK(script.lines[4] == "id");
+    }
+
+    SECTION("cached files are reloaded when an included file changes")
+    {
+      out.open("include-dir/snippet.sh");
+      out << "pwd -P" << endl;
+      out << "%cmd%" << endl;
+      out.close();
+
+      script.lines.clear();
+      script.commands.clear();
+      script.load("include-dir/main-script.sh");
+
+      CHECK(script.lines.size() == 6);
+      CHECK(script.lines[1] == "pwd -P");
+      CHECK(script.lines[3] == "pwd -P");
+    }
+  }
+
+  SECTION("Include cycles throw.")
+  {
+    ofstream out("cycle-a.sh");
+    out << "ls" << endl;
+    out << "#INCLUDE: cycle-b.sh" << endl;
+    out.close();
+    out.open("cycle-b.sh");
+    out << "#INCLUDE: cycle-a.sh" << endl;
+    out.close();
+
+    SessionScript script;
+    CHECK_THROWS_WITH( script.load("cycle-a.sh"), Catch::Contains("cycle-a.sh -> ") );
+  }
+
+  SECTION("Script Bundles.")
+  {
+    ofstream out("bundle-script.sh");
+    out << "ls" << endl;
+    out << "# RUN: echo %msg%" << endl;
+    out << "echo 50% %msg%%n%" << endl;
+    out << "%cmd%" << endl;
+    out << "# PAUSE: 10" << endl;
+    out.close();
+
+    SessionScript compiled;
+    compiled.load("bundle-script.sh");
+    compiled.save_bundle("bundle-script.gscb");
+
+    CHECK(!is_script_bundle("bundle-script.sh"));
+    CHECK(is_script_bundle("bundle-script.gscb"));
+
+    SessionScript expected, script;
+    expected.context["msg"] = "hi";
+    expected.context["n"] = "1";
+    expected.context["cmd"] = "#EXIT";
+    script.context = expected.context;
+
+    expected.load("bundle-script.sh");
+    script.load("bundle-script.gscb");
+
+    CHECK(script.lines == expected.lines);
+    REQUIRE(script.lines.size() == 5);
+    CHECK(script.lines[2] == "echo 50% hi1");
+    for(size_t i = 0; i < script.lines.size(); ++i)
+      CHECK(script.command(i) == expected.command(i));
+    CHECK(script.command(1)->second == "echo hi");
+    CHECK(script.command(3)->first == "EXIT");
+    CHECK(!script.command(0));
+
+    SECTION("corrupt bundles throw")
+    {
+      fstream f("bundle-script.gscb", ios::in | ios::out | ios::binary);
+      f.seekp(-3, ios::end);
+      f.put('X');
+      f.close();
+      SessionScript script;
+      CHECK_THROWS( script.load("bundle-script.gscb") );
+    }
+
+    SECTION("bundles render the same as text")
+    {
+      ofstream out("bundle-overlap.sh");
+      out << "echo %a%b%" << endl;
+      out << "echo %b%a%" << endl;
+      out << "x%v%y" << endl;
+      out << "plain" << endl;
+      out.close();
+      SessionScript compiled;
+      compiled.load("bundle-overlap.sh");
+      compiled.save_bundle("bundle-overlap.gscb");
+
+      for(Context context : {Context{{"b", "B"}}, Context{{"a", "A"}, {"b", "B"}}, Context{{"v", "$&"}}, Context{{"v", "%a%"}, {"a", "1"}}})
+      {
+        SessionScript text, bundle;
+        text.context = bundle.context = context;
+        text.load("bundle-overlap.sh");
+        bundle.load("bundle-overlap.gscb");
+        CHECK(bundle.lines == text.lines);
+      }
+
+      // tags are regexes, and a line can match them without containing them
+      out.open("bundle-overlap.sh");
+      out << "echo {{a}}" << endl;
+      out.close();
+      SessionScript escaped;
+      escaped.render_stag = "\\{\\{";
+      escaped.render_etag = "\\}\\}";
+      escaped.load("bundle-overlap.sh");
+      escaped.save_bundle("bundle-overlap.gscb");
+      SessionScript text, bundle;
+      text.render_stag = bundle.render_stag = escaped.render_stag;
+      text.render_etag = bundle.render_etag = escaped.render_etag;
+      text.context = bundle.context = {{"a", "A"}};
+      text.load("bundle-overlap.sh");
+      bundle.load("bundle-overlap.gscb");
+      CHECK(text.lines == std::vector<std::string>{"echo A"});
+      CHECK(bundle.lines == text.lines);
+    }
+  }
+
+  SECTION("Script Cache.")
+  {
+    boost::filesystem::remove_all("script-cache");
+    boost::filesystem::create_directories("cached-script");
+    ofstream out("cached-script/main.sh");
+    out << "echo %msg%" << endl;
+    out << "#INCLUDE: part.sh" << endl;
+    out << "# PAUSE: 10" << endl;
+    out.close();
+    out.open("cached-script/part.sh");
+    out << "ls %dir%" << endl;
+    out.close();
+
+    SessionScript first;
+    first.cache_dir = "script-cache";
+    first.context = {{"msg", "hi"}, {"dir", "/tmp"}};
+    first.load("cached-script/main.sh");
+    REQUIRE( first.lines.size() == 3 );
+    CHECK( first.lines[1] == "ls /tmp" );
+    size_t entries = std::distance(boost::filesystem::directory_iterator("script-cache"), boost::filesystem::directory_iterator());
+    CHECK( entries == 2 );
+
+    // a second load is served from the cache
+    SessionScript second;
+    second.cache_dir = "script-cache";
+    second.context = first.context;
+    second.load("cached-script/main.sh");
+    CHECK( second.lines == first.lines );
+    for(size_t i = 0; i < second.lines.size(); ++i)
+      CHECK( second.command(i) == first.command(i) );
+
+    // a different context is a different entry
+    SessionScript other;
+    other.cache_dir = "script-cache";
+    other.context = {{"msg", "bye"}, {"dir", "/tmp"}};
+    other.load("cached-script/main.sh");
+    CHECK( other.lines[0] == "echo bye" );
+    entries = std::distance(boost::filesystem::directory_iterator("script-cache"), boost::filesystem::directory_iterator());
+    CHECK( entries == 4 );
+
+    // changing an included file invalidates the entry
+    out.open("cached-script/part.sh");
+    out << "ls -l %dir%" << endl;
+    out.close();
+    SessionScript changed;
+    changed.cache_dir = "script-cache";
+    changed.context = first.context;
+    changed.load("cached-script/main.sh");
+    CHECK( changed.lines[1] == "ls -l /tmp" );
+
+    // the entries contain the context, so only the user can read them
+    auto perms = [](const boost::filesystem::path& p) { return boost::filesystem::status(p).permissions() & boost::filesystem::perms_mask; };
+    CHECK( perms("script-cache") == boost::filesystem::owner_all );
+    for(auto& f : boost::filesystem::directory_iterator("script-cache"))
+      CHECK( perms(f.path()) == (boost::filesystem::owner_read|boost::filesystem::owner_write) );
+
+    // entries that haven't been used for too long are removed when a new
+    // one is written
+    std::time_t old = std::time(nullptr) - 3600;
+    for(auto& f : boost::filesystem::directory_iterator("script-cache"))
+      boost::filesystem::last_write_time(f.path(), old);
+    SessionScript aged;
+    aged.cache_dir = "script-cache";
+    aged.cache_max_age = 60;
+    aged.context = {{"msg", "aaa"}, {"dir", "/tmp"}};
+    aged.load("cached-script/main.sh");
+    entries = std::distance(boost::filesystem::directory_iterator("script-cache"), boost::filesystem::directory_iterator());
+    CHECK( entries == 2 );
+
+    // and the least recently used ones when the cache is too big
+    uintmax_t size = 0;
+    for(auto& f : boost::filesystem::directory_iterator("script-cache"))
+      size += boost::filesystem::file_size(f.path());
+    for(auto& f : boost::filesystem::directory_iterator("script-cache"))
+      boost::filesystem::last_write_time(f.path(), std::time(nullptr) - 10);
+    SessionScript full;
+    full.cache_dir = "script-cache";
+    full.cache_max_bytes = size + size / 2;
+    full.context = {{"msg", "bbb"}, {"dir", "/tmp"}};
+    full.load("cached-script/main.sh");
+    entries = std::distance(boost::filesystem::directory_iterator("script-cache"), boost::filesystem::directory_iterator());
+    CHECK( entries == 2 );
+    for(auto& f : boost::filesystem::directory_iterator("script-cache"))
+    {
+      std::ifstream in(f.path().string());
+      std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+      if(f.path().extension() == ".gscb")
+        CHECK( contents.find("echo bbb") != std::string::npos );
+    }
+
+    boost::filesystem::remove_all("script-cache");
+    boost::filesystem::remove_all("cached-script");
+  }
+
+  SECTION("Parallel Loading.")
+  {
+    boost::filesystem::create_directories("parallel-script");
+    ofstream out("parallel-script/main.sh");
+    for(int i = 0; i < 500; ++i)
+    {
+      out << "echo %msg% " << i << endl;
+      if(i % 7 == 0)
+        out << "# PAUSE: %delay%" << endl;
+      if(i % 97 == 0)
+        out << "#INCLUDE: part.sh" << endl;
+      if(i % 53 == 0)
+        out << endl;
+    }
+    // no newline at the end of the file
+    out << "last line";
+    out.close();
+    out.open("parallel-script/part.sh");
+    out << "ls %dir%" << endl;
+    out << "#RUN: date" << endl;
+    out.close();
+
+    Context context = {{"msg", "hi"}, {"dir", "/tmp"}, {"delay", "5"}};
+    SessionScript sequential;
+    sequential.context = context;
+    sequential.load_threads = 1;
+    sequential.load("parallel-script/main.sh");
+    CHECK( sequential.lines.back() == "last line" );
+
+    // chunk boundaries land on every kind of line
+    for(size_t chunk_bytes : {1, 7, 64, 1000, 100000})
+    {
+      SessionScript parallel;
+      parallel.context = context;
+      parallel.load_threads = 8;
+      parallel.load_chunk_bytes = chunk_bytes;
+      parallel.load("parallel-script/main.sh");
+      CHECK( parallel.lines == sequential.lines );
+      REQUIRE( parallel.lines.size() == sequential.lines.size() );
+      for(size_t i = 0; i < parallel.lines.size(); ++i)
+        CHECK( parallel.command(i) == sequential.command(i) );
+    }
+
+    boost::filesystem::remove_all("parallel-script");
+  }
+
+  SECTION("Conditionals and Loops.")
+  {
+    ofstream out("directive-script.sh");
+    out << "#IF: cloud" << endl;
+    out << "deploy %cloud%" << endl;
+    out << "#ELSE" << endl;
+    out << "deploy local" << endl;
+    out << "#ENDIF" << endl;
+    out << "#FOR: env in %envs%" << endl;
+    out << "#LABEL: %env%" << endl;
+    out << "#IF: env=prod" << endl;
+    out << "#FOR: step in build, test" << endl;
+    out << "make %step% ENV=%env%" << endl;
+    out << "#ENDFOR" << endl;
+    out << "#ELSE" << endl;
+    out << "echo %env% %cloud%" << endl;
+    out << "#ENDIF" << endl;
+    out << "#ENDFOR" << endl;
+    out << "#IF: !missing" << endl;
+    out << "done" << endl;
+    out << "#ENDIF" << endl;
+    out.close();
+
+    SessionScript script;
+    script.context["cloud"] = "aws";
+    script.context["envs"] = "dev prod";
+    script.load("directive-script.sh");
+
+    std::vector<std::string> expected = {"deploy aws",
+                                         "#LABEL: dev", "echo dev aws",
+                                         "#LABEL: prod", "make build ENV=prod", "make test ENV=prod",
+                                         "done"};
+    CHECK( script.lines == expected );
+    REQUIRE( script.commands.size() == script.lines.size() );
+    CHECK( script.label("prod") == 3u );
+    CHECK( !script.command(4) );
+
+    script.lines.clear();
+    script.commands.clear();
+    script.context.erase("cloud");
+    script.context["envs"] = "";
+    script.load("directive-script.sh");
+    expected = {"deploy local", "done"};
+    CHECK( script.lines == expected );
+
+    SECTION("bundles are expanded when they are loaded")
+    {
+      SessionScript compiled;
+      compiled.expand_directives = false;
+      compiled.load("directive-script.sh");
+      compiled.save_bundle("directive-script.gscb");
+
+      SessionScript bundle, source;
+      bundle.context = source.context = {{"cloud", "gcp"}, {"envs", "prod"}};
+      bundle.load("directive-script.gscb");
+      source.load("directive-script.sh");
+      CHECK( bundle.lines == source.lines );
+      CHECK( bundle.lines.size() == 5 );
+    }
+
+    SECTION("directive arguments are rendered like lines")
+    {
+      // a value with a '$', a variable name with a regex character and tags
+      // with regex characters all go through the regex render()
+      out.open("directive-script.sh");
+      out << "#FOR: x in a$$b" << endl;
+      out << "#FOR: y in %x%" << endl;
+      out << "#IF: y=a$b" << endl;
+      out << "echo %x% %y%" << endl;
+      out << "#ENDIF" << endl;
+      out << "#ENDFOR" << endl;
+      out << "#ENDFOR" << endl;
+      out << "#FOR: c.d in p" << endl;
+      out << "#FOR: y in %cxd%" << endl;
+      out << "echo %cxd% %y%" << endl;
+      out << "#ENDFOR" << endl;
+      out << "#ENDFOR" << endl;
+      out.close();
+
+      SessionScript dollar;
+      dollar.load("directive-script.sh");
+      expected = {"echo a$b a$b", "echo p p"};
+      CHECK( dollar.lines == expected );
+
+      out.open("directive-script.sh");
+      out << "#FOR: x in a b" << endl;
+      out << "#FOR: y in {{x}}" << endl;
+      out << "echo {{x}}{{y}}" << endl;
+      out << "#ENDFOR" << endl;
+      out << "#ENDFOR" << endl;
+      out.close();
+
+      SessionScript braces;
+      // the tags are regexes, so the braces are escaped
+      braces.render_stag = "\\{\\{";
+      braces.render_etag = "\\}\\}";
+      braces.load("directive-script.sh");
+      expected = {"echo aa", "echo bb"};
+      CHECK( braces.lines == expected );
+    }
+
+    SECTION("unbalanced blocks throw")
+    {
+      SessionScript script;
+      out.open("unbalanced-script-1.sh");
+      out << "#FOR: x in a b" << endl;
+      out << "#IF: x" << endl;
+      out << "#ENDFOR" << endl;
+      out.close();
+      CHECK_THROWS_WITH( script.load("unbalanced-script-1.sh"), Catch::Contains("#IF without #ENDIF") );
+
+      out.open("unbalanced-script-2.sh");
+      out << "#FOR: x a b" << endl;
+      out << "#ENDFOR" << endl;
+      out.close();
+      CHECK_THROWS_WITH( script.load("unbalanced-script-2.sh"), Catch::Contains("Invalid #FOR") );
+
+      out.open("unbalanced-script-3.sh");
+      out << "#ELSE" << endl;
+      out.close();
+      CHECK_THROWS_WITH( script.load("unbalanced-script-3.sh"), Catch::Contains("#ELSE without #IF") );
+    }
+  }
+
+  SECTION("Navigation Index.")
+  {
+    SessionScript script;
+    script.lines = {"#LABEL: setup", "ls", "#PAUSE: 10", "#COMMENT: x", "pwd", "#LABEL:  build ", "make", "#WAIT"};
+
+    CHECK( script.label("setup") == 0u );
+    CHECK( script.label("build") == 5u );
+    CHECK( !script.label("missing") );
+
+    CHECK( !script.previous_typeable_line(0) );
+    CHECK( script.previous_typeable_line(1) == 1u );
+    CHECK( script.previous_typeable_line(3) == 1u );
+    CHECK( script.previous_typeable_line(7) == 6u );
+    CHECK( script.next_typeable_line(0) == 1u );
+    CHECK( script.next_typeable_line(2) == 4u );
+    CHECK( !script.next_typeable_line(7) );
+
+    CHECK( script.search("pw", 0) == 4u );
+    CHECK( script.search("LABEL", 0) == 5u );
+    // wraps around
+    CHECK( script.search("LABEL", 5) == 0u );
+    CHECK( script.search("ls", 4, false) == 1u );
+    CHECK( script.search("make", 6, false) == 6u );
+    CHECK( !script.search("missing", 0) );
+    CHECK( !script.search("", 0) );
+
+    // the index is rebuilt when the script is reloaded, even if the number
+    // of lines doesn't change
+    ofstream out("reload-script.sh");
+    out << "#IF: first" << endl;
+    out << "#LABEL: start" << endl;
+    out << "ls" << endl;
+    out << "#ELSE" << endl;
+    out << "ls" << endl;
+    out << "#LABEL: start" << endl;
+    out << "#ENDIF" << endl;
+    out.close();
+    SessionScript reloaded;
+    reloaded.context["first"] = "1";
+    reloaded.load("reload-script.sh");
+    CHECK( reloaded.label("start") == 0u );
+    CHECK( reloaded.next_typeable_line(0) == 1u );
+    reloaded.lines.clear();
+    reloaded.commands.clear();
+    reloaded.context.erase("first");
+    reloaded.load("reload-script.sh");
+    REQUIRE( reloaded.lines.size() == 2 );
+    CHECK( reloaded.label("start") == 1u );
+    CHECK( reloaded.next_typeable_line(0) == 0u );
+    CHECK( reloaded.previous_typeable_line(1) == 0u );
+    CHECK( !reloaded.next_typeable_line(1) );
+
+    // the index is rebuilt when the script changes
+    script.lines.push_back("#LABEL: end");
+    CHECK( script.label("end") == 8u );
+  }
+
   SECTION("Render Script Lines.")
   {
 
@@ -96,6 +597,63 @@ TEST_CASE("Session Script")
     CHECK(script.lines[0] == "first");
     CHECK(script.lines[1] == "2");
     CHECK(script.lines[2] == "3");
+
+    // Renderer gives the same result, without a regex when it can
+    for( auto line : {"echo %second% %third% %missing%", "50% of %second%%third%", "plain"} )
+    {
+      Renderer renderer(script.context);
+      CHECK( renderer.render(line) == render(line, script.context) );
+    }
+    Context angle = {{"x", "1"}};
+    CHECK( Renderer(angle, "<<", ">>").render("a <<x>> b") == "a 1 b" );
+
+    // including the cases where it falls back to the regex
+    Context chained = {{"a", "%b%"}, {"b", "x"}, {"c.d", "y"}, {"e", "$$"}};
+    for( auto line : {"%a% %b% %cxd% %c.d%", "%e%", "50% of %a%%b%", "plain"} )
+    {
+      Renderer renderer(chained);
+      CHECK( renderer.render(line) == render(line, chained) );
+      Context simple = {{"a", "%b%"}, {"b", "x"}};
+      Renderer simple_renderer(simple);
+      CHECK( simple_renderer.render(line) == render(line, simple) );
+    }
+    Context dollar = {{"x", "a$$b"}, {"y", "$&"}};
+    for( auto line : {"{{x}} {{y}}", "{x} {{x}}}"} )
+    {
+      Renderer renderer(dollar, "\\{\\{", "\\}\\}");
+      CHECK( renderer.render(line) == render(line, dollar, "\\{\\{", "\\}\\}") );
+    }
+  }
+
+  SECTION("Script Lines.")
+  {
+    ScriptLines lines = {"one", "", "three"};
+    std::string long_line(100000, 'x');
+    for(int i = 0; i < 1000; ++i)
+      lines.push_back("line " + std::to_string(i));
+    lines.push_back(long_line);
+    REQUIRE( lines.size() == 1004 );
+    CHECK( lines[1] == "" );
+    CHECK( lines[500] == "line 497" );
+    CHECK( lines.back() == long_line );
+
+    // copies share the text, and keep it alive
+    ScriptLines copy;
+    {
+      ScriptLines original = lines;
+      original.push_back("only in original");
+      copy.append(original, 1000, original.size());
+      copy.push_back("only in copy");
+      lines.clear();
+    }
+    REQUIRE( copy.size() == 6 );
+    CHECK( copy[0] == "line 997" );
+    CHECK( copy[3] == long_line );
+    CHECK( copy[4] == "only in original" );
+    CHECK( copy[5] == "only in copy" );
+
+    copy.truncate(2);
+    CHECK( (copy == std::vector<std::string>{"line 997", "line 998"}) );
   }
 }
 
@@ -183,6 +741,792 @@ TEST_CASE("Keybindings")
 
 }
 
+TEST_CASE("Histogram")
+{
+  Histogram h;
+
+  CHECK( h.count() == 0 );
+  CHECK( h.percentile(0.5) == 0 );
+
+  for(int i = 1; i <= 1000; ++i)
+    h.record(i*1000);
+
+  CHECK( h.count() == 1000 );
+  CHECK( h.min() == 1000 );
+  CHECK( h.max() == 1000000 );
+  CHECK( h.mean() == Approx(500500) );
+  // buckets have about 3% resolution
+  CHECK( h.percentile(0.5) == Approx(500000).epsilon(0.04) );
+  CHECK( h.percentile(0.99) == Approx(990000).epsilon(0.04) );
+  CHECK( h.percentile(1.0) == 1000000 );
+
+  h.record(-5);
+  CHECK( h.min() == 0 );
+}
+
+TEST_CASE("Output Filter")
+{
+  OutputFilter filter;
+  std::string out;
+
+  CHECK( filter.empty() );
+  CHECK_THROWS( filter.add_rule("nonsense") );
+  CHECK_THROWS( filter.add_rule("unknown:rule") );
+  CHECK_THROWS( filter.add_rule("suppress:(") );
+
+  SECTION("Literal redaction.")
+  {
+    filter.add_rule("redact:hunter2");
+    CHECK( !filter.empty() );
+
+    std::string in = "password is hunter2, really hunter2\n";
+    filter.process(in.data(), in.size(), out);
+    CHECK( out == "password is ****, really ****\n" );
+    CHECK( !filter.pending() );
+
+    // secret split across chunks
+    out.clear();
+    filter.process("my hun", 6, out);
+    CHECK( out == "my " );
+    CHECK( filter.pending() );
+    filter.process("ter2 ok", 7, out);
+    CHECK( out == "my **** ok" );
+
+    // partial secret is released on flush
+    out.clear();
+    filter.process("hunt", 4, out);
+    CHECK( out == "" );
+    filter.flush(out);
+    CHECK( out == "hunt" );
+    CHECK( !filter.pending() );
+
+    // escape sequences are passed through
+    out.clear();
+    std::string esc = "\x1b[31mhunter2\x1b[0m";
+    filter.process(esc.data(), esc.size(), out);
+    CHECK( out == "\x1b[31m****\x1b[0m" );
+  }
+
+  SECTION("Overlapping literals.")
+  {
+    filter.add_rule("redact:ab");
+    filter.add_rule("redact:bcdef");
+    filter.add_rule("redact:abc");
+    filter.add_rule("redact:bcdefg");
+
+    filter.process("xabcdefy", 8, out);
+    CHECK( out == "x****y" );
+    out.clear();
+    filter.process("zabcdefgz", 9, out);
+    CHECK( out == "z****z" );
+
+    // the masked range is held while a literal inside of it could still match
+    out.clear();
+    filter.process("xab", 3, out);
+    CHECK( out == "x" );
+    filter.process("cd", 2, out);
+    CHECK( out == "x" );
+    filter.process("efgh", 4, out);
+    CHECK( out == "x****h" );
+  }
+
+  SECTION("Line rules.")
+  {
+    filter.add_rule("suppress:^DEBUG");
+    filter.add_rule("replace:[0-9]+ ms=>N ms");
+    filter.add_rule("redact-regex:token=[a-z]+");
+
+    std::string in = "DEBUG: noise\ntook 12 ms\ntoken=abc\n";
+    filter.process(in.data(), in.size(), out);
+    CHECK( out == "took N ms\n****\n" );
+
+    // escape sequences in suppressed lines are kept
+    out.clear();
+    in = "\x1b[1mDEBUG\x1b[0m: bold\n";
+    filter.process(in.data(), in.size(), out);
+    CHECK( out == "\x1b[1m\x1b[0m" );
+
+    // incomplete lines are held until flushed
+    out.clear();
+    filter.process("$ ", 2, out);
+    CHECK( out == "" );
+    CHECK( filter.pending() );
+    filter.flush(out);
+    CHECK( out == "$ " );
+
+    // when the output goes idle, a match that could still grow is held
+    out.clear();
+    filter.process("my token=abc", 12, out);
+    CHECK( filter.idle_pending() );
+    filter.flush_idle(out);
+    CHECK( out == "my " );
+    CHECK( filter.pending() );
+    CHECK( !filter.idle_pending() );
+    filter.process("defgh\r\n", 7, out);
+    CHECK( out == "my ****\r\n" );
+
+    // so is a partial match
+    out.clear();
+    filter.process("tok", 3, out);
+    filter.flush_idle(out);
+    CHECK( out == "" );
+    filter.process("en=x\n", 5, out);
+    CHECK( out == "****\n" );
+
+    // prompts are released
+    out.clear();
+    filter.process("$ ", 2, out);
+    filter.flush_idle(out);
+    CHECK( out == "$ " );
+    CHECK( !filter.pending() );
+
+    // a copy that is reset filters other output without changing the
+    // state of the original
+    out.clear();
+    filter.process("DEBUG \x1b[3", 9, out);
+    OutputFilter copy = filter;
+    copy.reset();
+    std::string repaint;
+    copy.process("$ token=x\n", 10, repaint);
+    CHECK( repaint == "$ ****\n" );
+    CHECK( !copy.pending() );
+    filter.process("1mtoken=x\n", 10, out);
+    CHECK( out == "\x1b[31m" );
+  }
+
+  SECTION("Long lines.")
+  {
+    filter.max_line_length = 10;
+    filter.add_rule("redact:hunter2");
+    filter.add_rule("redact-regex:token=[a-z]+");
+
+    // a match that could still grow is held when a long line is flushed
+    filter.process("0123456token=ab", 15, out);
+    CHECK( out == "0123456" );
+    filter.process("cd\n", 3, out);
+    CHECK( out == "0123456****\n" );
+
+    // so is a literal
+    out.clear();
+    filter.process("0123456789hun", 13, out);
+    CHECK( out == "0123456789" );
+    filter.process("ter2\n", 5, out);
+    CHECK( out == "0123456789****\n" );
+  }
+
+  SECTION("String sequences.")
+  {
+    filter.add_rule("redact:host1");
+    filter.add_rule("replace:[0-9]+ ms=>N ms");
+    filter.add_rule("suppress:secret");
+
+    // window titles are filtered
+    std::string in = "\x1b]0;user@host1:~\x07$ ";
+    filter.process(in.data(), in.size(), out);
+    filter.flush(out);
+    CHECK( out == "\x1b]0;user@****:~\x07$ " );
+
+    out.clear();
+    in = "\x1b]2;took 5 ms\x1b\\\x1bP+q host1\x1b\\\n";
+    filter.process(in.data(), in.size(), out);
+    CHECK( out == "\x1b]2;took N ms\x1b\\\x1bP+q ****\x1b\\\n" );
+
+    // and held until they are terminated
+    out.clear();
+    filter.process("\x1b]0;ho", 6, out);
+    filter.flush(out);
+    CHECK( out == "" );
+    filter.process("st1\x07\n", 5, out);
+    CHECK( out == "\x1b]0;****\x07\n" );
+
+    // suppressed sequences are dropped
+    out.clear();
+    in = "\x1b]0;secret\x07ok\n";
+    filter.process(in.data(), in.size(), out);
+    CHECK( out == "ok\n" );
+
+    // control sequences are passed through
+    out.clear();
+    in = "\x1b[31mhost1\x1b[0m\n";
+    filter.process(in.data(), in.size(), out);
+    CHECK( out == "\x1b[31m****\x1b[0m\n" );
+
+    // an unterminated sequence is dropped once it is too long, and the
+    // output after it is filtered again
+    out.clear();
+    filter.max_escape_length = 16;
+    in = "\x1b]0;" + std::string(20, 'a') + "host1\n";
+    filter.process(in.data(), in.size(), out);
+    CHECK( out == std::string(7, 'a') + "****\n" );
+  }
+}
+
+TEST_CASE("Virtual Screen")
+{
+  VirtualScreen screen(5, 10);
+  auto feed = [&screen](const std::string& s) { screen.process(s.data(), s.size()); };
+
+  CHECK( sizeof(ScreenCell) == 8 );
+
+  SECTION("Text and wrapping.")
+  {
+    feed("$ ls\r\nabcdefghijklm");
+    auto snap = screen.snapshot();
+    CHECK( snap.row_text(0) == "$ ls" );
+    CHECK( snap.row_text(1) == "abcdefghij" );
+    CHECK( snap.row_text(2) == "klm" );
+    CHECK( snap.cursor_row == 2 );
+    CHECK( snap.cursor_col == 3 );
+
+    // scrolling
+    feed("\r\n1\r\n2\r\n3");
+    snap = screen.snapshot();
+    CHECK( snap.row_text(0) == "abcdefghij" );
+    CHECK( snap.row_text(4) == "3" );
+
+    // utf-8 split between chunks
+    feed("\r\n\xc3");
+    feed("\xa9!");
+    CHECK( screen.snapshot().row_text(4) == "\xc3\xa9!" );
+  }
+
+  SECTION("Escape sequences.")
+  {
+    // escape sequence split between chunks
+    feed("hello\x1b[");
+    feed("1;3Hx\x1b[31my");
+    auto snap = screen.snapshot();
+    CHECK( snap.row_text(0) == "hexyo" );
+    CHECK( snap.lines[0]->at(2).attrs == 0 );
+    CHECK( snap.lines[0]->at(3).fg == 1 );
+    CHECK( (snap.lines[0]->at(3).attrs & ScreenCell::FG) );
+
+    feed("\x1b[0m\x1b[2J\x1b[Habc\x1b[1D\x1b[K");
+    snap = screen.snapshot();
+    CHECK( snap.text() == "ab\n\n\n\n\n" );
+
+    // window titles are ignored
+    feed("\x1b]0;title\x07z");
+    CHECK( screen.snapshot().row_text(0) == "abz" );
+
+    // alternate screen
+    feed("\x1b[?1049h\x1b[Hvim");
+    CHECK( screen.snapshot().row_text(0) == "vim" );
+    feed("\x1b[?1049l");
+    CHECK( screen.snapshot().row_text(0) == "abz" );
+  }
+
+  SECTION("Snapshots and dirty rows.")
+  {
+    feed("one\r\ntwo");
+    auto snap = screen.snapshot();
+    feed("\r\x1b[Kthree");
+    auto snap2 = screen.snapshot();
+
+    // snapshots don't change
+    CHECK( snap.row_text(1) == "two" );
+    CHECK( snap2.row_text(1) == "three" );
+    // unchanged rows are shared
+    CHECK( snap.lines[0] == snap2.lines[0] );
+    CHECK( snap.lines[1] != snap2.lines[1] );
+    CHECK( snap2.dirty_rows(snap.generation) == std::vector<int>{1} );
+
+    screen.resize(3, 4);
+    snap = screen.snapshot();
+    CHECK( snap.rows == 3 );
+    CHECK( snap.cols == 4 );
+    CHECK( snap.row_text(0) == "one" );
+    CHECK( snap.row_text(1) == "thre" );
+    CHECK( snap.cursor_col == 3 );
+  }
+
+  SECTION("Repaint.")
+  {
+    feed("plain\r\n\x1b[1;31mbold red\x1b[0m and \x1b[38;5;200mpink");
+    auto snap = screen.snapshot();
+
+    VirtualScreen copy(5, 10);
+    copy.process("garbage\x1b[", 10);
+    std::string repaint = to_ansi(snap);
+    copy.process(repaint.data(), repaint.size());
+    auto snap2 = copy.snapshot();
+
+    CHECK( snap2.text() == snap.text() );
+    CHECK( snap2.cursor_row == snap.cursor_row );
+    CHECK( snap2.cursor_col == snap.cursor_col );
+    for(int r = 0; r < snap.rows; ++r)
+      CHECK( *snap2.lines[r] == *snap.lines[r] );
+    CHECK( snap2.cursor_pen == snap.cursor_pen );
+  }
+}
+
+TEST_CASE("Output Matcher")
+{
+  OutputMatcher matcher;
+  matcher.enabled = true;
+  auto feed = [&matcher](const std::string& s) { matcher.feed(s.data(), s.size()); };
+  auto soon = []() { return OutputMatcher::clock::now() + std::chrono::milliseconds(50); };
+
+  feed("$ ls\r\n\x1b[01;34mdir\x1b[0m  file.txt\r\n$ ");
+  CHECK( matcher.wait_for(std::regex("^dir +file"), soon()) );
+  // matched output is consumed
+  CHECK( !matcher.wait_for(std::regex("dir"), soon()) );
+  CHECK( matcher.unmatched() == std::vector<std::string>{"$ "} );
+
+  // the rest of the line is ignored after a mark (the echo of the command)
+  matcher.mark();
+  feed("echo hi\r\nhi\r\n");
+  CHECK( !matcher.wait_for(std::regex("echo"), soon()) );
+  CHECK( matcher.wait_for(std::regex("^hi$"), soon()) );
+
+  // output arriving while waiting
+  std::thread writer([&feed]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    feed("do");
+    feed("ne\r\n");
+  });
+  CHECK( matcher.wait_for(std::regex("^done$"), OutputMatcher::clock::now() + std::chrono::seconds(5)) );
+  writer.join();
+
+  SECTION("Captures.")
+  {
+    std::string value;
+    matcher.mark();
+    feed("create\r\ncreated id: 4f2a");
+    // the line isn't complete, so the id may not be either
+    CHECK( !matcher.capture(std::regex("id: (\\w+)"), soon(), value) );
+    feed("9c\r\n$ ");
+    CHECK( matcher.capture(std::regex("id: (\\w+)"), soon(), value) );
+    CHECK( value == "4f2a9c" );
+
+    // the whole match is used if there are no groups
+    feed("\r\nversion 1.2.3\r\n");
+    CHECK( matcher.capture(std::regex("[0-9.]+"), soon(), value) );
+    CHECK( value == "1.2.3" );
+  }
+}
+
+TEST_CASE("Slave Writer")
+{
+  int fds[2];
+  REQUIRE( pipe(fds) == 0 );
+  SessionStats stats;
+  SlaveWriter writer;
+  writer.fd = fds[1];
+  writer.stats = &stats;
+
+  auto read_back = [&fds]() {
+    char buffer[256];
+    int n = read(fds[0], buffer, sizeof(buffer));
+    return std::string(buffer, n > 0 ? n : 0);
+  };
+
+  writer.put('l');
+  writer.put("s -l\n");
+  CHECK( writer.buffered() == 6 );
+  CHECK( writer.flush() == 6 );
+  CHECK( writer.buffered() == 0 );
+  CHECK( read_back() == "ls -l\r" );
+  CHECK( stats.slave_writes == 1 );
+
+  CHECK( writer.write_lines({"PS1='$ '", "", "cd /tmp"}) == 18 );
+  CHECK( read_back() == "PS1='$ '\r\rcd /tmp\r" );
+  CHECK( stats.slave_writes == 2 );
+  CHECK( stats.slave_bytes_written == 24 );
+
+  SECTION("Output is queued when the fd would block.")
+  {
+    int wakeup[2];
+    REQUIRE( pipe(wakeup) == 0 );
+    writer.wakeup_fd = wakeup[1];
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    std::vector<std::string> payload;
+    for(int i = 0; i < 1000; ++i)
+      payload.push_back("echo " + std::string(200, 'a' + i % 26));
+    size_t size = 1000 * 206;
+
+    CHECK( writer.write_lines(payload) == size );
+    CHECK( writer.pending() > 0 );
+    CHECK( !writer.wait_until_below(0, std::chrono::milliseconds(1)) );
+    // characters are queued behind the lines
+    writer.put("x");
+    writer.flush();
+
+    char c;
+    CHECK( read(wakeup[0], &c, 1) == 1 );
+
+    std::string received;
+    char buffer[4096];
+    while(writer.pending() > 0)
+    {
+      int n;
+      while((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+        received.append(buffer, n);
+      writer.drain();
+    }
+    int n;
+    while((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+      received.append(buffer, n);
+
+    CHECK( writer.wait_until_below(0, std::chrono::milliseconds(1)) );
+    REQUIRE( received.size() == size + 1 );
+    CHECK( received.substr(0, 206) == "echo " + std::string(200, 'a') + "\r" );
+    CHECK( received.substr(size - 206, 206) == "echo " + std::string(200, 'a' + 999 % 26) + "\r" );
+    CHECK( received.back() == 'x' );
+
+    close(wakeup[0]);
+    close(wakeup[1]);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_CASE("Output Ring")
+{
+  SessionStats stats;
+  char buffer[64];
+  auto pop_all = [&buffer](OutputRing& ring) {
+    std::string out;
+    int n;
+    while((n = ring.pop(buffer, sizeof(buffer), std::chrono::milliseconds(0))) > 0)
+      out.append(buffer, n);
+    return out;
+  };
+
+  SECTION("Block.")
+  {
+    OutputRing ring(8);
+    CHECK( ring.push("abcdef", 6) );
+    CHECK( ring.size() == 6 );
+    CHECK( ring.pop(buffer, 4, std::chrono::milliseconds(0)) == 4 );
+    // wraps around the end of the buffer
+    CHECK( ring.push("ghijkl", 6) );
+    CHECK( pop_all(ring) == "efghijkl" );
+
+    // a push larger than the ring waits for the reader
+    std::thread reader([&]() {
+      std::string out;
+      char b[4];
+      int n;
+      while((n = ring.pop(b, sizeof(b), std::chrono::milliseconds(100))) >= 0)
+        out.append(b, n);
+      CHECK( out == "0123456789abcdefghij" );
+    });
+    CHECK( ring.push("0123456789abcdefghij", 20) );
+    ring.close();
+    reader.join();
+    CHECK( !ring.push("x", 1) );
+  }
+
+  SECTION("Drop.")
+  {
+    OutputRing ring(8, OverflowPolicy::DROP);
+    ring.stats = &stats;
+    CHECK( ring.push("abcdef", 6) );
+    CHECK( !ring.dropping() );
+    CHECK( ring.push("ghijkl", 6) );
+    CHECK( ring.dropping() );
+    CHECK( ring.empty() );
+    CHECK( ring.push("mn", 2) );
+    // output that may not be dropped is kept
+    CHECK( ring.push("!", 1, false) );
+    CHECK( stats.stdout_dropped_bytes == 14 );
+    CHECK( pop_all(ring) == "!" );
+    ring.end_drop();
+    CHECK( ring.push("op", 2) );
+    CHECK( pop_all(ring) == "op" );
+  }
+
+  SECTION("Spill.")
+  {
+    OutputRing ring(8, OverflowPolicy::SPILL);
+    ring.stats = &stats;
+    std::string in;
+    for(int i = 0; i < 100; ++i)
+    {
+      std::string chunk = std::to_string(i) + ",";
+      in += chunk;
+      CHECK( ring.push(chunk.data(), chunk.size()) );
+    }
+    CHECK( stats.stdout_spilled_bytes > 0 );
+    CHECK( ring.size() == in.size() );
+    CHECK( pop_all(ring) == in );
+
+    // back to using the ring after catching up
+    uint64_t spilled = stats.stdout_spilled_bytes;
+    CHECK( ring.push("abc", 3) );
+    CHECK( stats.stdout_spilled_bytes == spilled );
+    CHECK( pop_all(ring) == "abc" );
+
+    // the spill file is read while output is still being spilled
+    in.clear();
+    for(int i = 0; i < 20000; ++i)
+      in += std::to_string(i) + ",";
+    std::thread writer([&]() {
+      for(size_t i = 0; i < in.size(); i += 7)
+        ring.push(in.data() + i, std::min<size_t>(7, in.size() - i));
+      ring.close();
+    });
+    std::string out;
+    char buf[5];
+    int n;
+    while((n = ring.pop(buf, sizeof(buf), std::chrono::milliseconds(100))) >= 0)
+      out.append(buf, n);
+    writer.join();
+    CHECK( out == in );
+  }
+}
+
+TEST_CASE("Broadcast Hub")
+{
+  std::string path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("gsc-broadcast-%%%%%%.sock")).string();
+  BroadcastHub hub;
+  hub.listen_unix(path);
+  hub.start();
+
+  auto connect_viewer = [&path]() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    REQUIRE( connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 );
+    return fd;
+  };
+  // read until the output ends with text, or nothing arrives for a second
+  auto read_until = [](int fd, const std::string& text) {
+    std::string out;
+    char buffer[4096];
+    pollfd p{fd, POLLIN, 0};
+    while(!boost::algorithm::ends_with(out, text) && poll(&p, 1, 1000) > 0)
+    {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if(n <= 0)
+        break;
+      out.append(buffer, n);
+    }
+    return out;
+  };
+  auto wait_for_resync = [&hub]() {
+    for(int i = 0; i < 200 && !hub.needs_resync(); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return hub.needs_resync();
+  };
+
+  SECTION("New viewers start with a repaint.")
+  {
+    int a = connect_viewer();
+    REQUIRE( wait_for_resync() );
+    hub.resync("<screen>");
+    hub.publish("abc", 3);
+    CHECK( read_until(a, "<screen>abc") == "<screen>abc" );
+
+    int b = connect_viewer();
+    REQUIRE( wait_for_resync() );
+    hub.publish("def", 3);
+    hub.resync("<screen2>");
+    hub.publish("ghi", 3);
+    CHECK( read_until(a, "defghi") == "defghi" );
+    CHECK( read_until(b, "<screen2>ghi") == "<screen2>ghi" );
+    CHECK( hub.num_viewers() == 2 );
+
+    close(b);
+    hub.publish("jkl", 3);
+    CHECK( read_until(a, "jkl") == "jkl" );
+    for(int i = 0; i < 200 && hub.num_viewers() > 1; ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    CHECK( hub.num_viewers() == 1 );
+    close(a);
+  }
+
+  SECTION("Slow viewers are resynced.")
+  {
+    hub.capacity = 4096;
+    int a = connect_viewer();
+    REQUIRE( wait_for_resync() );
+    hub.resync("");
+
+    // publish more than the socket can hold while the viewer isn't reading
+    std::string chunk(1024, 'x');
+    for(int i = 0; i < 4096 && !hub.needs_resync(); ++i)
+    {
+      hub.publish(chunk.data(), chunk.size());
+      if(i % 64 == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE( hub.needs_resync() );
+    hub.resync("<screen>");
+    hub.publish("abc", 3);
+    std::string out = read_until(a, "<screen>abc");
+    CHECK( boost::algorithm::ends_with(out, "<screen>abc") );
+    CHECK( out.find_first_not_of('x') == out.size() - 11 );
+    close(a);
+  }
+
+  hub.stop();
+}
+
+TEST_CASE("Signals")
+{
+  Signals::watch(SIGUSR1);
+  Signals::drain();
+  CHECK( !Signals::take(SIGUSR1) );
+
+  raise(SIGUSR1);
+  raise(SIGUSR1);
+  pollfd p{Signals::fd(), POLLIN, 0};
+  CHECK( poll(&p, 1, 1000) == 1 );
+  Signals::drain();
+  CHECK( poll(&p, 1, 0) == 0 );
+  // a burst of signals is taken once
+  CHECK( Signals::take(SIGUSR1) );
+  CHECK( !Signals::take(SIGUSR1) );
+  CHECK( !Signals::take(SIGUSR2) );
+
+  Signals::unwatch(SIGUSR1);
+}
+
+TEST_CASE("Session State Publisher")
+{
+  SessionStatePublisher publisher;
+  SessionStateSnapshot snapshot = publisher.read();
+  CHECK( snapshot.num_lines == 0 );
+
+  snapshot.input_mode = UserInputMode::COMMAND;
+  snapshot.line = 2;
+  snapshot.character = 4;
+  snapshot.num_lines = 3;
+  publisher.publish(snapshot);
+  publisher.publish_window_size(40, 120);
+  snapshot = publisher.read();
+  CHECK( snapshot.input_mode == UserInputMode::COMMAND );
+  CHECK( snapshot.line == 2 );
+  CHECK( snapshot.character == 4 );
+  CHECK( snapshot.window_rows == 40 );
+  CHECK( snapshot.window_cols == 120 );
+
+  ScriptLines lines = {"echo one", "echo two", "echo three"};
+  std::string json = to_json(snapshot, lines);
+  CHECK( json.find("\"current line progress\": \"echo\"") != std::string::npos );
+  CHECK( json.find("\"next line\": \"None\"") != std::string::npos );
+
+  // readers never see a half published snapshot
+  snapshot.line = snapshot.character = snapshot.num_lines = 0;
+  publisher.publish(snapshot);
+  std::atomic<bool> done{false};
+  size_t torn = 0;
+  std::thread reader([&]() {
+    while(!done)
+    {
+      SessionStateSnapshot s = publisher.read();
+      if(s.line != s.character || s.line != s.num_lines)
+        ++torn;
+    }
+  });
+  for(size_t i = 0; i < 100000; ++i)
+  {
+    snapshot.line = snapshot.character = snapshot.num_lines = i;
+    publisher.publish(snapshot);
+  }
+  done = true;
+  reader.join();
+  CHECK( torn == 0 );
+
+  // captured variables are shared as immutable copies
+  auto captured = publisher.read_captured();
+  CHECK( captured->empty() );
+  publisher.publish_captured({{"id", "42"}});
+  CHECK( captured->empty() );
+  CHECK( publisher.read_captured()->at("id") == "42" );
+
+  // so is the script, so the session can change its own lines while
+  // monitors read the published ones
+  CHECK( publisher.read_lines()->empty() );
+  ScriptLines script = {"echo one"};
+  publisher.publish_lines(script);
+  auto published = publisher.read_lines();
+  script.push_back("echo two");
+  script.truncate(0);
+  CHECK( *published == std::vector<std::string>{"echo one"} );
+
+  // progress is cut from the rendered line that is being typed, since
+  // character counts the keys sent for it
+  publisher.publish_lines(ScriptLines{"cd %{dir}", "ls"});
+  publisher.publish_typed_line(0, "cd /tmp/build");
+  snapshot = SessionStateSnapshot();
+  snapshot.num_lines = 2;
+  snapshot.character = 8;
+  json = to_json(snapshot, *publisher.read_lines(), publisher.read_typed_line().get());
+  CHECK( json.find("\"current line\": \"cd \\/tmp\\/build\"") != std::string::npos );
+  CHECK( json.find("\"current line progress\": \"cd \\/tmp\\/\"") != std::string::npos );
+  // the typed line is only used for the line it was rendered from
+  snapshot.line = 1;
+  snapshot.character = 1;
+  json = to_json(snapshot, *publisher.read_lines(), publisher.read_typed_line().get());
+  CHECK( json.find("\"current line progress\": \"l\"") != std::string::npos );
+
+  // a snapshot published before the script was loaded shows no lines
+  snapshot = SessionStateSnapshot();
+  json = to_json(snapshot, *publisher.read_lines());
+  CHECK( json.find("\"current line\": \"None\"") != std::string::npos );
+}
+
+TEST_CASE("Checkpoint")
+{
+  Checkpoint checkpoint;
+  checkpoint.script = "/tmp/session.sh";
+  checkpoint.line = 12;
+  checkpoint.input_mode = UserInputMode::AUTO;
+  checkpoint.auto_pilot_mode = AutoPilotMode::SEMI;
+  checkpoint.output_mode = OutputMode::NONE;
+  checkpoint.context["NAME"] = "value with spaces";
+  checkpoint.captured["id"] = "4f2a9c";
+
+  checkpoint.save("test-checkpoint.json");
+  // the temporary file is renamed over the checkpoint
+  CHECK( boost::filesystem::exists("test-checkpoint.json") );
+  CHECK( !boost::filesystem::exists("test-checkpoint.json.tmp") );
+
+  // the checkpoint contains the context, so only the user can read it
+  CHECK( (boost::filesystem::status("test-checkpoint.json").permissions() & boost::filesystem::perms_mask) == (boost::filesystem::owner_read|boost::filesystem::owner_write) );
+
+  // a new checkpoint replaces the old one
+  checkpoint.line = 13;
+  checkpoint.save("test-checkpoint.json");
+
+  Checkpoint loaded = Checkpoint::load("test-checkpoint.json");
+  CHECK( loaded.script == "/tmp/session.sh" );
+  CHECK( loaded.line == 13 );
+  CHECK( loaded.input_mode == UserInputMode::AUTO );
+  CHECK( loaded.auto_pilot_mode == AutoPilotMode::SEMI );
+  CHECK( loaded.output_mode == OutputMode::NONE );
+  CHECK( loaded.context == checkpoint.context );
+  CHECK( loaded.captured == checkpoint.captured );
+
+  {
+    std::ofstream out("test-checkpoint.json");
+    out << "{\"script\": \"/tmp/session.sh\"";
+  }
+  CHECK_THROWS_AS( Checkpoint::load("test-checkpoint.json"), const std::runtime_error& );
+  CHECK_THROWS_AS( Checkpoint::load("missing-checkpoint.json"), const std::runtime_error& );
+  CHECK_THROWS_AS( checkpoint.save("missing-directory/checkpoint.json"), const std::runtime_error& );
+  boost::filesystem::remove("test-checkpoint.json");
+
+  // checkpoints are kept in a private directory, one for each session file
+  boost::filesystem::remove_all("test-state");
+  create_private_directory("test-state/gsc");
+  CHECK( (boost::filesystem::status("test-state/gsc").permissions() & boost::filesystem::perms_mask) == boost::filesystem::owner_all );
+  std::string name = Checkpoint::default_filename("test-state/gsc", "dir/session.sh");
+  CHECK( boost::starts_with(name, "test-state/gsc/session.sh-") );
+  CHECK( boost::ends_with(name, ".checkpoint") );
+  CHECK( name == Checkpoint::default_filename("test-state/gsc", "dir/../dir/session.sh") );
+  CHECK( name != Checkpoint::default_filename("test-state/gsc", "other/session.sh") );
+  boost::filesystem::remove_all("test-state");
+}
+
 int func_that_takes_char_by_ref( char& c )
 {
 	c = 'a';
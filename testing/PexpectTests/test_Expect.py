@@ -0,0 +1,29 @@
+import pexpect
+import pytest
+
+
+def test_ExpectPasses():
+  with open("script-expect-1.sh", "w") as f:
+    f.write("echo hello world\n");
+    f.write("#EXPECT: ^hello w.rld$\n");
+    f.write("printf '\\033[31mred\\033[0m text\\n'\n");
+    f.write("#EXPECT: red text\n");
+    f.write("#EXPECT_SCREEN: ^red text\n");
+
+  child = pexpect.spawn("""./gsc script-expect-1.sh --auto --auto-pause 1 --shell bash --no-monitor --expect-timeout 5000""",timeout=10)
+  child.expect(pexpect.EOF)
+  child.close()
+  assert child.exitstatus == 0
+
+
+def test_ExpectFailsWithDiff():
+  with open("script-expect-2.sh", "w") as f:
+    f.write("echo hello\n");
+    f.write("#EXPECT: goodbye\n");
+
+  child = pexpect.spawn("""./gsc script-expect-2.sh --auto --auto-pause 1 --shell bash --no-monitor --expect-timeout 3000""",timeout=10)
+  child.expect("#EXPECT failed on script line 2")
+  child.expect("-goodbye\r\n")
+  child.expect(pexpect.EOF)
+  child.close()
+  assert child.exitstatus == 4
@@ -1,5 +1,7 @@
+import os
 import pexpect
 import pytest
+import signal
 import time
 
 
@@ -200,22 +202,47 @@ def test_CommandModeQuit():
   child.close()
   assert child.exitstatus == 1
 
-def test_InsertModeQuit():
+def test_InsertModeInterrupt():
   with open("script-5.sh", "w") as f:
     f.write("echo\n");
 
-  child = pexpect.spawn("""./gsc script-5.sh --shell bash --no-monitor --setup-command='PS1="$>>> "'""",timeout=2)
+  child = pexpect.spawn("""./gsc script-5.sh --shell bash --no-monitor --setup-command='PS1="$>>> "'""",timeout=10)
+  # the setup command is echoed, and then the new prompt is printed
+  child.expect(r"\$>>> ")
+  child.expect(r"\$>>> ")
+  time.sleep(0.5)
 
+  # Ctl-C goes to the shell's foreground job (here, the shell itself),
+  # and doesn't type anything from the script. gsc keeps running.
+  child.send("")
+  child.expect(r"\^C")
+  with pytest.raises(pexpect.exceptions.TIMEOUT):
+    child.expect("e",timeout=1)
   assert child.isalive()
 
-  child.send("")
+  child.send("")
+  child.send("q")
   time.sleep(1)
-
   assert not child.isalive()
-
   child.close()
   assert child.exitstatus == 1
 
+@pytest.mark.parametrize("sig", [signal.SIGTERM, signal.SIGINT])
+def test_SignalExitStatus(sig):
+  with open("script-5.sh", "w") as f:
+    f.write("echo\n");
+
+  child = pexpect.spawn("""./gsc script-5.sh --shell bash --no-monitor --setup-command='PS1="$>>> "'""",timeout=10)
+  # the setup command is echoed, and then the new prompt is printed
+  child.expect(r"\$>>> ")
+  child.expect(r"\$>>> ")
+  time.sleep(0.5)
+
+  os.kill(child.pid, sig)
+  child.expect(pexpect.EOF, timeout=5)
+  child.close()
+  assert child.exitstatus == 128 + sig
+
 def test_SilenceOutput():
 
   with open("script-6.sh", "w") as f: